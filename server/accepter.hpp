@@ -1,22 +1,50 @@
 #pragma once
+#include <vector>
+#include <cerrno>
 #include "channel.hpp"
 #include "socket.hpp"
+#include "eventloop.hpp"
 
 class Accepter
 {
 public:
-    using acceptCallback = std::function<void(int)>;
+    // all fds accepted during one readiness event are delivered together
+    using acceptCallback = std::function<void(const std::vector<int>&)>;
+    static constexpr int kDefaultAcceptBudget = 64;
     Accepter(EventLoop* loop, uint16_t port, acceptCallback cb = nullptr)
-    : _socket(this->createServer(port))
+    : _loop(loop)
+    , _socket(this->createServer(port))
     , _channel(_socket.getFd(), loop)
     , _acceptCallback(std::move(cb))
+    , _acceptBudget(kDefaultAcceptBudget)
+    , _idleFd(::open("/dev/null", O_RDONLY | O_CLOEXEC))
     {
+        if(loop->poller()->completionIo())
+        {
+            _channel.setIoMode(Channel::kAccept);
+        }
         _channel.setReadCallback([this]{handleRead();});
     }
+    ~Accepter()
+    {
+        if(_idleFd >= 0)
+        {
+            ::close(_idleFd);
+        }
+    }
     void setAcceptCallback(const acceptCallback& cb)
     {
         _acceptCallback = cb;
     }
+    // max connections accepted per readiness event before yielding to other channels
+    void setAcceptBudget(int budget)
+    {
+        _acceptBudget = budget > 0 ? budget : 1;
+    }
+    EventLoop* getLoop() const {return _loop;}
+    // see Socket::steerByCpu; applies to the whole SO_REUSEPORT group
+    bool steerByCpu(const std::vector<int>& cpus) {return _socket.steerByCpu(cpus);}
+    // must be called in the owning loop thread
     void listen()
     {
         _channel.enableRead();
@@ -33,17 +61,59 @@ private:
     }
     void handleRead()
     {
-        int fd = _socket.accept();
-        if(fd != -1)
+        _accepted.clear();
+        for(int i = 0; i < _acceptBudget; i++)
         {
-            if(_acceptCallback)
+            int fd = _channel.ioMode() == Channel::kAccept ? _loop->poller()->takeAccepted(&_channel)
+                                                           : _socket.accept(SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd != -1)
+            {
+                _accepted.push_back(fd);
+                continue;
+            }
+            if(errno == EINTR || errno == ECONNABORTED)
             {
-                _acceptCallback(fd);
+                continue;
             }
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                // the pending connection would keep the listener readable forever,
+                // so give up the spare fd to accept it and close it right away
+                if(!dropPending())
+                {
+                    break;
+                }
+                continue;
+            }
+            // EAGAIN: backlog drained
+            break;
+        }
+        if(!_accepted.empty() && _acceptCallback)
+        {
+            _acceptCallback(_accepted);
+        }
+    }
+    bool dropPending()
+    {
+        if(_idleFd < 0)
+        {
+            return false;
+        }
+        ::close(_idleFd);
+        int fd = _socket.accept(SOCK_CLOEXEC);
+        if(fd != -1)
+        {
+            ::close(fd);
         }
+        _idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return fd != -1;
     }
 private:
+    EventLoop* _loop;
     Socket _socket;
     Channel _channel;
     acceptCallback _acceptCallback;
+    int _acceptBudget;
+    int _idleFd; // spare fd released when the process runs out of descriptors
+    std::vector<int> _accepted;
 };
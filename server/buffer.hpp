@@ -2,15 +2,51 @@
 #include <iostream>
 #include <vector>
 #include <mutex>
+#include <cerrno>
+#include <algorithm>
+#include <utility>
+#include <sys/uio.h>
+#include "bufferpool.hpp"
 
 class Buffer
 {
 public:
     explicit Buffer(std::size_t size = 1024)
-        : _buffer(size), _readIndex(0), _writeIndex(0) {}
+        : _pool(nullptr), _data(nullptr), _capacity(0), _readIndex(0), _writeIndex(0)
+    {
+        if(size > 0)
+        {
+            _data = BufferPool::allocate(_pool, size, _capacity);
+        }
+    }
+    // lazy: storage comes from pool when data arrives and goes back on shrink()
+    explicit Buffer(BufferPool* pool)
+        : _pool(pool), _data(nullptr), _capacity(0), _readIndex(0), _writeIndex(0) {}
     Buffer (const Buffer& buf) : Buffer() {Write(buf);}
+    Buffer (Buffer&& buf) noexcept
+        : _pool(buf._pool), _data(buf._data), _capacity(buf._capacity),
+          _readIndex(buf._readIndex), _writeIndex(buf._writeIndex)
+    {
+        buf._data = nullptr;
+        buf._capacity = 0;
+        buf._readIndex = 0;
+        buf._writeIndex = 0;
+    }
+    Buffer& operator=(Buffer buf) noexcept
+    {
+        std::swap(_pool, buf._pool);
+        std::swap(_data, buf._data);
+        std::swap(_capacity, buf._capacity);
+        std::swap(_readIndex, buf._readIndex);
+        std::swap(_writeIndex, buf._writeIndex);
+        return *this;
+    }
+    ~Buffer()
+    {
+        BufferPool::deallocate(_pool, _data, _capacity);
+    }
 
-    const char* readPos() const { return _buffer.data() + _readIndex; }
+    const char* readPos() const { return _data + _readIndex; }
     std::size_t readableSize() const { return _writeIndex - _readIndex; }
     std::size_t writeableSize() const {return backsize() + frontSize(); }
     bool moveReadIdx(std::size_t len)
@@ -91,15 +127,63 @@ public:
     {
         write(buf.readPos(), buf.readableSize(), push);
     }
+    // reads from fd with readv straight into the writable tail; a stack spill area catches
+    // whatever doesn't fit so one syscall still takes up to 64KB. Returns -1 with errno on failure
+    ssize_t readFd(int fd)
+    {
+        char extra[65536];
+        if(readableSize() == 0)
+        {
+            clear();
+        }
+        std::size_t writeable = backsize();
+        iovec vec[2];
+        vec[0].iov_base = writePos();
+        vec[0].iov_len = writeable;
+        vec[1].iov_base = extra;
+        vec[1].iov_len = sizeof(extra);
+        int iovcnt = writeable < sizeof(extra) ? 2 : 1;
+        ssize_t n;
+        do
+        {
+            n = ::readv(fd, vec, iovcnt);
+        } while(n == -1 && errno == EINTR);
+        if(n <= 0)
+        {
+            return n;
+        }
+        if(static_cast<std::size_t>(n) <= writeable)
+        {
+            _writeIndex += n;
+        }
+        else
+        {
+            _writeIndex = _capacity;
+            write(extra, n - writeable);
+        }
+        return n;
+    }
     void clear()
     {
         _readIndex = 0;
         _writeIndex = 0;
     }
+    // gives the storage back once everything has been read, so an idle owner holds none
+    void shrink()
+    {
+        if(readableSize() == 0 && _data != nullptr)
+        {
+            BufferPool::deallocate(_pool, _data, _capacity);
+            _data = nullptr;
+            _capacity = 0;
+            clear();
+        }
+    }
+    std::size_t capacity() const { return _capacity; }
 private:
-    char* writePos() {return _buffer.data() + _writeIndex;}
+    char* writePos() {return _data + _writeIndex;}
     std::size_t frontSize() const {return _readIndex;}
-    std::size_t backsize() const {return _buffer.size() - _writeIndex;}
+    std::size_t backsize() const {return _capacity - _writeIndex;}
 
     void ensureWriteable(std::size_t len)
     {
@@ -107,11 +191,19 @@ private:
         {
             if(len > writeableSize())
             {
-                _buffer.resize(_buffer.size() + len);
+                std::size_t readable = readableSize();
+                std::size_t capacity;
+                char* data = BufferPool::allocate(_pool, std::max(readable + len, _capacity * 2), capacity);
+                std::copy(readPos(), static_cast<const char*>(writePos()), data);
+                BufferPool::deallocate(_pool, _data, _capacity);
+                _data = data;
+                _capacity = capacity;
+                _readIndex = 0;
+                _writeIndex = readable;
             }
             else
             {
-                std::copy(readPos(), static_cast<const char*>(writePos()), _buffer.data());
+                std::copy(readPos(), static_cast<const char*>(writePos()), _data);
                 _writeIndex -= frontSize();
                 _readIndex = 0;
             }
@@ -130,7 +222,9 @@ private:
         return nullptr;
     }
 private:
-    std::vector<char> _buffer;
+    BufferPool* _pool;
+    char* _data;
+    std::size_t _capacity;
     std::size_t _readIndex;
     std::size_t _writeIndex;
 };
\ No newline at end of file
@@ -0,0 +1,190 @@
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+// Size-classed storage for Buffer and OutputQueue, one pool per EventLoop. Requests are
+// rounded up to a power of two between kMinClass and kMaxClass and served from per-class
+// free lists; larger ones go to the heap. Each class keeps at most kMaxCachedPerClass bytes
+// around, the rest is freed. With huge pages enabled (before the first allocation) classes
+// are carved from 2MB slabs mapped with MAP_HUGETLB, or transparent huge pages if none are
+// reserved; slab blocks are never returned to the system. Blocks may be freed from any
+// thread, e.g. when a Buffer moved to a worker is destroyed there.
+class BufferPool
+{
+public:
+    static constexpr std::size_t kMinClass = 512;
+    static constexpr std::size_t kMaxClass = 256 * 1024;
+    static constexpr int kClasses = 10; // kMinClass << (kClasses - 1) == kMaxClass
+    static constexpr std::size_t kMaxCachedPerClass = 4 * 1024 * 1024;
+    static constexpr std::size_t kSlabSize = 2 * 1024 * 1024;
+
+    struct Stats
+    {
+        std::size_t inUse = 0;      // bytes handed out
+        std::size_t highWater = 0;  // peak of inUse
+        std::size_t cached = 0;     // bytes on free lists
+        std::size_t slabs = 0;      // bytes mapped for huge page slabs
+    };
+
+    BufferPool() : _hugePages(false), _free{} {}
+    ~BufferPool()
+    {
+        if(_hugePages)
+        {
+            for(void* slab : _slabs)
+            {
+                ::munmap(slab, kSlabSize);
+            }
+            return;
+        }
+        for(int i = 0; i < kClasses; i++)
+        {
+            while(_free[i] != nullptr)
+            {
+                FreeBlock* block = _free[i];
+                _free[i] = block->next;
+                ::operator delete(block);
+            }
+        }
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // no effect once anything has been allocated
+    void enableHugePages()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_stats.inUse == 0 && _stats.cached == 0)
+        {
+            _hugePages = true;
+        }
+    }
+    // returns at least size bytes; capacity receives the usable size to pass back to deallocate
+    char* allocate(std::size_t size, std::size_t& capacity)
+    {
+        int cls = classOf(size);
+        capacity = cls < 0 ? size : kMinClass << cls;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.inUse += capacity;
+        if(_stats.inUse > _stats.highWater)
+        {
+            _stats.highWater = _stats.inUse;
+        }
+        if(cls < 0)
+        {
+            return static_cast<char*>(::operator new(capacity));
+        }
+        if(_free[cls] == nullptr)
+        {
+            if(!_hugePages)
+            {
+                return static_cast<char*>(::operator new(capacity));
+            }
+            refill(cls);
+        }
+        FreeBlock* block = _free[cls];
+        _free[cls] = block->next;
+        _cachedBytes[cls] -= capacity;
+        _stats.cached -= capacity;
+        return reinterpret_cast<char*>(block);
+    }
+    void deallocate(char* p, std::size_t capacity)
+    {
+        if(p == nullptr)
+        {
+            return;
+        }
+        int cls = classOf(capacity);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.inUse -= capacity;
+        if(cls < 0 || (!_hugePages && _cachedBytes[cls] + capacity > kMaxCachedPerClass))
+        {
+            ::operator delete(p);
+            return;
+        }
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(p);
+        block->next = _free[cls];
+        _free[cls] = block;
+        _cachedBytes[cls] += capacity;
+        _stats.cached += capacity;
+    }
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats;
+    }
+    // storage helpers for owners that may have no pool
+    static char* allocate(BufferPool* pool, std::size_t size, std::size_t& capacity)
+    {
+        if(pool != nullptr)
+        {
+            return pool->allocate(size, capacity);
+        }
+        capacity = size;
+        return static_cast<char*>(::operator new(size));
+    }
+    static void deallocate(BufferPool* pool, char* p, std::size_t capacity)
+    {
+        if(pool != nullptr)
+        {
+            pool->deallocate(p, capacity);
+            return;
+        }
+        ::operator delete(p);
+    }
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+    // class index for size, -1 if it is larger than kMaxClass
+    static int classOf(std::size_t size)
+    {
+        if(size > kMaxClass)
+        {
+            return -1;
+        }
+        int cls = 0;
+        while((kMinClass << cls) < size)
+        {
+            cls++;
+        }
+        return cls;
+    }
+    void refill(int cls)
+    {
+        void* slab = ::mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(slab == MAP_FAILED)
+        {
+            slab = ::mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(slab == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+            ::madvise(slab, kSlabSize, MADV_HUGEPAGE);
+        }
+        _slabs.push_back(slab);
+        _stats.slabs += kSlabSize;
+        std::size_t size = kMinClass << cls;
+        for(std::size_t off = kSlabSize; off >= size; off -= size)
+        {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(static_cast<char*>(slab) + off - size);
+            block->next = _free[cls];
+            _free[cls] = block;
+        }
+        _cachedBytes[cls] += kSlabSize;
+        _stats.cached += kSlabSize;
+    }
+private:
+    mutable std::mutex _mutex;
+    bool _hugePages;
+    FreeBlock* _free[kClasses];
+    std::size_t _cachedBytes[kClasses] = {};
+    std::vector<void*> _slabs;
+    Stats _stats;
+};
@@ -8,3 +8,8 @@ void Channel::remove()
 {
     _loop->removeEvent(this);
 }
+
+bool Channel::ownedByCurrentThread() const
+{
+    return _loop->isInLoopThread();
+}
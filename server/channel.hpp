@@ -9,7 +9,11 @@ class Channel
 {
 public:
     using callback_t = std::function<void()>;
-    Channel(int fd, EventLoop* loop) : _fd(fd), _events(0), _revents(0), _loop(loop){}
+    // who does the I/O when the poller supports completions, see Poller::completionIo
+    static constexpr int kReadiness = 0; // the poller reports readiness, the owner reads and writes
+    static constexpr int kAccept = 1;    // the poller accepts, see Poller::takeAccepted
+    static constexpr int kRecv = 2;      // the poller receives and sends, see Poller::takeReceived
+    Channel(int fd, EventLoop* loop) : _fd(fd), _events(0), _revents(0), _registered(false), _index(-1), _ioMode(kReadiness), _loop(loop){}
     ~Channel() = default;
     void setReadCallback(callback_t cb) { _readCallback = std::move(cb); }
     void setWriteCallback(callback_t cb) { _writeCallback = std::move(cb); }
@@ -19,17 +23,46 @@ public:
     void setRevents(int revents) { _revents = revents; }
     int getFd() const {return _fd;}
     int getEvents() const {return _events;}
+    // registration state with the loop's poller, maintained by the Poller backend
+    bool isRegistered() const {return _registered;}
+    void setRegistered(bool on) {_registered = on;}
+    int getIndex() const {return _index;}
+    void setIndex(int index) {_index = index;}
+    // only while unregistered; a poller without completions treats every mode as kReadiness
+    void setIoMode(int mode) {_ioMode = mode;}
+    int ioMode() const {return _ioMode;}
     bool readable() const {return _events & EPOLLIN;}
     bool writable() const {return _events & EPOLLOUT;}
-    void enableRead() {_events |= EPOLLIN; update();}
-    void disableRead() {_events &= ~EPOLLIN; update();}
+    bool edgeTriggered() const {return _events & EPOLLET;}
+    // takes effect with the next enable/disable call; in edge-triggered mode the owner
+    // must drain the fd until EAGAIN because readiness is only reported on changes
+    void setEdgeTriggered(bool on) {on ? _events |= EPOLLET : _events &= ~EPOLLET;}
+    void enableRead()
+    {
+        _events |= EPOLLIN;
+        if(edgeTriggered())
+        {
+            _events |= EPOLLRDHUP;
+        }
+        update();
+    }
+    void disableRead() {_events &= ~(EPOLLIN | EPOLLRDHUP); update();}
     void enableWrite() {_events |= EPOLLOUT; update();}
     void disableWrite() {_events &= ~EPOLLOUT; update();}
-    void disableAll() {_events = 0; update();}
+    void disableAll() {_events &= EPOLLET; update();}
     void update();
     void remove();
+    // only while unregistered, when the owner moves to another loop
+    void setLoop(EventLoop* loop) {_loop = loop;}
+    EventLoop* getLoop() const {return _loop;}
+    bool ownedByCurrentThread() const;
     void handleEvent()
     {
+        // events collected before a move to another loop are dropped
+        if(!ownedByCurrentThread())
+        {
+            return;
+        }
         // EPOLLIN:  有数据可读
         // EPOLLPRI: 有紧急数据可读
         // EPOLLOUT: 有数据可写
@@ -50,7 +83,8 @@ public:
                 _errorCallback();
             }
         }
-        else if(_revents & EPOLLOUT)
+        // EPOLLERR also signals MSG_ZEROCOPY completions, which must not swallow a write edge
+        if(_revents & EPOLLOUT)
         {
             if(_writeCallback)
             {
@@ -74,6 +108,9 @@ private:
     int _fd;
     int _events;
     int _revents;
+    bool _registered;
+    int _index; // backend-private slot, e.g. the io_uring poll request
+    int _ioMode;
     EventLoop* _loop;
 
     callback_t _readCallback;
@@ -0,0 +1,296 @@
+#pragma once
+#include <algorithm>
+#include <any>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <functional>
+#include "connect.hpp"
+
+enum class FrameFormat
+{
+    K_VARINT,   // LEB128 length, at most 10 bytes
+    K_U16,      // big-endian 16-bit length
+    K_U32,      // big-endian 32-bit length
+    K_DELIMITER // frame runs up to a delimiter, which is consumed but not delivered
+};
+
+// Splits a connection's input into frames and hands each one to the frame callback as a view
+// into the input buffer, valid only during the call. Incomplete frames stay buffered until the
+// rest arrives. A frame over maxFrame or a malformed length reports to the error callback,
+// drops the input and shuts the connection down. One codec can serve every connection of a
+// server: server.setMessageCallback(codec.messageCallback()). An input high watermark below
+// minInputHighWater() ends connections whose frame is still arriving, see
+// Connection::setInputHighWaterMark. In delimiter mode a connection with no context of its own
+// keeps how far the search got in its context, so a frame arriving in pieces is scanned once.
+class FrameCodec
+{
+public:
+    using ptrConnection = Connection::ptrConnection;
+    using frameCallback = std::function<void(const ptrConnection&, std::string_view)>;
+    using errorCallback = std::function<void(const ptrConnection&)>;
+    static constexpr size_t kDefaultMaxFrame = 16 * 1024 * 1024;
+    static constexpr size_t kMaxVarintBytes = 10;
+
+    FrameCodec(FrameFormat format, frameCallback cb, size_t maxFrame = kDefaultMaxFrame)
+    : _format(format), _maxFrame(maxFrame), _frameCb(std::move(cb)) {}
+    FrameCodec(std::string delimiter, frameCallback cb, size_t maxFrame = kDefaultMaxFrame)
+    : _format(FrameFormat::K_DELIMITER), _delimiter(std::move(delimiter)), _maxFrame(maxFrame), _frameCb(std::move(cb))
+    {
+        if(_delimiter.empty())
+        {
+            _delimiter = "\n";
+        }
+    }
+    void setErrorCallback(const errorCallback& cb) {_errorCb = cb;}
+    // most input an accepted frame can leave buffered while incomplete, plus one
+    size_t minInputHighWater() const
+    {
+        switch(_format)
+        {
+        case FrameFormat::K_VARINT:
+            return kMaxVarintBytes + _maxFrame;
+        case FrameFormat::K_U16:
+            return 2 + _maxFrame;
+        case FrameFormat::K_U32:
+            return 4 + _maxFrame;
+        default:
+            return _maxFrame + _delimiter.size();
+        }
+    }
+    Connection::messageCallback messageCallback()
+    {
+        return [this](const ptrConnection& conn, Buffer* buf){onMessage(conn, buf);};
+    }
+    void onMessage(const ptrConnection& conn, Buffer* buf)
+    {
+        // stops when the frame callback closes or pauses the connection; resuming re-delivers the rest
+        size_t scanned = takeScanned(conn, buf);
+        while(conn->isConnected() && !conn->readingPaused() && buf->readableSize() > 0)
+        {
+            size_t header = 0;
+            size_t length = 0;
+            size_t trailer = 0;
+            int r = _format == FrameFormat::K_DELIMITER
+                  ? findDelimited(buf->readPos(), buf->readableSize(), scanned, length, trailer)
+                  : parseHeader(buf->readPos(), buf->readableSize(), header, length);
+            if(r == kIncomplete)
+            {
+                // the next read resumes the delimiter search where this one stopped
+                saveScanned(conn, buf, scanned);
+                return;
+            }
+            if(r == kMalformed || length > _maxFrame)
+            {
+                break;
+            }
+            if(buf->readableSize() - header < length + trailer)
+            {
+                return;
+            }
+            _frameCb(conn, std::string_view(buf->readPos() + header, length));
+            buf->moveReadIdx(header + length + trailer);
+        }
+        if(!conn->isConnected())
+        {
+            // closing: nothing more is parsed
+            buf->moveReadIdx(buf->readableSize());
+            return;
+        }
+        if(conn->readingPaused() || buf->readableSize() == 0)
+        {
+            return;
+        }
+        buf->moveReadIdx(buf->readableSize());
+        if(_errorCb)
+        {
+            _errorCb(conn);
+        }
+        conn->shutdown();
+    }
+    // writes the header for a payload of length bytes into out (at least kMaxVarintBytes),
+    // returns its size; 0 for K_DELIMITER or a length the format can't carry
+    static size_t encodeHeader(FrameFormat format, size_t length, char* out)
+    {
+        switch(format)
+        {
+        case FrameFormat::K_VARINT:
+        {
+            size_t n = 0;
+            do
+            {
+                uint8_t byte = length & 0x7f;
+                length >>= 7;
+                out[n++] = static_cast<char>(length > 0 ? byte | 0x80 : byte);
+            } while(length > 0);
+            return n;
+        }
+        case FrameFormat::K_U16:
+            if(length > UINT16_MAX)
+            {
+                return 0;
+            }
+            out[0] = static_cast<char>(length >> 8);
+            out[1] = static_cast<char>(length);
+            return 2;
+        case FrameFormat::K_U32:
+            if(length > UINT32_MAX)
+            {
+                return 0;
+            }
+            for(int i = 0; i < 4; i++)
+            {
+                out[i] = static_cast<char>(length >> (24 - 8 * i));
+            }
+            return 4;
+        default:
+            return 0;
+        }
+    }
+    // frames payload in this codec's format; the header or delimiter and the payload leave as
+    // one message without being joined first, see Connection::send(first, second)
+    bool send(const ptrConnection& conn, std::string_view payload) const
+    {
+        if(payload.size() > _maxFrame)
+        {
+            return false;
+        }
+        if(_format == FrameFormat::K_DELIMITER)
+        {
+            conn->send(payload, _delimiter);
+            return true;
+        }
+        char header[kMaxVarintBytes];
+        size_t n = encodeHeader(_format, payload.size(), header);
+        if(n == 0)
+        {
+            return false;
+        }
+        conn->send(std::string_view(header, n), payload);
+        return true;
+    }
+private:
+    static constexpr int kComplete = 0;
+    static constexpr int kIncomplete = 1;
+    static constexpr int kMalformed = 2;
+
+    // how far the delimiter search got in a partial frame, kept in the connection's context
+    // while the application leaves that empty. position is where the input started in the
+    // stream then; if anything consumed input since, the search starts over
+    struct ScanState
+    {
+        uint64_t position = 0;
+        size_t scanned = 0;
+    };
+    static uint64_t inputPosition(const ptrConnection& conn, const Buffer* buf)
+    {
+        return conn->bytesRead() - buf->readableSize();
+    }
+    static size_t takeScanned(const ptrConnection& conn, const Buffer* buf)
+    {
+        ScanState* state = std::any_cast<ScanState>(conn->getContext());
+        if(state == nullptr || state->scanned == 0)
+        {
+            return 0;
+        }
+        size_t scanned = state->position == inputPosition(conn, buf) ? state->scanned : 0;
+        state->scanned = 0;
+        return scanned;
+    }
+    static void saveScanned(const ptrConnection& conn, const Buffer* buf, size_t scanned)
+    {
+        std::any* context = conn->getContext();
+        ScanState* state = std::any_cast<ScanState>(context);
+        if(state == nullptr)
+        {
+            // nothing to keep, or the context is the application's and searches start from the front
+            if(scanned == 0 || context->has_value())
+            {
+                return;
+            }
+            *context = ScanState();
+            state = std::any_cast<ScanState>(context);
+        }
+        state->position = inputPosition(conn, buf);
+        state->scanned = scanned;
+    }
+    int parseHeader(const char* data, size_t size, size_t& header, size_t& length) const
+    {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        switch(_format)
+        {
+        case FrameFormat::K_VARINT:
+        {
+            uint64_t value = 0;
+            for(size_t i = 0; i < kMaxVarintBytes; i++)
+            {
+                if(i == size)
+                {
+                    return kIncomplete;
+                }
+                value |= static_cast<uint64_t>(p[i] & 0x7f) << (7 * i);
+                if((p[i] & 0x80) == 0)
+                {
+                    header = i + 1;
+                    length = static_cast<size_t>(value);
+                    return kComplete;
+                }
+                if(value > _maxFrame)
+                {
+                    // already too long, no need to wait for the rest of the header
+                    length = SIZE_MAX;
+                    return kComplete;
+                }
+            }
+            return kMalformed;
+        }
+        case FrameFormat::K_U16:
+            if(size < 2)
+            {
+                return kIncomplete;
+            }
+            header = 2;
+            length = (static_cast<size_t>(p[0]) << 8) | p[1];
+            return kComplete;
+        default:
+            if(size < 4)
+            {
+                return kIncomplete;
+            }
+            header = 4;
+            length = (static_cast<size_t>(p[0]) << 24) | (static_cast<size_t>(p[1]) << 16) |
+                     (static_cast<size_t>(p[2]) << 8) | p[3];
+            return kComplete;
+        }
+    }
+    // scanned: bytes of data already searched without a match, updated on kIncomplete and
+    // reset once a delimiter is found; a delimiter may straddle the old end, so the search
+    // restarts delimiter size - 1 bytes before it
+    int findDelimited(const char* data, size_t size, size_t& scanned, size_t& length, size_t& trailer) const
+    {
+        size_t limit = std::min(size, _maxFrame + _delimiter.size());
+        size_t from = scanned >= _delimiter.size() ? std::min(scanned - _delimiter.size() + 1, limit) : 0;
+        const void* hit = ::memmem(data + from, limit - from, _delimiter.data(), _delimiter.size());
+        if(hit == nullptr)
+        {
+            if(size >= _maxFrame + _delimiter.size())
+            {
+                length = SIZE_MAX;
+                return kComplete;
+            }
+            scanned = limit;
+            return kIncomplete;
+        }
+        scanned = 0;
+        length = static_cast<const char*>(hit) - data;
+        trailer = _delimiter.size();
+        return kComplete;
+    }
+private:
+    FrameFormat _format;
+    std::string _delimiter;
+    size_t _maxFrame;
+    frameCallback _frameCb;
+    errorCallback _errorCb;
+};
@@ -1,10 +1,19 @@
 #pragma once
 #include "eventloop.hpp"
 #include "buffer.hpp"
+#include "outputqueue.hpp"
 #include "channel.hpp"
 #include "socket.hpp"
 #include <memory>
 #include <any>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
 
 enum class ConnectionState
 {
@@ -22,126 +31,427 @@ public:
     using messageCallback = std::function<void(const ptrConnection&, Buffer*)>;
     using closeCallback = std::function<void(const ptrConnection&)>;
     using eventCallback = std::function<void(const ptrConnection&)>;
+    using spliceCallback = std::function<void(const ptrConnection&, size_t)>;
+    using highWaterMarkCallback = std::function<void(const ptrConnection&, size_t)>;
+    using lowWaterMarkCallback = std::function<void(const ptrConnection&)>;
+    using migrateCallback = std::function<void(const ptrConnection&, bool)>;
+    static constexpr int kMaxIoPerEvent = 16; // fairness budget for edge-triggered reads/writes
+    static constexpr size_t kSpliceChunk = 64 * 1024; // default pipe capacity
+    static constexpr size_t kDefaultZeroCopyThreshold = 64 * 1024;
+    static constexpr std::chrono::milliseconds kZeroCopyReclaim{10}; // error queue poll interval after close
+    static constexpr int kShrinkAfterDrained = 64; // drained reads in a row before input storage goes back
+    // reasons reading is paused, reading resumes once none is left
+    static constexpr int kPauseUser = 1 << 0;
+    static constexpr int kPauseOutput = 1 << 1;
+    static constexpr int kPauseInput = 1 << 2;
+    static constexpr int kPauseMigrate = 1 << 3;
 
     Connection(EventLoop* loop, uint64_t connId, int sockfd)
     : _id(connId),
     _fd(sockfd),
     _inactiveRelease(false),
+    _inactiveTimeout(0),
+    _lastActive(0),
+    _edgeTriggered(false),
+    _outputHighWater(0),
+    _outputLowWater(0),
+    _inputHighWater(0),
+    _aboveHighWater(false),
+    _coalesce(false),
+    _flushQueued(false),
+    _readPause(0),
+    _drainedReads(0),
+    _migrating(false),
+    _sendInFlight(false),
+    _bytesRead(0),
+    _balanceMark(0),
     _loop(loop),
     _state(ConnectionState::K_CONNECTING),
     _socket(sockfd),
-    _channel(sockfd, loop)
+    _channel(sockfd, loop),
+    _input(&loop->bufferPool()),
+    _output(&loop->bufferPool()),
+    _spliceFd(-1),
+    _spliceRemain(0),
+    _spliceMoved(0)
     {
+        if(loop->poller()->completionIo())
+        {
+            _channel.setIoMode(Channel::kRecv);
+        }
         _channel.setReadCallback([this]{handleRead();});
         _channel.setWriteCallback([this]{handleWrite();});
         _channel.setCloseCallback([this]{handleClose();});
+        _channel.setErrorCallback([this]{handleError();});
         _channel.setEventCallback([this]{handleEvent();});
     }
-    ~Connection() = default;
+    ~Connection()
+    {
+        closePipe();
+    }
     uint64_t getId() const {return _id;}
     int getFd() const {return _fd;}
-    EventLoop* getLoop() const {return _loop;}
+    EventLoop* getLoop() const {return _loop.load(std::memory_order_acquire);}
     ConnectionState getState() const {return _state;}
     std::any* getContext() {return &_context;}
     bool isConnected() const {return _state == ConnectionState::K_CONNECTED;}
+    // must be called before establish()
+    void setEdgeTriggered(bool on)
+    {
+        _edgeTriggered = on;
+        _channel.setEdgeTriggered(on);
+    }
 
     void setConnectedCallback(const connectedCallback& cb) {_connectedCb = cb;}
     void setMessageCallback(const messageCallback& cb) {_messageCb = cb;}
     void setCloseCallback(const closeCallback& cb) {_closeCb = cb;}
     void setServerCloseCallback(const closeCallback& cb) {_serverCloseCb = cb;}
     void setEventCallback(const eventCallback& cb) {_eventCb = cb;}
+    // called when queued output reaches the high watermark and when it drains back to the low one
+    void setHighWaterMarkCallback(const highWaterMarkCallback& cb) {_highWaterCb = cb;}
+    void setLowWaterMarkCallback(const lowWaterMarkCallback& cb) {_lowWaterCb = cb;}
+    // set before establish() or on the loop thread; 0 disables. Queued output at or above
+    // high stops reading from this peer until it drains to low, so a client that doesn't
+    // read its replies can't make the server buffer without bound
+    void setOutputWaterMarks(size_t high, size_t low)
+    {
+        _outputHighWater = high;
+        _outputLowWater = std::min(low, high);
+    }
+    // unconsumed input at or above high stops reading and calls the input high watermark
+    // callback, which decides what happens to it: consume it and resumeReading(), or close.
+    // Without a callback the input is dropped and the connection shut down, a message that
+    // never completes below the mark would otherwise park the connection for good
+    void setInputHighWaterMark(size_t high) {_inputHighWater = high;}
+    void setInputHighWaterMarkCallback(const highWaterMarkCallback& cb) {_inputHighWaterCb = cb;}
+    // e.g. a proxy pausing the upstream side while the downstream one is above its high watermark
+    void pauseReading()
+    {
+        _runInLoop([this]{_pauseReading(kPauseUser);});
+    }
+    // also lifts an input watermark pause; input still buffered is delivered again
+    void resumeReading()
+    {
+        _runInLoop([this]{_resumeReading(kPauseUser | kPauseInput);});
+    }
+    bool readingPaused() const {return _readPause != 0;}
 
     void establish()
     {
-        _loop->runInLoop([this]{_establish();});
+        _runInLoop([this]{_establish();});
     }
+    // on the loop thread with nothing queued the bytes go straight to the socket and only
+    // the unsent tail is buffered; from other threads the data is copied once into a Buffer
+    // from the loop's pool, which the output queue then takes over
     void send(const char* data, size_t len)
     {
-        Buffer buf;
-        buf.write(data, len);
-        _loop->runInLoop([this, buf]{_send(std::move(buf));});
+        EventLoop* loop = getLoop();
+        if(loop->isInLoopThread() && !_migrating.load(std::memory_order_relaxed))
+        {
+            _sendInLoop(data, len);
+            return;
+        }
+        Buffer copy(&loop->bufferPool());
+        copy.write(data, len);
+        _runInLoop([this, copy = std::move(copy)]() mutable {_sendBuffer(std::move(copy));});
+    }
+    void send(std::string_view data)
+    {
+        send(data.data(), data.size());
+    }
+    // first and second as one message, e.g. a frame header and its payload: on the loop thread
+    // both leave with one sendmsg from the caller's memory and only an unsent tail is copied;
+    // other threads copy both once into one pooled Buffer
+    void send(std::string_view first, std::string_view second)
+    {
+        EventLoop* loop = getLoop();
+        if(loop->isInLoopThread() && !_migrating.load(std::memory_order_relaxed))
+        {
+            _sendInLoop(first, second);
+            return;
+        }
+        Buffer copy(&loop->bufferPool());
+        copy.write(first.data(), first.size());
+        copy.write(second.data(), second.size());
+        _runInLoop([this, copy = std::move(copy)]() mutable {_sendBuffer(std::move(copy));});
+    }
+    void send(std::string&& data)
+    {
+        _runInLoop([this, data = std::move(data)]() mutable {_sendString(std::move(data));});
+    }
+    void send(Buffer&& buf)
+    {
+        _runInLoop([this, buf = std::move(buf)]() mutable {_sendBuffer(std::move(buf));});
+    }
+    // queued as a refcounted segment: no copy, the string is released once sent
+    void send(std::shared_ptr<const std::string> data)
+    {
+        _runInLoop([this, data]{_sendShared(data);});
+    }
+    // queued by reference: data must stay valid until done runs, which happens on the
+    // loop thread once the bytes are sent or the connection drops them
+    void sendBorrowed(const char* data, size_t len, OutputQueue::releaseCallback done = nullptr)
+    {
+        _runInLoop([this, data, len, done = std::move(done)]() mutable {_sendBorrowed(data, len, std::move(done));});
+    }
+    // zero-copy: length bytes of fd from offset go out with sendfile, ordered with the
+    // buffered data around them; fd must stay open until done runs on the loop thread
+    void sendFile(int fd, off_t offset, size_t length, OutputQueue::releaseCallback done = nullptr)
+    {
+        _runInLoop([this, fd, offset, length, done = std::move(done)]() mutable {_sendFile(fd, offset, length, std::move(done));});
+    }
+    // moves the next length inbound bytes to fd at its current position through a pipe,
+    // without passing them through user space; the message callback is not called for them.
+    // done gets the number of bytes written, less than length if the connection dropped
+    void spliceToFile(int fd, size_t length, const spliceCallback& done = nullptr)
+    {
+        _runInLoop([this, fd, length, done]{_spliceToFile(fd, length, done);});
+    }
+    // queued segments of at least threshold bytes are sent with MSG_ZEROCOPY; falls back to
+    // ordinary sends when the socket or the route (e.g. loopback) can't avoid the copy
+    void enableZeroCopy(size_t threshold = kDefaultZeroCopyThreshold)
+    {
+        _runInLoop([this, threshold]{_enableZeroCopy(threshold);});
+    }
+    // writes are queued and sent by one flush at the end of the loop iteration, so many
+    // small sends leave as one write; applies to every send path
+    void enableWriteCoalescing()
+    {
+        _runInLoop([this]{_coalesce = true;});
+    }
+    // SO_BUSY_POLL in microseconds, see Socket::busyPoll
+    void enableBusyPoll(int usecs)
+    {
+        _runInLoop([this, usecs]{_socket.busyPoll(usecs);});
     }
     void shutdown()
     {
-        _loop->runInLoop([this]{_shutdownInLoop();});
+        _runInLoop([this]{_shutdownInLoop();});
     }
     void enableInactivityRelease(int timeout)
     {
-        _loop->runInLoop([this, timeout]{_enableInactivityRelease(timeout);});
+        _runInLoop([this, timeout]{_enableInactivityRelease(timeout);});
     }
     void disableInactivityRelease()
     {
-        _loop->runInLoop([this]{_disableInactivityRelease();});
+        _runInLoop([this]{_disableInactivityRelease();});
     }
     void upgrade(const std::any& context, const connectedCallback& cb,
                  const messageCallback& msgCb, const closeCallback& closeCb,
                  const eventCallback& eventCb)
     {
-        if(!_loop->isInLoopThread())
+        if(!getLoop()->isInLoopThread())
         {
             perror("not in loop thread");
             exit(1);
         }
-        _loop->runInLoop([this, context, cb, msgCb, closeCb, eventCb]{_upgrade(context, cb, msgCb, closeCb, eventCb);});
+        _runInLoop([this, context, cb, msgCb, closeCb, eventCb]{_upgrade(context, cb, msgCb, closeCb, eventCb);});
     }
     void setContext(const std::any& context) {_context = context;}
+    // moves the connection to target: its channel leaves this loop's poller and is registered
+    // on target with buffers, pause state, inactivity timer and context intact. Sends from any
+    // thread keep their order across the move. done runs on the new loop, or with false on the
+    // old one if the connection can't move (not connected, mid-splice or already moving)
+    void migrateTo(EventLoop* target, const migrateCallback& done = nullptr)
+    {
+        ptrConnection self = shared_from_this();
+        // queued even on the owning thread: a callback of this connection may be on the stack,
+        // and the read or event handling around it must finish before the loop changes
+        std::lock_guard<std::mutex> lock(_loopMutex);
+        EventLoop* loop = getLoop();
+        loop->queueInLoop([self, loop, target, done]{
+            self->_dispatch(loop, false, [self, target, done]{self->_migrateInLoop(target, done);});
+        });
+    }
+    bool migrating() const {return _migrating.load(std::memory_order_relaxed);}
+    // bytes received so far, readable from any thread
+    uint64_t bytesRead() const {return _bytesRead.load(std::memory_order_relaxed);}
+    // scratch value for a rebalancer, see TcpServer
+    uint64_t balanceMark() const {return _balanceMark;}
+    void setBalanceMark(uint64_t mark) {_balanceMark = mark;}
 
 private:
     void handleRead()
     {
-        char buf[65536];
-        ssize_t n = _socket.recv(buf, sizeof(buf), MSG_DONTWAIT);
-        if(n > 0)
+        // the check for the loop drops a re-queued read that ran into a migration
+        if(_state == ConnectionState::K_DISCONNECTED || _readPause != 0 || !getLoop()->isInLoopThread())
         {
-            _input.write(buf, n);
-            if(_input.readableSize() > 0)
+            return;
+        }
+        // level-triggered: one read per wakeup, the poller reports the rest;
+        // edge-triggered: drain until EAGAIN, bounded so one busy peer can't starve the loop
+        if(_spliceRemain > 0)
+        {
+            _completion() ? handleSpliceReceived() : handleSplice();
+            return;
+        }
+        int budget = _edgeTriggered ? kMaxIoPerEvent : 1;
+        bool peerClosed = false;
+        bool failed = false;
+        bool drained = false;
+        bool received = false;
+        while(budget-- > 0)
+        {
+            // with completions the poller has already received the bytes, they only get copied
+            ssize_t n = _completion() ? getLoop()->poller()->takeReceived(&_channel, &_input) : _input.readFd(_fd);
+            if(n > 0)
+            {
+                received = true;
+                _bytesRead.store(_bytesRead.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+            else if(n == 0)
             {
-                if(_messageCb)
+                peerClosed = true;
+                break;
+            }
+            else
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
                 {
-                    _messageCb(shared_from_this(), &_input);
+                    drained = true;
                 }
+                else
+                {
+                    failed = true;
+                }
+                break;
             }
         }
-        else if(n == 0)
+        if(received && _input.readableSize() > 0)
+        {
+            if(_messageCb)
+            {
+                _messageCb(shared_from_this(), &_input);
+            }
+        }
+        // a connection that keeps draining its input is likely idle between short requests;
+        // giving the smallest class back after every read would only churn the pool. Storage
+        // a burst grew goes back with the first read that drains it, the peer may stay quiet
+        if(_input.readableSize() > 0)
+        {
+            _drainedReads = 0;
+        }
+        else if(_input.capacity() > BufferPool::kMinClass || ++_drainedReads >= kShrinkAfterDrained)
+        {
+            _drainedReads = 0;
+            _input.shrink();
+        }
+        _checkInputHighWater();
+        if(_state == ConnectionState::K_DISCONNECTED)
         {
-            //not recieve data
             return;
         }
-        else
+        if(peerClosed || failed)
         {
-            _shutdownInLoop();
+            // stop watching the fd, otherwise a closed peer keeps it readable and the loop spins
+            _channel.disableRead();
+            if(_state != ConnectionState::K_DISCONNECTING)
+            {
+                _shutdownInLoop();
+            }
+        }
+        else if(_edgeTriggered && !drained && _readPause == 0)
+        {
+            // budget exhausted with data left: no further edge will come, so continue later
+            ptrConnection self = shared_from_this();
+            getLoop()->queueInLoop([self]{self->handleRead();});
         }
     }
     void handleWrite()
     {
-        ssize_t n = _socket.send(_output.readPos(), _output.readableSize(), MSG_DONTWAIT);
-        if(n > 0)
+        if(_sendInFlight)
         {
-            _output.moveReadIdx(n);
-            if(_output.readableSize() == 0)
+            handleSent();
+            return;
+        }
+        if(_state == ConnectionState::K_DISCONNECTED || !getLoop()->isInLoopThread())
+        {
+            return;
+        }
+        int budget = _edgeTriggered ? kMaxIoPerEvent : 1;
+        while(budget-- > 0 && _output.readableSize() > 0)
+        {
+            ssize_t n = _output.sendTo(_fd, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if(n > 0)
+            {
+                continue;
+            }
+            else if(n == 0)
             {
-                _channel.disableWrite();
-                if(_state == ConnectionState::K_DISCONNECTING)
+                //socket buffer full
+                _checkLowWater();
+                return;
+            }
+            else //disconnect
+            {
+                if(_input.readableSize() > 0)
                 {
-                    _close();
+                    if(_messageCb)
+                    {
+                        _messageCb(shared_from_this(), &_input);
+                    }
                 }
+                _close();
+                return;
             }
         }
-        else if(n == 0)
+        if(!_checkLowWater())
         {
-            //not send data
             return;
         }
-        else //disconnect
+        if(_output.readableSize() == 0)
         {
-            if(_input.readableSize() > 0)
+            _channel.disableWrite();
+            if(_state == ConnectionState::K_DISCONNECTING)
             {
-                if(_messageCb)
-                {
-                    _messageCb(shared_from_this(), &_input);
-                }
+                _close();
+            }
+        }
+        else if(_edgeTriggered)
+        {
+            ptrConnection self = shared_from_this();
+            getLoop()->queueInLoop([self]{self->handleWrite();});
+        }
+    }
+    // completion of the send _submitOutput queued
+    void handleSent()
+    {
+        ssize_t n = getLoop()->poller()->takeSent(&_channel);
+        if(n == -1 && errno == EAGAIN)
+        {
+            return;
+        }
+        _sendInFlight = false;
+        if(_state == ConnectionState::K_DISCONNECTED)
+        {
+            // closed while the kernel still read the output queue, release it now; the last
+            // reference goes after the channel is done with this event
+            _releaseSocket();
+            ptrConnection self = std::move(_closing);
+            getLoop()->queueInLoop([self]{});
+            return;
+        }
+        if(n < 0)
+        {
+            if(_input.readableSize() > 0 && _messageCb)
+            {
+                _messageCb(shared_from_this(), &_input);
             }
             _close();
+            return;
+        }
+        _output.consumeSent(n);
+        if(!_checkLowWater())
+        {
+            return;
+        }
+        if(_output.readableSize() > 0)
+        {
+            _submitOutput();
+        }
+        else if(_state == ConnectionState::K_DISCONNECTING)
+        {
+            _close();
         }
     }
     void handleClose()
@@ -155,38 +465,675 @@ private:
         }
         _close();
     }
+    void handleError()
+    {
+        if(_state == ConnectionState::K_DISCONNECTED)
+        {
+            return;
+        }
+        // zerocopy completions arrive through the error queue; real socket errors
+        // surface on the next read or write
+        if(_output.zeroCopyEnabled() || _output.zeroCopyPending())
+        {
+            _output.readZeroCopyCompletions(_fd);
+        }
+    }
     void handleEvent()
     {
         if(_inactiveRelease)
         {
-            _loop->refreshAfter(_id);
+            // only stamp the activity, the timer compares against it when it fires
+            _lastActive = getLoop()->pollTime();
         }
         if(_eventCb)
         {
             _eventCb(shared_from_this());
         }
     }
-    void _send(const Buffer& buf)
+    // writes directly when nothing is queued ahead, returns how many bytes went out;
+    // payloads big enough for zerocopy are left to the queue, which sends them with MSG_ZEROCOPY
+    size_t _sendDirect(const char* data, size_t len)
+    {
+        if(!_directSendable(len))
+        {
+            return 0;
+        }
+        ssize_t n = _socket.send(data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        // on error the rest is queued and handleWrite runs the usual disconnect path
+        return n > 0 ? n : 0;
+    }
+    size_t _sendDirect(std::string_view first, std::string_view second)
+    {
+        if(!_directSendable(first.size() + second.size()))
+        {
+            return 0;
+        }
+        iovec iov[2];
+        iov[0].iov_base = const_cast<char*>(first.data());
+        iov[0].iov_len = first.size();
+        iov[1].iov_base = const_cast<char*>(second.data());
+        iov[1].iov_len = second.size();
+        ssize_t n = _socket.sendv(iov, 2, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return n > 0 ? n : 0;
+    }
+    bool _directSendable(size_t len) const
+    {
+        return !_coalesce && !_completion() && _output.readableSize() == 0 && !_channel.writable() &&
+               !(_output.zeroCopyEnabled() && len >= _output.zeroCopyThreshold());
+    }
+    void _sendInLoop(const char* data, size_t len)
+    {
+        if(_state != ConnectionState::K_CONNECTED)
+        {
+            return;
+        }
+        size_t n = _sendDirect(data, len);
+        if(n < len)
+        {
+            _output.append(data + n, len - n);
+            _startWrite();
+        }
+    }
+    void _sendInLoop(std::string_view first, std::string_view second)
+    {
+        if(_state != ConnectionState::K_CONNECTED)
+        {
+            return;
+        }
+        size_t n = _sendDirect(first, second);
+        if(n < first.size() + second.size())
+        {
+            size_t head = std::min(n, first.size());
+            _output.append(first.data() + head, first.size() - head);
+            _output.append(second.data() + (n - head), second.size() - (n - head));
+            _startWrite();
+        }
+    }
+    void _sendString(std::string&& data)
+    {
+        if(_state != ConnectionState::K_CONNECTED)
+        {
+            return;
+        }
+        size_t n = _sendDirect(data.data(), data.size());
+        if(n < data.size())
+        {
+            _output.append(std::move(data), n);
+            _startWrite();
+        }
+    }
+    void _sendBuffer(Buffer&& buf)
+    {
+        if(_state != ConnectionState::K_CONNECTED)
+        {
+            return;
+        }
+        buf.moveReadIdx(_sendDirect(buf.readPos(), buf.readableSize()));
+        if(buf.readableSize() > 0)
+        {
+            _output.append(std::move(buf));
+            _startWrite();
+        }
+    }
+    void _sendShared(std::shared_ptr<const std::string> data)
     {
         if(_state == ConnectionState::K_CONNECTED)
         {
-            _output.Write(buf);
-            if(!_channel.writable())
+            _output.append(std::move(data));
+            _startWrite();
+        }
+    }
+    void _sendBorrowed(const char* data, size_t len, OutputQueue::releaseCallback done)
+    {
+        if(_state != ConnectionState::K_CONNECTED)
+        {
+            if(done)
+            {
+                done();
+            }
+            return;
+        }
+        _output.appendBorrowed(data, len, std::move(done));
+        _startWrite();
+    }
+    void _enableZeroCopy(size_t threshold)
+    {
+        // completion sends can't read the error queue completions
+        if(!_completion() && _socket.zeroCopy())
+        {
+            _output.setZeroCopyThreshold(threshold);
+        }
+    }
+    void _sendFile(int fd, off_t offset, size_t length, OutputQueue::releaseCallback done)
+    {
+        if(_state != ConnectionState::K_CONNECTED)
+        {
+            if(done)
+            {
+                done();
+            }
+            return;
+        }
+        _output.appendFile(fd, offset, length, std::move(done));
+        _startWrite();
+    }
+    void _spliceToFile(int fd, size_t length, const spliceCallback& done)
+    {
+        if(_state != ConnectionState::K_CONNECTED || _spliceRemain > 0)
+        {
+            if(done)
+            {
+                done(shared_from_this(), 0);
+            }
+            return;
+        }
+        _spliceFd = fd;
+        _spliceRemain = length;
+        _spliceMoved = 0;
+        _spliceDone = done;
+        // part of the body may already sit in the input buffer
+        if(!_spliceBuffered())
+        {
+            _finishSplice();
+            return;
+        }
+        if(_spliceRemain == 0)
+        {
+            _finishSplice();
+        }
+        else if(_edgeTriggered || _completion())
+        {
+            // the socket or the poller may already hold the rest and no new report is coming
+            ptrConnection self = shared_from_this();
+            getLoop()->queueInLoop([self]{self->handleRead();});
+        }
+    }
+    // writes the part of the body sitting in the input buffer to the file, false if that fails
+    bool _spliceBuffered()
+    {
+        size_t buffered = std::min(_input.readableSize(), _spliceRemain);
+        while(buffered > 0)
+        {
+            ssize_t n = ::write(_spliceFd, _input.readPos(), buffered);
+            if(n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if(n <= 0)
+            {
+                return false;
+            }
+            _input.moveReadIdx(n);
+            _spliceMoved += n;
+            _spliceRemain -= n;
+            buffered -= n;
+        }
+        return true;
+    }
+    // completion mode: the poller owns the socket's receive side, so the body is copied from
+    // what it received instead of spliced
+    void handleSpliceReceived()
+    {
+        ssize_t n = getLoop()->poller()->takeReceived(&_channel, &_input);
+        if(n == -1 && errno == EAGAIN)
+        {
+            return;
+        }
+        if(n <= 0 || !_spliceBuffered())
+        {
+            // peer closed or the file write failed before the body was complete
+            _channel.disableRead();
+            _finishSplice();
+            _shutdownInLoop();
+            return;
+        }
+        if(_spliceRemain == 0)
+        {
+            _finishSplice();
+        }
+    }
+    void handleSplice()
+    {
+        if(_pipe[0] == -1 && ::pipe2(_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        {
+            _finishSplice();
+            _shutdownInLoop();
+            return;
+        }
+        int budget = _edgeTriggered ? kMaxIoPerEvent : 1;
+        while(budget-- > 0 && _spliceRemain > 0)
+        {
+            ssize_t n = ::splice(_fd, nullptr, _pipe[1], nullptr, std::min(_spliceRemain, kSpliceChunk),
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return;
+            }
+            if(n <= 0 || !drainPipe(n))
+            {
+                // peer closed or the file write failed before the body was complete
+                _channel.disableRead();
+                _finishSplice();
+                _shutdownInLoop();
+                return;
+            }
+            _spliceMoved += n;
+            _spliceRemain -= n;
+        }
+        if(_spliceRemain == 0)
+        {
+            _finishSplice();
+        }
+        if(_edgeTriggered)
+        {
+            ptrConnection self = shared_from_this();
+            getLoop()->queueInLoop([self]{self->handleRead();});
+        }
+    }
+    bool drainPipe(size_t len)
+    {
+        while(len > 0)
+        {
+            ssize_t n = ::splice(_pipe[0], nullptr, _spliceFd, nullptr, len, SPLICE_F_MOVE);
+            if(n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if(n <= 0)
+            {
+                return false;
+            }
+            len -= n;
+        }
+        return true;
+    }
+    void _finishSplice()
+    {
+        spliceCallback done = std::move(_spliceDone);
+        size_t moved = _spliceMoved;
+        _spliceDone = nullptr;
+        _spliceRemain = 0;
+        _spliceMoved = 0;
+        _spliceFd = -1;
+        if(done)
+        {
+            done(shared_from_this(), moved);
+        }
+        if(_input.readableSize() > 0 && _state == ConnectionState::K_CONNECTED)
+        {
+            // bytes following the body were already read, hand them over outside this call;
+            // if the connection migrates first, the new loop delivers them when it resumes reading
+            ptrConnection self = shared_from_this();
+            getLoop()->queueInLoop([self]{
+                if(self->isConnected() && self->_input.readableSize() > 0 && self->_messageCb &&
+                   self->getLoop()->isInLoopThread())
+                {
+                    self->_messageCb(self, &self->_input);
+                }
+            });
+        }
+    }
+    void closePipe()
+    {
+        for(int& fd : _pipe)
+        {
+            if(fd != -1)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+    }
+    // called after anything is queued
+    // runs fn on the connection's loop. A task that reaches a loop the connection has since
+    // left is forwarded to the new one; while a migration settles, tasks queued directly on
+    // the new loop wait in _deferred behind the forwarded ones, which keeps per-sender order
+    template <typename F>
+    void _runInLoop(F&& fn)
+    {
+        EventLoop* loop = getLoop();
+        if(loop->isInLoopThread())
+        {
+            _dispatch(loop, false, std::forward<F>(fn));
+            return;
+        }
+        // the owner can't switch loops between reading _loop and queuing on it
+        std::lock_guard<std::mutex> lock(_loopMutex);
+        loop = getLoop();
+        loop->queueInLoop([this, loop, fn = std::forward<F>(fn)]() mutable {_dispatch(loop, false, std::move(fn));});
+    }
+    template <typename F>
+    void _dispatch(EventLoop* loop, bool forwarded, F&& fn)
+    {
+        EventLoop* owner = getLoop();
+        if(owner != loop)
+        {
+            owner->queueInLoop([this, owner, fn = std::forward<F>(fn)]() mutable {_dispatch(owner, true, std::move(fn));});
+            return;
+        }
+        if(!forwarded && _migrating.load(std::memory_order_acquire))
+        {
+            _deferred.emplace_back(std::forward<F>(fn));
+            return;
+        }
+        fn();
+    }
+    void _migrateInLoop(EventLoop* target, const migrateCallback& done)
+    {
+        EventLoop* source = getLoop();
+        if(target == source)
+        {
+            if(done)
+            {
+                done(shared_from_this(), true);
+            }
+            return;
+        }
+        if(_state != ConnectionState::K_CONNECTED || _spliceRemain > 0 || _migrating)
+        {
+            if(!_migrating && (_readPause & kPauseMigrate))
+            {
+                // gave up while waiting for the ring to let go, see below
+                _resumeReading(kPauseMigrate);
+                _submitOutput();
+            }
+            if(done)
+            {
+                done(shared_from_this(), false);
+            }
+            return;
+        }
+        // no interest is carried over: _adoptInLoop and _finishMigration register it anew.
+        // Reading stays paused until then, whatever else resumes it meanwhile
+        _readPause |= kPauseMigrate;
+        _channel.disableAll();
+        if(_completion())
+        {
+            if(_sendInFlight || source->poller()->busy(&_channel))
+            {
+                // the cancelled recv and the send in flight end in this ring first, try again
+                // after the next poll
+                ptrConnection self = shared_from_this();
+                source->queueInLoop([self, source, target, done]{
+                    self->_dispatch(source, false, [self, target, done]{self->_migrateInLoop(target, done);});
+                });
+                return;
+            }
+            while(source->poller()->takeReceived(&_channel, &_input) > 0)
+            {
+            }
+        }
+        _channel.remove();
+        if(_inactiveRelease)
+        {
+            source->removeAfter(_id);
+        }
+        ptrConnection self = shared_from_this();
+        {
+            std::lock_guard<std::mutex> lock(_loopMutex);
+            _migrating.store(true, std::memory_order_release);
+            _channel.setLoop(target);
+            _loop.store(target, std::memory_order_release);
+        }
+        source->load().connectionRemoved();
+        target->load().connectionAdded();
+        target->queueInLoop([self]{self->_adoptInLoop();});
+        // runs after every task other threads queued here before the switch, all of which
+        // are forwarded by then; only then may target run what was queued on it directly
+        source->queueAfterPending([self, target, done]{
+            target->queueInLoop([self, done]{self->_finishMigration(done);});
+        });
+    }
+    void _adoptInLoop()
+    {
+        if(_state == ConnectionState::K_DISCONNECTED)
+        {
+            return;
+        }
+        _channel.setIoMode(getLoop()->poller()->completionIo() ? Channel::kRecv : Channel::kReadiness);
+        // reading waits for _finishMigration so replies can't overtake forwarded sends
+        if(_output.readableSize() > 0)
+        {
+            _armWrite();
+        }
+        if(_inactiveRelease)
+        {
+            uint64_t idle = TimerWheel::monotonicMs() - _lastActive;
+            getLoop()->runAfter(_id, std::chrono::milliseconds(idle < _inactiveTimeout ? _inactiveTimeout - idle : 0),
+                                [this]{_checkInactivity();});
+        }
+    }
+    void _finishMigration(const migrateCallback& done)
+    {
+        EventLoop* loop = getLoop();
+        _migrating.store(false, std::memory_order_release);
+        std::vector<Task> deferred;
+        deferred.swap(_deferred);
+        for(auto& task : deferred)
+        {
+            EventLoop* owner = getLoop();
+            if(owner != loop)
+            {
+                // a deferred migrateTo moved the connection on, the rest follows it in order
+                owner->queueInLoop([this, owner, task = std::move(task)]() mutable {_dispatch(owner, true, std::move(task));});
+                continue;
+            }
+            task();
+        }
+        if(getLoop() == loop && _state == ConnectionState::K_CONNECTED)
+        {
+            _resumeReading(kPauseMigrate);
+            _submitOutput();
+        }
+        if(!done)
+        {
+            return;
+        }
+        ptrConnection self = shared_from_this();
+        bool moved = _state != ConnectionState::K_DISCONNECTED;
+        EventLoop* owner = getLoop();
+        if(owner != loop)
+        {
+            // this loop no longer owns the connection, done follows the deferred tasks
+            owner->queueInLoop([this, self, owner, done, moved]{
+                _dispatch(owner, true, [self, done, moved]{done(self, moved);});
+            });
+            return;
+        }
+        done(self, moved);
+    }
+    // called after anything is queued
+    void _startWrite()
+    {
+        if(_coalesce && !_channel.writable() && _output.readableSize() > 0)
+        {
+            if(!_flushQueued)
+            {
+                _flushQueued = true;
+                ptrConnection self = shared_from_this();
+                getLoop()->queueFlush([self]{self->_flush();});
+            }
+        }
+        else if(_output.readableSize() > 0)
+        {
+            _armWrite();
+        }
+        if(_outputHighWater > 0 && !_aboveHighWater && _output.readableSize() >= _outputHighWater)
+        {
+            _aboveHighWater = true;
+            _pauseReading(kPauseOutput);
+            if(_highWaterCb)
             {
-                _channel.enableWrite();
+                _highWaterCb(shared_from_this(), _output.readableSize());
             }
         }
     }
+    bool _completion() const {return _channel.ioMode() == Channel::kRecv;}
+    void _armWrite()
+    {
+        if(_completion())
+        {
+            _submitOutput();
+        }
+        else if(!_channel.writable())
+        {
+            _channel.enableWrite();
+        }
+    }
+    // completion mode: one SENDMSG in flight at a time, covering whatever is queued when it is
+    // submitted; file segments still go out with sendfile once the socket reports writable
+    void _submitOutput()
+    {
+        // a migration waits for the send in flight, _finishMigration submits the rest
+        if(_sendInFlight || _channel.writable() || _output.readableSize() == 0 || (_readPause & kPauseMigrate))
+        {
+            return;
+        }
+        iovec iov[OutputQueue::kMaxIov];
+        int iovcnt = _output.peekIov(iov, OutputQueue::kMaxIov);
+        if(iovcnt > 0 && getLoop()->poller()->submitSend(&_channel, iov, iovcnt))
+        {
+            _sendInFlight = true;
+            return;
+        }
+        _channel.enableWrite();
+    }
+    // sends everything queued during the iteration; MSG_MORE keeps the kernel from cutting
+    // a packet between sendmsg calls when the queue needs more than one
+    void _flush()
+    {
+        _flushQueued = false;
+        if(_state == ConnectionState::K_DISCONNECTED || _channel.writable() || !getLoop()->isInLoopThread())
+        {
+            // handleWrite owns a queue waiting for EPOLLOUT, a migrated connection gets one
+            return;
+        }
+        if(_completion())
+        {
+            // already batched: the send goes out with the next wait
+            _submitOutput();
+            return;
+        }
+        while(_output.readableSize() > 0)
+        {
+            ssize_t n = _output.sendTo(_fd, MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE);
+            if(n == 0)
+            {
+                break;
+            }
+            if(n < 0)
+            {
+                _close();
+                return;
+            }
+        }
+        if(!_checkLowWater())
+        {
+            return;
+        }
+        if(_output.readableSize() > 0)
+        {
+            _channel.enableWrite();
+        }
+        else if(_state == ConnectionState::K_DISCONNECTING)
+        {
+            _close();
+        }
+    }
+    // false once the low water callback closed the connection, the channel is gone then
+    bool _checkLowWater()
+    {
+        if(_aboveHighWater && _output.readableSize() <= _outputLowWater)
+        {
+            _aboveHighWater = false;
+            _resumeReading(kPauseOutput);
+            if(_lowWaterCb)
+            {
+                _lowWaterCb(shared_from_this());
+            }
+        }
+        return _state != ConnectionState::K_DISCONNECTED;
+    }
+    void _pauseReading(int reason)
+    {
+        bool wasPaused = _readPause != 0;
+        _readPause |= reason;
+        if(!wasPaused && _state == ConnectionState::K_CONNECTED && _channel.readable())
+        {
+            _channel.disableRead();
+        }
+    }
+    void _resumeReading(int reasons)
+    {
+        if((_readPause & reasons) == 0)
+        {
+            return;
+        }
+        _readPause &= ~reasons;
+        if(_readPause != 0 || _state != ConnectionState::K_CONNECTED)
+        {
+            return;
+        }
+        // re-arming also reports data that arrived meanwhile, even in edge-triggered mode
+        _channel.enableRead();
+        if(_input.readableSize() > 0)
+        {
+            ptrConnection self = shared_from_this();
+            getLoop()->queueInLoop([self]{
+                if(self->isConnected() && self->_readPause == 0 && self->_input.readableSize() > 0 && self->_messageCb &&
+                   self->getLoop()->isInLoopThread())
+                {
+                    self->_messageCb(self, &self->_input);
+                    self->_checkInputHighWater();
+                }
+            });
+        }
+    }
+    void _checkInputHighWater()
+    {
+        if(_inputHighWater == 0 || _state != ConnectionState::K_CONNECTED || (_readPause & kPauseInput) ||
+           _input.readableSize() < _inputHighWater)
+        {
+            return;
+        }
+        _pauseReading(kPauseInput);
+        if(_inputHighWaterCb)
+        {
+            _inputHighWaterCb(shared_from_this(), _input.readableSize());
+            return;
+        }
+        _input.moveReadIdx(_input.readableSize());
+        _shutdownInLoop();
+    }
     void _enableInactivityRelease(int timeout)
     {
         _inactiveRelease = true;
-        _loop->hasAfter(_id) ? 
-        _loop->refreshAfter(_id) : _loop->runAfter(_id, timeout, [this] {_close();});
+        _inactiveTimeout = static_cast<uint64_t>(timeout) * 1000;
+        _lastActive = TimerWheel::monotonicMs();
+        getLoop()->runAfter(_id, std::chrono::milliseconds(_inactiveTimeout), [this]{_checkInactivity();});
+    }
+    // the timer is armed once per timeout period, not per event: if the connection saw
+    // traffic since, it is re-armed for the rest of the period measured from _lastActive
+    void _checkInactivity()
+    {
+        uint64_t idle = TimerWheel::monotonicMs() - _lastActive;
+        if(idle >= _inactiveTimeout)
+        {
+            _close();
+            return;
+        }
+        // runs once a period, so this is where a quiet connection gives its input storage back
+        _input.shrink();
+        getLoop()->runAfter(_id, std::chrono::milliseconds(_inactiveTimeout - idle), [this]{_checkInactivity();});
     }
     void _disableInactivityRelease()
     {
         _inactiveRelease = false;
-        _loop->removeAfter(_id);
+        getLoop()->removeAfter(_id);
     }
     void _upgrade(const std::any& context, const connectedCallback& cb,
                  const messageCallback& msgCb, const closeCallback& closeCb,
@@ -206,7 +1153,10 @@ private:
             exit(1);
         }
         _state = ConnectionState::K_CONNECTED;
-        _channel.enableRead();
+        if(_readPause == 0)
+        {
+            _channel.enableRead();
+        }
         if(_connectedCb)
         {
             _connectedCb(shared_from_this());
@@ -222,12 +1172,9 @@ private:
                 _messageCb(shared_from_this(), &_input);
             }
         }
-        if(_output.readableSize() > 0)
+        if(_output.readableSize() > 0 || _sendInFlight)
         {
-            if(!_channel.writable())
-            {
-                _channel.enableWrite();
-            }
+            _armWrite();
         }
         else
         {
@@ -236,15 +1183,30 @@ private:
     }
     void _close()
     {
-        _loop->runInLoop([this]{_closeInLoop();});
+        _runInLoop([this]{_closeInLoop();});
     }
     void _closeInLoop()
     {
         if(_state == ConnectionState::K_DISCONNECTED) return;
         _state = ConnectionState::K_DISCONNECTED;
-        _channel.remove();
-        _socket.close();
-        _loop->removeAfter(_id);
+        if(_sendInFlight)
+        {
+            // the kernel still reads the output queue; the shutdown makes the send end soon
+            // and handleSent releases the rest then
+            _channel.disableAll();
+            ::shutdown(_fd, SHUT_RDWR);
+            _closing = shared_from_this();
+        }
+        else
+        {
+            _releaseSocket();
+        }
+        if(_spliceRemain > 0)
+        {
+            _finishSplice();
+        }
+        closePipe();
+        getLoop()->removeAfter(_id);
         if(_closeCb)
         {
             _closeCb(shared_from_this());
@@ -254,21 +1216,75 @@ private:
             _serverCloseCb(shared_from_this());
         }
     }
+    void _releaseSocket()
+    {
+        _channel.remove();
+        _output.clear(); // borrowed segments are released on the loop thread
+        if(_output.zeroCopyPending())
+        {
+            // the peer sees the close now, the socket stays open for the completions
+            ::shutdown(_fd, SHUT_RDWR);
+            _reclaimZeroCopy();
+        }
+        else
+        {
+            _socket.close();
+        }
+    }
+    // keeps the connection and its socket until the kernel has released every zerocopy
+    // segment, reading the error queue from a timer since the channel is gone
+    void _reclaimZeroCopy()
+    {
+        _output.readZeroCopyCompletions(_fd);
+        if(!_output.zeroCopyPending())
+        {
+            _socket.close();
+            return;
+        }
+        ptrConnection self = shared_from_this();
+        getLoop()->runAfter(kZeroCopyReclaim, [self]{self->_reclaimZeroCopy();});
+    }
 private:
     uint64_t _id;
     int _fd;
     bool _inactiveRelease;
-    EventLoop* _loop;
+    uint64_t _inactiveTimeout;  // ms
+    uint64_t _lastActive;       // CLOCK_MONOTONIC ms of the last event
+    bool _edgeTriggered;
+    size_t _outputHighWater;
+    size_t _outputLowWater;
+    size_t _inputHighWater;
+    bool _aboveHighWater;
+    bool _coalesce;         // writes wait for the end of iteration flush
+    bool _flushQueued;
+    int _readPause;         // kPause* bits
+    int _drainedReads;      // reads in a row that left the input empty
+    std::atomic<bool> _migrating;
+    std::vector<Task> _deferred;    // direct tasks held back until a migration settles
+    bool _sendInFlight;             // completion mode: a submitted send still reads _output
+    ptrConnection _closing;         // keeps a closed connection until that send ends
+    std::atomic<uint64_t> _bytesRead;
+    uint64_t _balanceMark;
+    std::mutex _loopMutex;          // orders cross-thread queuing against a loop switch
+    std::atomic<EventLoop*> _loop;
     ConnectionState _state;
     Socket _socket;
     Channel _channel;
     Buffer _input;
-    Buffer _output;
+    OutputQueue _output;
     std::any _context;
+    int _spliceFd;          // inbound splice target while _spliceRemain > 0
+    size_t _spliceRemain;
+    size_t _spliceMoved;
+    spliceCallback _spliceDone;
+    int _pipe[2] = {-1, -1};
 
     connectedCallback _connectedCb;
     messageCallback _messageCb;
     closeCallback _closeCb;
     closeCallback _serverCloseCb;
     eventCallback _eventCb;
+    highWaterMarkCallback _highWaterCb;
+    lowWaterMarkCallback _lowWaterCb;
+    highWaterMarkCallback _inputHighWaterCb;
 };
\ No newline at end of file
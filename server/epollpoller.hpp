@@ -0,0 +1,91 @@
+#pragma once
+#include <sys/epoll.h>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include "poller.hpp"
+
+class EpollPoller : public Poller
+{
+public:
+    static constexpr int kInitEventListSize = 128;
+    EpollPoller() : _epollfd(epoll_create1(EPOLL_CLOEXEC)), _events(kInitEventListSize)
+    {
+        if(_epollfd == -1)
+        {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ~EpollPoller() override
+    {
+        close(_epollfd);
+    }
+
+    void update(Channel* ch) override
+    {
+        if(ch->isRegistered())
+        {
+            epollOp(EPOLL_CTL_MOD, ch);
+        }
+        else
+        {
+            epollOp(EPOLL_CTL_ADD, ch);
+            ch->setRegistered(true);
+        }
+    }
+    void remove(Channel* ch) override
+    {
+        if(ch->isRegistered())
+        {
+            epollOp(EPOLL_CTL_DEL, ch);
+            ch->setRegistered(false);
+        }
+    }
+    bool poll(std::vector<Channel*>& activeChannels, int timeout = -1) override
+    {
+        int n = epoll_wait(_epollfd, _events.data(), _events.size(), timeout);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+            {
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        for(int i = 0; i < n; i++)
+        {
+            Channel* ch = static_cast<Channel*>(_events[i].data.ptr);
+            ch->setRevents(_events[i].events);
+            activeChannels.push_back(ch);
+        }
+        if(static_cast<size_t>(n) == _events.size())
+        {
+            // the array was filled, more fds are probably ready: take a bigger batch next time
+            _events.resize(_events.size() * 2);
+        }
+        return true;
+    }
+
+private:
+    void epollOp(int op, Channel* ch)
+    {
+        int fd = ch->getFd();
+        epoll_event ev{};
+        ev.data.ptr = ch;
+        ev.events = ch->getEvents();
+        int ret = epoll_ctl(_epollfd, op, fd, &ev);
+        if(ret == -1)
+        {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+private:
+    int _epollfd;
+    std::vector<epoll_event> _events;
+};
\ No newline at end of file
@@ -1,22 +1,92 @@
 #pragma once
 #include <functional>
+#include <algorithm>
+#include <chrono>
 #include <thread>
-#include <queue>
+#include <vector>
+#include <atomic>
+#include <memory>
 #include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cstring>
+#include <string>
 #include <mutex>
 #include <condition_variable>
 #include "channel.hpp"
 #include "poller.hpp"
+#include "mpscqueue.hpp"
+#include "task.hpp"
 #include "timer.hpp"
+#include "bufferpool.hpp"
+
+// Load counters a loop publishes for connection placement. Written by the owning loop
+// (connections also by the placing thread), read by any thread without locking.
+class LoopLoad
+{
+public:
+    static constexpr uint64_t kWindowNs = 100 * 1000 * 1000;
+
+    LoopLoad() : _connections(0), _busyTotal(0), _recentBusy(0), _recentStamp(nowNs()), _windowStart(_recentStamp), _windowBusy(0) {}
+    static uint64_t nowNs()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+    void connectionAdded() { _connections.fetch_add(1, std::memory_order_relaxed); }
+    void connectionRemoved() { _connections.fetch_sub(1, std::memory_order_relaxed); }
+    int connections() const { return _connections.load(std::memory_order_relaxed); }
+    // total ns spent handling events and tasks
+    uint64_t busyTotal() const { return _busyTotal.load(std::memory_order_relaxed); }
+    // busy ns per window, halved for every window that passes, plus the current window;
+    // a loop asleep in poll can't publish, so the reader applies the decay since the last update
+    uint64_t recentBusy() const
+    {
+        uint64_t age = (nowNs() - _recentStamp.load(std::memory_order_relaxed)) / kWindowNs;
+        uint64_t recent = age >= 64 ? 0 : _recentBusy.load(std::memory_order_relaxed) >> age;
+        return recent + (age == 0 ? _windowBusy.load(std::memory_order_relaxed) : 0);
+    }
+    // loop thread only
+    void addBusy(uint64_t now, uint64_t busy)
+    {
+        _busyTotal.fetch_add(busy, std::memory_order_relaxed);
+        uint64_t window = _windowBusy.load(std::memory_order_relaxed) + busy;
+        if(now - _windowStart < kWindowNs)
+        {
+            _windowBusy.store(window, std::memory_order_relaxed);
+            return;
+        }
+        uint64_t age = (now - _recentStamp.load(std::memory_order_relaxed)) / kWindowNs;
+        uint64_t recent = age >= 64 ? 0 : _recentBusy.load(std::memory_order_relaxed) >> age;
+        _windowBusy.store(0, std::memory_order_relaxed);
+        _recentBusy.store((recent + window) / 2, std::memory_order_relaxed);
+        _recentStamp.store(now, std::memory_order_relaxed);
+        _windowStart = now;
+    }
+private:
+    std::atomic<int> _connections;
+    std::atomic<uint64_t> _busyTotal;
+    std::atomic<uint64_t> _recentBusy;
+    std::atomic<uint64_t> _recentStamp;
+    uint64_t _windowStart;
+    std::atomic<uint64_t> _windowBusy;
+};
 
 class EventLoop
 {
 public:
-    using callback_t = std::function<void()>;
-    EventLoop() : _eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    using callback_t = Task;
+    static constexpr int kMaxPendingPerIteration = 4096; // cross-thread tasks run before polling again
+    explicit EventLoop(PollerBackend backend = PollerBackend::K_EPOLL) : _eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
     _tid(std::this_thread::get_id()),
     _eventch(new Channel(_eventFd, this)),
-    _timeWheel(this)
+    _poller(Poller::newPoller(backend)),
+    _timeWheel(this),
+    _wakeupPending(false),
+    _pendingBacklog(false),
+    _pollTime(TimerWheel::monotonicMs()),
+    _busyPollNs(0)
     {
         if(_eventFd < 0)
         {
@@ -32,24 +102,68 @@ public:
         delete _eventch;
         close(_eventFd);
     }
-    void runInLoop(const callback_t& cb)
+    // on the loop thread fn runs right away and is never wrapped in a Task
+    template <typename F>
+    void runInLoop(F&& fn)
     {
         if(isInLoopThread())
         {
-            cb();
+            fn();
         }
         else
         {
-            queueInLoop(cb);
+            queueInLoop(callback_t(std::forward<F>(fn)));
         }
     }
-    void queueInLoop(const callback_t& cb)
+    void queueInLoop(callback_t cb)
     {
+        if(isInLoopThread())
         {
-            std::lock_guard<std::mutex> lock(_mutex);
-            _pending.push(cb);
+            // runs after the current event batch, ahead of what other threads queued; the loop
+            // is awake by definition
+            _localPending.push_back(std::move(cb));
+            return;
         }
-        wakeup();
+        pushPending(std::move(cb));
+    }
+    LoopLoad& load()
+    {
+        return _load;
+    }
+    // storage for the buffers of this loop's connections
+    BufferPool& bufferPool()
+    {
+        return _bufferPool;
+    }
+    // CLOCK_MONOTONIC ms taken when the last poll returned, a clock read shared by the
+    // whole event batch
+    uint64_t pollTime() const
+    {
+        return _pollTime;
+    }
+    // runs cb once this iteration's events and tasks are handled, before the loop polls
+    // again; loop thread only. Lets connections combine everything written meanwhile
+    void queueFlush(callback_t cb)
+    {
+        _flushes.push_back(std::move(cb));
+    }
+    // after its tasks the loop spins on non-blocking polls for up to spin microseconds before
+    // blocking in the poller, trading a busy CPU for wakeup latency; 0 always blocks
+    void setBusyPoll(uint64_t spin)
+    {
+        _busyPollNs.store(spin * 1000, std::memory_order_relaxed);
+    }
+    // queues behind every task queued so far, by other threads and by the loop thread itself
+    void queueAfterPending(callback_t cb)
+    {
+        if(isInLoopThread())
+        {
+            // the loop's own tasks drain first, so this pushes once they are done, and the
+            // drain that follows them takes it in turn
+            _localPending.push_back([this, cb = std::move(cb)]() mutable {_pending.push(std::move(cb));});
+            return;
+        }
+        pushPending(std::move(cb));
     }
     bool isInLoopThread() const
     {
@@ -57,15 +171,40 @@ public:
     }
     void updateEvent(Channel* ch)
     {
-        _poller.update(ch);
+        _poller->update(ch);
     }
     void removeEvent(Channel* ch)
     {
-        _poller.remove(ch);
+        _poller->remove(ch);
+    }
+    Poller* poller() const {return _poller.get();}
+    // timeout in seconds; the wheel itself works in milliseconds
+    void runAfter(uint64_t id, uint64_t timeout, TimerWheel::TaskFunc task)
+    {
+        _timeWheel.addTask(id, timeout * 1000, std::move(task));
+    }
+    void runAfter(uint64_t id, std::chrono::milliseconds timeout, TimerWheel::TaskFunc task)
+    {
+        _timeWheel.addTask(id, toMs(timeout), std::move(task));
     }
-    void runAfter(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task)
+    // handle timers with millisecond resolution; steady_clock is the CLOCK_MONOTONIC that
+    // TimerWheel::monotonicMs() reads. Callable from any thread, as is cancel()
+    TimerId runAt(std::chrono::steady_clock::time_point when, TimerWheel::TaskFunc task)
     {
-        _timeWheel.addTask(id, timeout, task);
+        return _timeWheel.addTimer(toMs(when.time_since_epoch()), 0, std::move(task));
+    }
+    TimerId runAfter(std::chrono::milliseconds delay, TimerWheel::TaskFunc task)
+    {
+        return _timeWheel.addTimer(TimerWheel::monotonicMs() + toMs(delay), 0, std::move(task));
+    }
+    TimerId runEvery(std::chrono::milliseconds interval, TimerWheel::TaskFunc task)
+    {
+        uint64_t period = std::max<uint64_t>(toMs(interval), 1);
+        return _timeWheel.addTimer(TimerWheel::monotonicMs() + period, period, std::move(task));
+    }
+    void cancel(TimerId timer)
+    {
+        _timeWheel.cancel(timer);
     }
     void refreshAfter(uint64_t id)
     {
@@ -83,16 +222,64 @@ public:
     {
         while(1)
         {
-            std::vector<Channel*> activeChannels;
-            _poller.poll(activeChannels);
-            for(auto& ch : activeChannels)
+            _activeChannels.clear();
+            waitEvents();
+            uint64_t busyStart = LoopLoad::nowNs();
+            _pollTime = busyStart / 1000000;
+            // awake: tasks queued from now on are picked up by runPendingTasks without a wakeup
+            _wakeupPending.store(true);
+            for(auto& ch : _activeChannels)
             {
                 ch->handleEvent();
             }
             runPendingTasks();
+            runFlushes();
+            uint64_t busyEnd = LoopLoad::nowNs();
+            _load.addBusy(busyEnd, busyEnd - busyStart);
         }
     }
 private:
+    void waitEvents()
+    {
+        if(!_localPending.empty() || !_flushes.empty() || _pendingBacklog)
+        {
+            _poller->poll(_activeChannels, 0);
+            return;
+        }
+        uint64_t spin = _busyPollNs.load(std::memory_order_relaxed);
+        if(spin > 0)
+        {
+            // producers see the loop awake and skip the eventfd write while it spins
+            _wakeupPending.store(true);
+            uint64_t deadline = LoopLoad::nowNs() + spin;
+            do
+            {
+                _poller->poll(_activeChannels, 0);
+                if(!_activeChannels.empty() || !_pending.empty())
+                {
+                    return;
+                }
+            } while(LoopLoad::nowNs() < deadline);
+            // a task pushed before the exchange shows up in empty(), one pushed after it
+            // finds false and writes the eventfd
+            _wakeupPending.exchange(false);
+            if(!_pending.empty())
+            {
+                return;
+            }
+        }
+        _poller->poll(_activeChannels, -1);
+    }
+    void pushPending(callback_t cb)
+    {
+        _pending.push(std::move(cb));
+        // only the first producer after the loop starts draining pays for the eventfd write;
+        // while the loop is handling events or a wakeup is in flight, nothing is written
+        if(!_wakeupPending.exchange(true))
+        {
+            wakeup();
+        }
+    }
     void readEventfd()
     {
         uint64_t res;
@@ -120,34 +307,73 @@ private:
             exit(1);
         }
     }
+    // negative durations count as 0
+    template <typename Rep, typename Period>
+    static uint64_t toMs(std::chrono::duration<Rep, Period> d)
+    {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+        return ms > 0 ? static_cast<uint64_t>(ms) : 0;
+    }
     void runPendingTasks()
     {
-        std::queue<callback_t> tasks;
+        // clear before draining: a task pushed after this point either gets drained below
+        // or its producer sees false and wakes the next poll
+        _wakeupPending.store(false);
+        _pendingBacklog = false;
+        // the loop's own tasks first, what they queue waits for the next iteration
+        _runningTasks.swap(_localPending);
+        for(auto& t : _runningTasks)
         {
-            std::lock_guard<std::mutex> lock(_mutex);
-            tasks.swap(_pending);
+            t();
         }
-        while(!tasks.empty())
+        _runningTasks.clear();
+        callback_t task;
+        int n = 0;
+        while(_pending.pop(task))
         {
-            auto task = tasks.front();
-            tasks.pop();
             task();
+            if(++n == kMaxPendingPerIteration)
+            {
+                _pendingBacklog = true;
+                break;
+            }
         }
     }
+    void runFlushes()
+    {
+        // flushes queued by these run in the next iteration
+        _runningTasks.swap(_flushes);
+        for(auto& t : _runningTasks)
+        {
+            t();
+        }
+        _runningTasks.clear();
+    }
 private:
     int _eventFd;
     std::thread::id _tid;
     Channel* _eventch;
-    Poller _poller;
+    std::unique_ptr<Poller> _poller;
+    std::vector<Channel*> _activeChannels;
     TimerWheel _timeWheel;
-    std::queue<callback_t> _pending;
-    std::mutex _mutex;
+    BufferPool _bufferPool;
+    MpscQueue<callback_t> _pending;          // from other threads
+    std::vector<callback_t> _localPending;   // from the loop thread itself
+    std::vector<callback_t> _flushes;        // end of iteration callbacks
+    std::vector<callback_t> _runningTasks;
+    std::atomic<bool> _wakeupPending;        // loop is awake or an eventfd write is in flight
+    bool _pendingBacklog;                    // _pending was not fully drained last iteration
+    uint64_t _pollTime;
+    std::atomic<uint64_t> _busyPollNs;       // spin budget before blocking, 0 to block right away
+    LoopLoad _load;
 };
 
 class LoopThread
 {
 public:
-    LoopThread() : _thread(std::thread([this] { threadEntry(); })), _loop(nullptr){}
+    // cpu >= 0 pins the thread to that CPU; name shows up in ps/top (15 chars at most)
+    explicit LoopThread(PollerBackend backend = PollerBackend::K_EPOLL, int cpu = -1, const std::string& name = "loop")
+    : _backend(backend), _cpu(cpu), _name(name), _loop(nullptr), _thread(std::thread([this] { threadEntry(); })){}
     ~LoopThread()
     {
         if(_thread.joinable())
@@ -164,7 +390,20 @@ public:
 private:
     void threadEntry()
     {
-        EventLoop loop;
+        pthread_setname_np(pthread_self(), _name.substr(0, 15).c_str());
+        if(_cpu >= 0)
+        {
+            // pinned before the loop exists, so the memory it first touches is on the CPU's NUMA node
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(_cpu, &set);
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if(err != 0)
+            {
+                fprintf(stderr, "pthread_setaffinity_np cpu %d: %s\n", _cpu, strerror(err));
+            }
+        }
+        EventLoop loop(_backend);
         {
             std::lock_guard<std::mutex> lock(_mutex);
             _loop = &loop;
@@ -173,8 +412,11 @@ private:
         loop.start();
     }
 private:
-    std::thread _thread;
+    PollerBackend _backend;
+    int _cpu;
+    std::string _name;
     EventLoop* _loop;
     std::mutex _mutex;
     std::condition_variable _cond;
+    std::thread _thread; // last: threadEntry uses the members above
 };
\ No newline at end of file
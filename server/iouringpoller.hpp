@@ -0,0 +1,967 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include "poller.hpp"
+
+// io_uring backend. Interest changes are queued as SQEs and submitted together with the wait
+// in a single io_uring_enter, so a loop iteration costs one syscall no matter how many channels
+// changed. Readiness channels get polls: level-triggered ones a one-shot poll re-armed before
+// the next wait (the same semantics as epoll LT), edge-triggered ones a multishot poll.
+// On kernels with provided-buffer rings the backend also does the I/O of channels that opt in:
+// a listener gets a multishot accept, a connection a multishot recv filling buffers from a ring
+// the whole loop shares, and its sends become SENDMSG requests submitted with the next wait.
+// Results wait in the channel's slot until the owner takes them. A level-triggered channel that
+// leaves some behind is reported again, like a readable fd under epoll LT.
+class IoUringPoller : public Poller
+{
+public:
+    static constexpr unsigned kEntries = 1024;
+    static constexpr unsigned kRecvBuffers = 256;          // power of two
+    static constexpr size_t kRecvBufferSize = 16 * 1024;
+    static constexpr uint16_t kBufferGroup = 0;
+
+    IoUringPoller() : _ringFd(-1), _sqRing(nullptr), _cqRing(nullptr), _sqes(nullptr),
+    _sqRingSize(0), _cqRingSize(0), _toSubmit(0), _round(0), _freeSlot(-1),
+    _bufRing(nullptr), _bufBase(nullptr), _buffersHeld(0)
+    {
+        io_uring_params params{};
+        _ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, kEntries, &params));
+        if(_ringFd < 0)
+        {
+            _ringFd = -1;
+            return;
+        }
+        if(!mapRings(params))
+        {
+            unmapRings();
+            ::close(_ringFd);
+            _ringFd = -1;
+            return;
+        }
+        // buffer rings and multishot accept need 5.19, multishot recv 6.0; without them
+        // every channel stays on readiness polls
+        if(!setupBufferRing() || !probeRecvMultishot())
+        {
+            releaseBufferRing();
+        }
+    }
+    ~IoUringPoller() override
+    {
+        if(_ringFd != -1)
+        {
+            unmapRings();
+            ::close(_ringFd);
+            _ringFd = -1;
+        }
+        for(Slot& slot : _slots)
+        {
+            for(size_t i = slot.acceptHead; i < slot.accepted.size(); i++)
+            {
+                ::close(slot.accepted[i]);
+            }
+        }
+        releaseBufferRing();
+    }
+    bool valid() const { return _ringFd != -1; }
+
+    void update(Channel* ch) override
+    {
+        if(!ch->isRegistered())
+        {
+            int index = allocSlot(ch);
+            ch->setIndex(index);
+            ch->setRegistered(true);
+            _slots[index].mode == Channel::kReadiness ? arm(index) : updateIo(index);
+            return;
+        }
+        Slot& slot = _slots[ch->getIndex()];
+        if(slot.mode != Channel::kReadiness)
+        {
+            updateIo(ch->getIndex());
+            return;
+        }
+        uint32_t events = pollMask(ch->getEvents());
+        bool edge = ch->edgeTriggered();
+        if(!slot.armed)
+        {
+            // re-armed with the current interest before the next wait
+            queueRearm(ch->getIndex());
+            return;
+        }
+        if(edge != slot.multishot)
+        {
+            cancel(ch->getIndex());
+            slot.gen++;
+            arm(ch->getIndex());
+            return;
+        }
+        if(events != slot.events)
+        {
+            io_uring_sqe* sqe = getSqe();
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = userData(ch->getIndex(), kOpPoll);
+            sqe->len = IORING_POLL_UPDATE_EVENTS | (slot.multishot ? IORING_POLL_ADD_MULTI : 0);
+            sqe->poll32_events = events;
+            sqe->user_data = kInternal;
+            slot.events = events;
+        }
+    }
+    void remove(Channel* ch) override
+    {
+        if(!ch->isRegistered())
+        {
+            return;
+        }
+        int index = ch->getIndex();
+        Slot& slot = _slots[index];
+        if(slot.armed)
+        {
+            cancel(index);
+        }
+        if(slot.ioArmed && !slot.ioCancelled)
+        {
+            cancelIo(index);
+        }
+        dropResults(slot);
+        // late completions carry the old generation and are dropped
+        slot.ch = nullptr;
+        slot.gen++;
+        slot.nextFree = _freeSlot;
+        _freeSlot = index;
+        ch->setRegistered(false);
+        ch->setIndex(-1);
+    }
+    bool poll(std::vector<Channel*>& activeChannels, int timeout = -1) override
+    {
+        _rearming.swap(_rearm);
+        for(int index : _rearming)
+        {
+            rearm(index);
+        }
+        _rearming.clear();
+        for(int index : _reported)
+        {
+            Slot& slot = _slots[index];
+            if(slot.ch != nullptr && !slot.ch->edgeTriggered())
+            {
+                queueCarry(index);
+            }
+        }
+        _reported.clear();
+        if(!_carry.empty())
+        {
+            timeout = 0;
+        }
+        if(!enter(timeout))
+        {
+            return false;
+        }
+        reap(activeChannels);
+        return true;
+    }
+
+    bool completionIo() const override { return _bufRing != nullptr; }
+    int takeAccepted(Channel* ch) override
+    {
+        if(!ch->isRegistered())
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        Slot& slot = _slots[ch->getIndex()];
+        if(slot.acceptHead < slot.accepted.size())
+        {
+            int fd = slot.accepted[slot.acceptHead++];
+            if(slot.acceptHead == slot.accepted.size())
+            {
+                slot.accepted.clear();
+                slot.acceptHead = 0;
+            }
+            return fd;
+        }
+        if(slot.error != 0)
+        {
+            // the multishot accept ended with it, listening goes on after this report
+            errno = slot.error;
+            slot.error = 0;
+            queueRearm(ch->getIndex());
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t takeReceived(Channel* ch, Buffer* buf) override
+    {
+        if(!ch->isRegistered())
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        Slot& slot = _slots[ch->getIndex()];
+        if(slot.recvHead == -1)
+        {
+            if(slot.error != 0)
+            {
+                errno = slot.error;
+                slot.error = 0;
+                return -1;
+            }
+            if(slot.eof)
+            {
+                slot.eof = false;
+                return 0;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t total = 0;
+        while(slot.recvHead != -1)
+        {
+            int bid = slot.recvHead;
+            slot.recvHead = _bufNext[bid];
+            buf->write(bufferAt(bid), _bufLen[bid]);
+            total += _bufLen[bid];
+            recycleBuffer(bid);
+        }
+        slot.recvTail = -1;
+        return static_cast<ssize_t>(total);
+    }
+    bool submitSend(Channel* ch, const iovec* iov, int iovcnt) override
+    {
+        if(!ch->isRegistered() || iovcnt <= 0)
+        {
+            return false;
+        }
+        int index = ch->getIndex();
+        Slot& slot = _slots[index];
+        if(slot.mode != Channel::kRecv || slot.sendArmed)
+        {
+            return false;
+        }
+        // both live in the slot until the completion, slots never move
+        slot.iov.assign(iov, iov + iovcnt);
+        slot.msg = msghdr{};
+        slot.msg.msg_iov = slot.iov.data();
+        slot.msg.msg_iovlen = iovcnt;
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = ch->getFd();
+        sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData(index, kOpSend);
+        slot.sendArmed = true;
+        slot.sendDone = false;
+        return true;
+    }
+    ssize_t takeSent(Channel* ch) override
+    {
+        if(!ch->isRegistered() || !_slots[ch->getIndex()].sendDone)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        Slot& slot = _slots[ch->getIndex()];
+        slot.sendDone = false;
+        if(slot.sendResult < 0)
+        {
+            errno = -slot.sendResult;
+            return -1;
+        }
+        return slot.sendResult;
+    }
+    bool busy(const Channel* ch) const override
+    {
+        if(!ch->isRegistered())
+        {
+            return false;
+        }
+        const Slot& slot = _slots[ch->getIndex()];
+        return slot.ioArmed || slot.sendArmed;
+    }
+private:
+    struct Slot
+    {
+        Channel* ch = nullptr;
+        uint32_t gen = 0;
+        int mode = Channel::kReadiness;
+        uint32_t events = 0;
+        uint32_t revents = 0;
+        uint64_t round = 0;      // poll round in which revents was collected
+        bool armed = false;      // a poll request is in flight
+        bool multishot = false;
+        bool rearmQueued = false;
+        bool carryQueued = false;
+        int nextFree = -1;
+        // completion mode
+        bool ioArmed = false;    // multishot accept or recv in flight, until its last completion
+        bool ioCancelled = false;
+        bool finished = false;   // the stream ended, recv is not armed again
+        bool eof = false;        // end of stream not yet taken
+        int error = 0;           // errno not yet taken
+        int recvHead = -1;       // received buffers in arrival order, linked through _bufNext
+        int recvTail = -1;
+        std::vector<int> accepted;
+        size_t acceptHead = 0;
+        bool sendArmed = false;
+        bool sendDone = false;
+        int sendResult = 0;
+        msghdr msg{};
+        std::vector<iovec> iov;
+    };
+    // user_data: generation in the high half, then the request kind and the slot index
+    static constexpr int kOpPoll = 0;
+    static constexpr int kOpRecv = 1;
+    static constexpr int kOpAccept = 2;
+    static constexpr int kOpSend = 3;
+    static constexpr uint64_t kIndexMask = (1u << 30) - 1;
+    static constexpr uint64_t kInternal = ~0ULL; // completions of update/cancel requests
+
+    static uint32_t pollMask(int events)
+    {
+        return static_cast<uint32_t>(events) & ~static_cast<uint32_t>(EPOLLET);
+    }
+    uint64_t userData(int index, int op) const
+    {
+        return (static_cast<uint64_t>(_slots[index].gen) << 32) | (static_cast<uint64_t>(op) << 30) |
+               static_cast<uint32_t>(index);
+    }
+    int allocSlot(Channel* ch)
+    {
+        int index = _freeSlot;
+        if(index == -1)
+        {
+            index = static_cast<int>(_slots.size());
+            _slots.emplace_back();
+        }
+        else
+        {
+            _freeSlot = _slots[index].nextFree;
+        }
+        Slot& slot = _slots[index];
+        uint32_t gen = slot.gen;
+        slot = Slot();
+        slot.gen = gen;
+        slot.ch = ch;
+        slot.mode = completionIo() ? ch->ioMode() : Channel::kReadiness;
+        return index;
+    }
+    void arm(int index)
+    {
+        Slot& slot = _slots[index];
+        slot.events = pollMask(slot.ch->getEvents());
+        slot.multishot = slot.ch->edgeTriggered();
+        if(slot.events == 0)
+        {
+            // nothing to watch, armed again by the next update with interest
+            slot.armed = false;
+            return;
+        }
+        armPoll(index);
+    }
+    void armPoll(int index)
+    {
+        Slot& slot = _slots[index];
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = slot.ch->getFd();
+        sqe->poll32_events = slot.events;
+        sqe->len = slot.multishot ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = userData(index, kOpPoll);
+        slot.armed = true;
+    }
+    void cancel(int index)
+    {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = userData(index, kOpPoll);
+        sqe->user_data = kInternal;
+        _slots[index].armed = false;
+    }
+    // completion mode: EPOLLIN interest runs the multishot accept/recv, EPOLLOUT interest
+    // a one-shot poll for owners that still write on readiness (sendfile)
+    void updateIo(int index)
+    {
+        Slot& slot = _slots[index];
+        if(slot.ch->readable())
+        {
+            if(!slot.ioArmed)
+            {
+                queueRearm(index);
+            }
+            if(hasResults(slot))
+            {
+                // what arrived while reading was off is reported again, even edge-triggered
+                queueCarry(index);
+            }
+        }
+        else if(slot.ioArmed && !slot.ioCancelled)
+        {
+            cancelIo(index);
+        }
+        if(slot.ch->writable() && !slot.armed)
+        {
+            slot.events = EPOLLOUT;
+            slot.multishot = false;
+            armPoll(index);
+        }
+        else if(!slot.ch->writable() && slot.armed)
+        {
+            cancel(index);
+        }
+    }
+    void armIo(int index)
+    {
+        Slot& slot = _slots[index];
+        io_uring_sqe* sqe = getSqe();
+        sqe->fd = slot.ch->getFd();
+        if(slot.mode == Channel::kAccept)
+        {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = userData(index, kOpAccept);
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = _recvMultishot ? IORING_RECV_MULTISHOT : 0;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = kBufferGroup;
+            sqe->user_data = userData(index, kOpRecv);
+        }
+        slot.ioArmed = true;
+        slot.ioCancelled = false;
+    }
+    void cancelIo(int index)
+    {
+        Slot& slot = _slots[index];
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = userData(index, slot.mode == Channel::kAccept ? kOpAccept : kOpRecv);
+        sqe->user_data = kInternal;
+        // completions keep coming until the one without IORING_CQE_F_MORE
+        slot.ioCancelled = true;
+    }
+    void rearm(int index)
+    {
+        Slot& slot = _slots[index];
+        slot.rearmQueued = false;
+        if(slot.ch == nullptr)
+        {
+            return;
+        }
+        if(slot.mode == Channel::kReadiness)
+        {
+            if(!slot.armed)
+            {
+                arm(index);
+            }
+            return;
+        }
+        if(slot.ch->writable() && !slot.armed)
+        {
+            slot.events = EPOLLOUT;
+            slot.multishot = false;
+            armPoll(index);
+        }
+        if(!slot.ch->readable() || slot.ioArmed || slot.finished || slot.error != 0)
+        {
+            return;
+        }
+        if(slot.mode == Channel::kRecv && _buffersHeld == kRecvBuffers)
+        {
+            // every buffer waits to be taken, try again once some came back
+            queueRearm(index);
+            return;
+        }
+        armIo(index);
+    }
+    void queueRearm(int index)
+    {
+        if(!_slots[index].rearmQueued)
+        {
+            _slots[index].rearmQueued = true;
+            _rearm.push_back(index);
+        }
+    }
+    void queueCarry(int index)
+    {
+        Slot& slot = _slots[index];
+        if(!slot.carryQueued && hasResults(slot))
+        {
+            slot.carryQueued = true;
+            _carry.push_back(index);
+        }
+    }
+    static bool hasResults(const Slot& slot)
+    {
+        return slot.recvHead != -1 || slot.eof || slot.error != 0 || slot.acceptHead < slot.accepted.size();
+    }
+    void dropResults(Slot& slot)
+    {
+        while(slot.recvHead != -1)
+        {
+            int bid = slot.recvHead;
+            slot.recvHead = _bufNext[bid];
+            recycleBuffer(bid);
+        }
+        slot.recvTail = -1;
+        for(size_t i = slot.acceptHead; i < slot.accepted.size(); i++)
+        {
+            ::close(slot.accepted[i]);
+        }
+        slot.accepted.clear();
+        slot.acceptHead = 0;
+        slot.eof = false;
+        slot.error = 0;
+    }
+    io_uring_sqe* getSqe()
+    {
+        unsigned tail = *_sqTail;
+        if(tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) == *_sqEntries)
+        {
+            // ring full: push what we have without waiting
+            submit(0, 0, nullptr);
+            tail = *_sqTail;
+        }
+        unsigned idx = tail & *_sqMask;
+        io_uring_sqe* sqe = &_sqes[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        _sqArray[idx] = idx;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+        _toSubmit++;
+        return sqe;
+    }
+    bool submit(unsigned minComplete, unsigned flags, io_uring_getevents_arg* arg)
+    {
+        int ret = static_cast<int>(::syscall(__NR_io_uring_enter, _ringFd, _toSubmit, minComplete, flags,
+                                             arg, arg ? sizeof(*arg) : 0));
+        if(ret >= 0)
+        {
+            _toSubmit -= std::min<unsigned>(ret, _toSubmit);
+            return true;
+        }
+        return errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN;
+    }
+    bool enter(int timeout)
+    {
+        if(timeout == 0)
+        {
+            // still enter the kernel so pending poll completions get posted
+            return submit(0, IORING_ENTER_GETEVENTS, nullptr);
+        }
+        if(timeout < 0)
+        {
+            return submit(1, IORING_ENTER_GETEVENTS, nullptr);
+        }
+        __kernel_timespec ts{};
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        io_uring_getevents_arg arg{};
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        return submit(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+    }
+    void reap(std::vector<Channel*>& activeChannels)
+    {
+        _round++;
+        size_t first = activeChannels.size();
+        unsigned head = *_cqHead;
+        unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++)
+        {
+            const io_uring_cqe& cqe = _cqes[head & *_cqMask];
+            if(cqe.user_data == kInternal)
+            {
+                continue;
+            }
+            uint32_t index = static_cast<uint32_t>(cqe.user_data & kIndexMask);
+            int op = static_cast<int>((cqe.user_data >> 30) & 3);
+            uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32);
+            if(index >= _slots.size() || _slots[index].gen != gen || _slots[index].ch == nullptr)
+            {
+                dropStale(cqe, op);
+                continue;
+            }
+            switch(op)
+            {
+            case kOpPoll:
+                onPoll(index, cqe, activeChannels);
+                break;
+            case kOpSend:
+                _slots[index].sendArmed = false;
+                _slots[index].sendDone = true;
+                _slots[index].sendResult = cqe.res;
+                report(index, EPOLLOUT, activeChannels);
+                break;
+            default:
+                onIo(index, cqe, activeChannels);
+                break;
+            }
+        }
+        __atomic_store_n(_cqHead, tail, __ATOMIC_RELEASE);
+        for(int index : _carry)
+        {
+            Slot& slot = _slots[index];
+            slot.carryQueued = false;
+            if(slot.ch != nullptr && slot.ch->readable() && hasResults(slot))
+            {
+                report(index, EPOLLIN, activeChannels);
+            }
+        }
+        _carry.clear();
+        for(size_t i = first; i < activeChannels.size(); i++)
+        {
+            Channel* ch = activeChannels[i];
+            ch->setRevents(_slots[ch->getIndex()].revents);
+        }
+    }
+    void onPoll(uint32_t index, const io_uring_cqe& cqe, std::vector<Channel*>& activeChannels)
+    {
+        Slot& slot = _slots[index];
+        if(!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            slot.armed = false;
+            queueRearm(index);
+        }
+        if(cqe.res > 0)
+        {
+            report(index, static_cast<uint32_t>(cqe.res), activeChannels);
+        }
+    }
+    void onIo(uint32_t index, const io_uring_cqe& cqe, std::vector<Channel*>& activeChannels)
+    {
+        Slot& slot = _slots[index];
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if(!more)
+        {
+            slot.ioArmed = false;
+            slot.ioCancelled = false;
+        }
+        if(slot.mode == Channel::kAccept)
+        {
+            if(cqe.res >= 0)
+            {
+                slot.accepted.push_back(cqe.res);
+            }
+            else if(cqe.res != -ECANCELED)
+            {
+                slot.error = -cqe.res;
+            }
+        }
+        else
+        {
+            if(cqe.flags & IORING_CQE_F_BUFFER)
+            {
+                int bid = static_cast<int>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                _buffersHeld++;
+                if(cqe.res > 0)
+                {
+                    appendReceived(slot, bid, static_cast<uint32_t>(cqe.res));
+                }
+                else
+                {
+                    recycleBuffer(bid);
+                }
+            }
+            if(cqe.res == 0)
+            {
+                slot.eof = true;
+                slot.finished = true;
+            }
+            else if(cqe.res == -EINVAL && _recvMultishot && !more)
+            {
+                // the kernel refused the multishot flag after all: every recv from now on is
+                // a one-shot one, re-armed after each completion like after ENOBUFS
+                _recvMultishot = false;
+            }
+            else if(cqe.res < 0 && cqe.res != -ECANCELED && cqe.res != -ENOBUFS)
+            {
+                slot.error = -cqe.res;
+                slot.finished = true;
+            }
+        }
+        if(!more)
+        {
+            // ended by a cancel, an error or a lack of buffers: runs again while wanted
+            queueRearm(index);
+        }
+        if(slot.ch->readable() && hasResults(slot))
+        {
+            report(index, EPOLLIN, activeChannels);
+        }
+    }
+    void dropStale(const io_uring_cqe& cqe, int op)
+    {
+        if(op == kOpRecv && (cqe.flags & IORING_CQE_F_BUFFER))
+        {
+            _buffersHeld++;
+            recycleBuffer(static_cast<int>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        else if(op == kOpAccept && cqe.res >= 0)
+        {
+            ::close(cqe.res);
+        }
+    }
+    void report(uint32_t index, uint32_t revents, std::vector<Channel*>& activeChannels)
+    {
+        Slot& slot = _slots[index];
+        if(slot.round != _round)
+        {
+            slot.round = _round;
+            slot.revents = 0;
+            activeChannels.push_back(slot.ch);
+            if(slot.mode != Channel::kReadiness)
+            {
+                _reported.push_back(index);
+            }
+        }
+        slot.revents |= revents;
+    }
+    void appendReceived(Slot& slot, int bid, uint32_t len)
+    {
+        _bufLen[bid] = len;
+        _bufNext[bid] = -1;
+        if(slot.recvTail == -1)
+        {
+            slot.recvHead = bid;
+        }
+        else
+        {
+            _bufNext[slot.recvTail] = bid;
+        }
+        slot.recvTail = bid;
+    }
+    char* bufferAt(int bid) const
+    {
+        return _bufBase + static_cast<size_t>(bid) * kRecvBufferSize;
+    }
+    // hands a buffer back to the kernel; only this thread writes the ring tail
+    void recycleBuffer(int bid)
+    {
+        uint16_t tail = _bufRing->tail;
+        // not _bufRing->bufs: in C++ the header's flex array member sits 8 bytes into the ring
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(_bufRing)[tail & (kRecvBuffers - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(bufferAt(bid));
+        buf.len = kRecvBufferSize;
+        buf.bid = static_cast<uint16_t>(bid);
+        __atomic_store_n(&_bufRing->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+        _buffersHeld--;
+    }
+    bool setupBufferRing()
+    {
+        _bufRingSize = kRecvBuffers * sizeof(io_uring_buf);
+        void* ring = ::mmap(nullptr, _bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ring == MAP_FAILED)
+        {
+            return false;
+        }
+        _bufRing = static_cast<io_uring_buf_ring*>(ring);
+        // untouched buffers cost no memory, pages are faulted in as data arrives
+        void* base = ::mmap(nullptr, kRecvBuffers * kRecvBufferSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED)
+        {
+            return false;
+        }
+        _bufBase = static_cast<char*>(base);
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(_bufRing);
+        reg.ring_entries = kRecvBuffers;
+        reg.bgid = kBufferGroup;
+        if(::syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        {
+            return false;
+        }
+        _bufNext.assign(kRecvBuffers, -1);
+        _bufLen.assign(kRecvBuffers, 0);
+        _buffersHeld = kRecvBuffers;
+        for(unsigned bid = 0; bid < kRecvBuffers; bid++)
+        {
+            recycleBuffer(static_cast<int>(bid));
+        }
+        return true;
+    }
+    // posts a multishot recv on a socketpair: one byte must complete with IORING_CQE_F_MORE,
+    // the peer's close then ends the request
+    bool probeRecvMultishot()
+    {
+        int sv[2];
+        if(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        {
+            return false;
+        }
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        sqe->user_data = kInternal;
+        bool multishot = false;
+        bool done = ::write(sv[1], "p", 1) != 1;
+        while(!done && submit(1, IORING_ENTER_GETEVENTS, nullptr))
+        {
+            unsigned head = *_cqHead;
+            unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+            for(; head != tail; head++)
+            {
+                const io_uring_cqe& cqe = _cqes[head & *_cqMask];
+                if(cqe.flags & IORING_CQE_F_BUFFER)
+                {
+                    _buffersHeld++;
+                    recycleBuffer(static_cast<int>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                }
+                if(cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE))
+                {
+                    multishot = true;
+                    ::close(sv[1]);
+                    sv[1] = -1;
+                }
+                if(!(cqe.flags & IORING_CQE_F_MORE))
+                {
+                    done = true;
+                }
+            }
+            __atomic_store_n(_cqHead, tail, __ATOMIC_RELEASE);
+        }
+        ::close(sv[0]);
+        if(sv[1] != -1)
+        {
+            ::close(sv[1]);
+        }
+        return multishot && done;
+    }
+    void releaseBufferRing()
+    {
+        if(_bufRing != nullptr && _ringFd != -1)
+        {
+            io_uring_buf_reg reg{};
+            reg.bgid = kBufferGroup;
+            ::syscall(__NR_io_uring_register, _ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        if(_bufBase != nullptr)
+        {
+            ::munmap(_bufBase, kRecvBuffers * kRecvBufferSize);
+        }
+        if(_bufRing != nullptr)
+        {
+            ::munmap(_bufRing, _bufRingSize);
+        }
+        _bufBase = nullptr;
+        _bufRing = nullptr;
+    }
+    bool mapRings(const io_uring_params& params)
+    {
+        _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single)
+        {
+            _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+        }
+        _sqRing = ::mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         _ringFd, IORING_OFF_SQ_RING);
+        if(_sqRing == MAP_FAILED)
+        {
+            _sqRing = nullptr;
+            return false;
+        }
+        if(single)
+        {
+            _cqRing = _sqRing;
+        }
+        else
+        {
+            _cqRing = ::mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             _ringFd, IORING_OFF_CQ_RING);
+            if(_cqRing == MAP_FAILED)
+            {
+                _cqRing = nullptr;
+                return false;
+            }
+        }
+        void* sqes = ::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED)
+        {
+            return false;
+        }
+        _sqes = static_cast<io_uring_sqe*>(sqes);
+        _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        char* sq = static_cast<char*>(_sqRing);
+        char* cq = static_cast<char*>(_cqRing);
+        _sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        _sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        _sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        _sqEntries = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+        _sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        _cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        _cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+    void unmapRings()
+    {
+        if(_sqes != nullptr)
+        {
+            ::munmap(_sqes, _sqesSize);
+        }
+        if(_cqRing != nullptr && _cqRing != _sqRing)
+        {
+            ::munmap(_cqRing, _cqRingSize);
+        }
+        if(_sqRing != nullptr)
+        {
+            ::munmap(_sqRing, _sqRingSize);
+        }
+        _sqes = nullptr;
+        _cqRing = _sqRing = nullptr;
+    }
+private:
+    int _ringFd;
+    void* _sqRing;
+    void* _cqRing;
+    io_uring_sqe* _sqes;
+    size_t _sqRingSize;
+    size_t _cqRingSize;
+    size_t _sqesSize = 0;
+    unsigned* _sqHead = nullptr;
+    unsigned* _sqTail = nullptr;
+    unsigned* _sqMask = nullptr;
+    unsigned* _sqEntries = nullptr;
+    unsigned* _sqArray = nullptr;
+    unsigned* _cqHead = nullptr;
+    unsigned* _cqTail = nullptr;
+    unsigned* _cqMask = nullptr;
+    io_uring_cqe* _cqes = nullptr;
+    unsigned _toSubmit;
+    uint64_t _round;
+    int _freeSlot;
+    std::deque<Slot> _slots;   // a deque so a slot's msghdr never moves while a send is queued
+    std::vector<int> _rearm;   // slots whose request ended or must be (re)started
+    std::vector<int> _rearming;
+    std::vector<int> _carry;   // slots with results to report without a new completion
+    std::vector<int> _reported; // completion slots reported in the last round
+    io_uring_buf_ring* _bufRing;
+    size_t _bufRingSize = 0;
+    char* _bufBase;
+    unsigned _buffersHeld;     // buffers not in the ring: filled, waiting to be taken
+    bool _recvMultishot = true;
+    std::vector<int> _bufNext;
+    std::vector<uint32_t> _bufLen;
+};
@@ -2,14 +2,40 @@
 #include <vector>
 #include <memory>
 #include <thread>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <sched.h>
 #include "eventloop.hpp"
 
+enum class PlacementPolicy
+{
+    K_ROUND_ROBIN,
+    K_LEAST_CONNECTIONS, // fewest open connections, scans every loop
+    K_LEAST_BUSY,        // least recent busy time, scans every loop
+    K_POWER_OF_TWO,      // the less busy of two random loops
+    K_PEER_HASH,         // consistent hash of the peer address, keeps a client on one loop
+    K_INCOMING_CPU       // loop pinned to the CPU that received the connection (SO_INCOMING_CPU),
+                         // round robin when no loop is pinned there
+};
+
 class LoopThreadPool
 {
 public:
-    explicit LoopThreadPool(EventLoop* baseLoop, int threadNum = std::thread::hardware_concurrency())
+    // overrides the policy: gets the worker loops and the peer hash, returns one of them
+    using placementCallback = std::function<EventLoop*(const std::vector<EventLoop*>&, uint64_t)>;
+    static constexpr int kVirtualNodes = 64; // ring points per loop for K_PEER_HASH
+
+    // worker i is pinned to cpus[i % cpus.size()] when cpus is not empty; the default thread
+    // count is the number of CPUs the process may run on, which respects taskset and cpusets
+    explicit LoopThreadPool(EventLoop* baseLoop, int threadNum = static_cast<int>(allowedCpus().size()),
+                            PollerBackend backend = PollerBackend::K_EPOLL, const std::vector<int>& cpus = {})
     : _threadNum(threadNum),
     _next(0),
+    _policy(PlacementPolicy::K_ROUND_ROBIN),
+    _random(0x9e3779b97f4a7c15ULL),
+    _backend(backend),
+    _cpus(cpus),
     _baseLoop(baseLoop)
     {
 
@@ -18,24 +44,159 @@ public:
     {
         for(int i = 0; i < _threadNum; i++)
         {
-            LoopThread* lt = new LoopThread();
+            int cpu = _cpus.empty() ? -1 : _cpus[i % _cpus.size()];
+            LoopThread* lt = new LoopThread(_backend, cpu, "loop-" + std::to_string(i));
             _threads.push_back(lt);
             _loops.push_back(lt->getLoop());
+            _loopCpus.push_back(cpu);
+            if(cpu >= 0)
+            {
+                if(static_cast<size_t>(cpu) >= _cpuLoops.size())
+                {
+                    _cpuLoops.resize(cpu + 1, nullptr);
+                }
+                if(_cpuLoops[cpu] == nullptr)
+                {
+                    _cpuLoops[cpu] = _loops.back();
+                }
+            }
+        }
+        for(size_t i = 0; i < _loops.size(); i++)
+        {
+            for(int v = 0; v < kVirtualNodes; v++)
+            {
+                _ring.emplace_back(mix((i << 32) | v), _loops[i]);
+            }
         }
+        std::sort(_ring.begin(), _ring.end());
     }
-    EventLoop* getNextLoop()
+    void setPlacementPolicy(PlacementPolicy policy) {_policy = policy;}
+    void setPlacementCallback(const placementCallback& cb) {_placementCb = cb;}
+    PlacementPolicy placementPolicy() const {return _policy;}
+    // CPU each worker loop is pinned to, -1 for unpinned, in getAllLoops() order
+    const std::vector<int>& loopCpus() const {return _loopCpus;}
+    // CPUs in the process's affinity mask
+    static std::vector<int> allowedCpus()
     {
-        EventLoop* loop = _baseLoop;
-        if(!_loops.empty())
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(set), &set) == -1)
+        {
+            for(unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++)
+            {
+                cpus.push_back(static_cast<int>(i));
+            }
+            return cpus;
+        }
+        for(int i = 0; i < CPU_SETSIZE; i++)
+        {
+            if(CPU_ISSET(i, &set))
+            {
+                cpus.push_back(i);
+            }
+        }
+        return cpus;
+    }
+    // peerHash is only used by K_PEER_HASH and custom callbacks, incomingCpu by K_INCOMING_CPU;
+    // not thread-safe, called from the accepting loop
+    EventLoop* getNextLoop(uint64_t peerHash = 0, int incomingCpu = -1)
+    {
+        if(_loops.empty())
+        {
+            return _baseLoop;
+        }
+        if(_placementCb)
+        {
+            return _placementCb(_loops, peerHash);
+        }
+        switch(_policy)
+        {
+        case PlacementPolicy::K_LEAST_CONNECTIONS:
+            return *std::min_element(_loops.begin(), _loops.end(), [](EventLoop* a, EventLoop* b) {
+                return a->load().connections() < b->load().connections();
+            });
+        case PlacementPolicy::K_LEAST_BUSY:
+            return *std::min_element(_loops.begin(), _loops.end(), [](EventLoop* a, EventLoop* b) {
+                return lessLoaded(a, b);
+            });
+        case PlacementPolicy::K_POWER_OF_TWO:
+        {
+            if(_loops.size() == 1)
+            {
+                return _loops[0];
+            }
+            size_t i = nextRandom() % _loops.size();
+            size_t j = nextRandom() % (_loops.size() - 1);
+            EventLoop* a = _loops[i];
+            EventLoop* b = _loops[j >= i ? j + 1 : j];
+            return lessLoaded(b, a) ? b : a;
+        }
+        case PlacementPolicy::K_PEER_HASH:
+        {
+            auto it = std::lower_bound(_ring.begin(), _ring.end(), std::make_pair(mix(peerHash), static_cast<EventLoop*>(nullptr)));
+            return it == _ring.end() ? _ring.front().second : it->second;
+        }
+        case PlacementPolicy::K_INCOMING_CPU:
+            if(incomingCpu >= 0 && static_cast<size_t>(incomingCpu) < _cpuLoops.size() && _cpuLoops[incomingCpu] != nullptr)
+            {
+                return _cpuLoops[incomingCpu];
+            }
+            // fall through
+        default:
         {
-            loop = _loops[_next];
+            EventLoop* loop = _loops[_next];
             _next = (_next + 1) % _threadNum;
+            return loop;
         }
-        return loop;
+        }
+    }
+    std::vector<EventLoop*> getAllLoops() const
+    {
+        if(_loops.empty())
+        {
+            return std::vector<EventLoop*>(1, _baseLoop);
+        }
+        return _loops;
+    }
+private:
+    // recent busy time first, open connections to break ties between idle loops
+    static bool lessLoaded(EventLoop* a, EventLoop* b)
+    {
+        uint64_t busyA = a->load().recentBusy();
+        uint64_t busyB = b->load().recentBusy();
+        if(busyA != busyB)
+        {
+            return busyA < busyB;
+        }
+        return a->load().connections() < b->load().connections();
+    }
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    uint64_t nextRandom()
+    {
+        _random ^= _random << 13;
+        _random ^= _random >> 7;
+        _random ^= _random << 17;
+        return _random;
     }
 private:
     int _threadNum;
     int _next;
+    PlacementPolicy _policy;
+    placementCallback _placementCb;
+    uint64_t _random;
+    std::vector<std::pair<uint64_t, EventLoop*>> _ring;
+    PollerBackend _backend;
+    std::vector<int> _cpus;
+    std::vector<int> _loopCpus;
+    std::vector<EventLoop*> _cpuLoops; // indexed by CPU, first loop pinned there
     EventLoop* _baseLoop;
     std::vector<LoopThread*> _threads;
     std::vector<EventLoop*> _loops;
@@ -0,0 +1,137 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+// Unbounded intrusive multi-producer single-consumer queue (Vyukov). push() is lock-free
+// and may be called from any thread; pop() must only be called by the single consumer.
+// pop() can briefly report empty while a producer is between its two steps, so consumers
+// rely on the producer's wakeup after push() rather than on polling.
+// Popped nodes are recycled through a free list, so once the queue has reached its peak
+// depth push() no longer allocates.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() : _head(&_stub), _tail(&_stub), _free(0) {}
+    ~MpscQueue()
+    {
+        T value;
+        while(pop(value))
+        {
+        }
+        Node* node = pointer(_free.load(std::memory_order_relaxed));
+        while(node != nullptr)
+        {
+            Node* next = node->freeNext.load(std::memory_order_relaxed);
+            delete node;
+            node = next;
+        }
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value)
+    {
+        Node* node = allocNode();
+        node->value = std::move(value);
+        node->next.store(nullptr, std::memory_order_relaxed);
+        link(node);
+    }
+    bool pop(T& value)
+    {
+        Node* tail = _tail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if(tail == &_stub)
+        {
+            if(next == nullptr)
+            {
+                return false;
+            }
+            _tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if(next == nullptr)
+        {
+            if(tail != _head.load(std::memory_order_acquire))
+            {
+                // a producer swapped the head but hasn't linked its node yet
+                return false;
+            }
+            _stub.next.store(nullptr, std::memory_order_relaxed);
+            link(&_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if(next == nullptr)
+            {
+                return false;
+            }
+        }
+        _tail = next;
+        value = std::move(tail->value);
+        freeNode(tail);
+        return true;
+    }
+    // consumer only; a push still in progress already counts, so pop() may fail right after
+    bool empty() const
+    {
+        return _tail == &_stub && _stub.next.load(std::memory_order_acquire) == nullptr &&
+               _head.load(std::memory_order_acquire) == &_stub;
+    }
+private:
+    struct Node
+    {
+        T value;
+        std::atomic<Node*> next{nullptr};
+        std::atomic<Node*> freeNext{nullptr};
+    };
+    // the free list head packs a 16-bit ABA tag above a 48-bit user-space pointer
+    static constexpr int kTagShift = 48;
+    static Node* pointer(uint64_t word)
+    {
+        return reinterpret_cast<Node*>(word & ((uint64_t(1) << kTagShift) - 1));
+    }
+    static uint64_t pack(Node* node, uint64_t oldWord)
+    {
+        return reinterpret_cast<uint64_t>(node) | (((oldWord >> kTagShift) + 1) << kTagShift);
+    }
+    Node* allocNode()
+    {
+        uint64_t old = _free.load(std::memory_order_acquire);
+        while(true)
+        {
+            Node* node = pointer(old);
+            if(node == nullptr)
+            {
+                return new Node();
+            }
+            // nodes are never deleted while the queue lives, so reading a stale next is safe;
+            // the tag makes the CAS fail if the node was popped and pushed back meanwhile
+            Node* next = node->freeNext.load(std::memory_order_relaxed);
+            if(_free.compare_exchange_weak(old, pack(next, old), std::memory_order_acquire,
+                                           std::memory_order_acquire))
+            {
+                return node;
+            }
+        }
+    }
+    void freeNode(Node* node)
+    {
+        uint64_t old = _free.load(std::memory_order_relaxed);
+        do
+        {
+            node->freeNext.store(pointer(old), std::memory_order_relaxed);
+        } while(!_free.compare_exchange_weak(old, pack(node, old), std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+    void link(Node* node)
+    {
+        Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+private:
+    Node _stub;
+    std::atomic<Node*> _head;   // producers push here
+    Node* _tail;                // consumer pops here
+    std::atomic<uint64_t> _free; // recycled nodes, pushed by the consumer, popped by producers
+};
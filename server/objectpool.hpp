@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Slab allocator for blocks of one size. The size is fixed by the first allocation; other
+// sizes go straight to operator new. Freed blocks are kept on a free list and slabs are
+// only returned when the pool is destroyed. Blocks may be freed from any thread.
+class FixedPool
+{
+public:
+    static constexpr std::size_t kBlocksPerSlab = 64;
+
+    FixedPool() : _blockSize(0), _free(nullptr) {}
+    ~FixedPool()
+    {
+        for(void* slab : _slabs)
+        {
+            ::operator delete(slab);
+        }
+    }
+    FixedPool(const FixedPool&) = delete;
+    FixedPool& operator=(const FixedPool&) = delete;
+
+    void* allocate(std::size_t size)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_blockSize == 0)
+        {
+            _blockSize = roundUp(size);
+        }
+        if(roundUp(size) != _blockSize)
+        {
+            return ::operator new(size);
+        }
+        if(_free == nullptr)
+        {
+            grow();
+        }
+        FreeBlock* block = _free;
+        _free = block->next;
+        return block;
+    }
+    void deallocate(void* p, std::size_t size)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(roundUp(size) != _blockSize)
+        {
+            ::operator delete(p);
+            return;
+        }
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = _free;
+        _free = block;
+    }
+    std::size_t blockSize() const { return _blockSize; }
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+    static std::size_t roundUp(std::size_t size)
+    {
+        std::size_t align = alignof(std::max_align_t);
+        return (std::max(size, sizeof(FreeBlock)) + align - 1) / align * align;
+    }
+    void grow()
+    {
+        char* slab = static_cast<char*>(::operator new(_blockSize * kBlocksPerSlab));
+        _slabs.push_back(slab);
+        for(std::size_t i = kBlocksPerSlab; i > 0; i--)
+        {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + (i - 1) * _blockSize);
+            block->next = _free;
+            _free = block;
+        }
+    }
+private:
+    std::mutex _mutex;
+    std::size_t _blockSize;
+    FreeBlock* _free;
+    std::vector<void*> _slabs;
+};
+
+// Allocator over a FixedPool for std::allocate_shared, which puts the object and its
+// control block in one pooled block. The allocator copy stored in the control block
+// keeps the pool alive until the last object is freed.
+template <typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+
+    explicit PoolAllocator(std::shared_ptr<FixedPool> pool) : _pool(std::move(pool)) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) : _pool(other._pool) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(_pool->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n)
+    {
+        _pool->deallocate(p, n * sizeof(T));
+    }
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const { return _pool == other._pool; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& other) const { return _pool != other._pool; }
+private:
+    template <typename U>
+    friend class PoolAllocator;
+    std::shared_ptr<FixedPool> _pool;
+};
@@ -0,0 +1,537 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <functional>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include "buffer.hpp"
+#include "bufferpool.hpp"
+#include "task.hpp"
+
+// Pending output kept as a chain of segments instead of one contiguous buffer,
+// so queuing a large reply never resizes or compacts, and a header and its
+// payload go out in the same sendmsg without being concatenated first. An empty
+// queue owns no memory: chunks come from the loop's BufferPool and the segment
+// lists free their storage whenever they drain.
+class OutputQueue
+{
+public:
+    using releaseCallback = Task;
+    static constexpr std::size_t kChunkSize = 16 * 1024; // small copies are packed into chunks of this size
+    static constexpr int kMaxIov = IOV_MAX;
+    static constexpr std::size_t kMaxFileChunk = 1024 * 1024; // per sendfile call, keeps the loop responsive
+    static constexpr std::size_t kAdoptThreshold = 4 * 1024; // moved-in data above this is adopted, not copied
+    static constexpr uint32_t kMinZeroCopyBackoff = 16;     // sends made without MSG_ZEROCOPY after ENOBUFS,
+    static constexpr uint32_t kMaxZeroCopyBackoff = 4096;   // doubling while it keeps failing
+
+    explicit OutputQueue(BufferPool* pool = nullptr)
+    : _pool(pool), _size(0), _zeroCopyThreshold(0), _zeroCopySeq(0), _zeroCopyDone(0),
+      _zeroCopySkip(0), _zeroCopyBackoff(kMinZeroCopyBackoff) {}
+    ~OutputQueue()
+    {
+        clear();
+        while(!_zeroCopyPending.empty())
+        {
+            releaseZeroCopyFront();
+        }
+    }
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+
+    std::size_t readableSize() const { return _size; }
+    bool empty() const { return _size == 0; }
+    // segments of at least threshold bytes are sent with MSG_ZEROCOPY (the socket must have
+    // SO_ZEROCOPY set) and stay pinned until the kernel reports completion; 0 disables it
+    void setZeroCopyThreshold(std::size_t threshold) { _zeroCopyThreshold = threshold; }
+    bool zeroCopyEnabled() const { return _zeroCopyThreshold > 0; }
+    std::size_t zeroCopyThreshold() const { return _zeroCopyThreshold; }
+    bool zeroCopyPending() const { return !_zeroCopyPending.empty(); }
+
+    // owned: the bytes are copied into queue-owned chunks
+    void append(const void* data, std::size_t len)
+    {
+        if(len == 0)
+        {
+            return;
+        }
+        const char* p = static_cast<const char*>(data);
+        if(!_segments.empty())
+        {
+            Segment& tail = _segments.back();
+            if(tail.owned && tail.end < tail.capacity)
+            {
+                std::size_t n = std::min(len, tail.capacity - tail.end);
+                std::memcpy(tail.owned.get() + tail.end, p, n);
+                tail.end += n;
+                _size += n;
+                p += n;
+                len -= n;
+            }
+        }
+        if(len > 0)
+        {
+            Segment seg;
+            char* chunk = BufferPool::allocate(_pool, std::max(len, kChunkSize), seg.capacity);
+            seg.owned = Chunk(chunk, ChunkDeleter{_pool, seg.capacity});
+            seg.data = chunk;
+            std::memcpy(seg.owned.get(), p, len);
+            seg.end = len;
+            push(std::move(seg));
+        }
+    }
+    void append(const std::string& str)
+    {
+        append(str.data(), str.size());
+    }
+    // refcounted: the segment holds a reference until its bytes are sent
+    void append(std::shared_ptr<const std::string> data)
+    {
+        if(!data || data->empty())
+        {
+            return;
+        }
+        Segment seg;
+        seg.data = data->data();
+        seg.end = data->size();
+        seg.shared = std::move(data);
+        push(std::move(seg));
+    }
+    // takes ownership of str, queuing the bytes from offset on; small strings are
+    // packed into the tail chunk, larger ones are adopted without copying
+    void append(std::string&& str, std::size_t offset = 0)
+    {
+        if(offset >= str.size())
+        {
+            return;
+        }
+        if(str.size() - offset <= kAdoptThreshold)
+        {
+            append(str.data() + offset, str.size() - offset);
+            return;
+        }
+        auto owner = std::make_shared<const std::string>(std::move(str));
+        Segment seg;
+        seg.data = owner->data();
+        seg.begin = offset;
+        seg.end = owner->size();
+        seg.shared = std::move(owner);
+        push(std::move(seg));
+    }
+    void append(Buffer&& buf)
+    {
+        if(buf.readableSize() == 0)
+        {
+            return;
+        }
+        if(buf.readableSize() <= kAdoptThreshold)
+        {
+            append(buf.readPos(), buf.readableSize());
+            return;
+        }
+        auto owner = std::make_shared<Buffer>(std::move(buf));
+        Segment seg;
+        seg.data = owner->readPos();
+        seg.end = owner->readableSize();
+        seg.shared = std::move(owner);
+        push(std::move(seg));
+    }
+    // borrowed: the caller keeps data alive until done runs (sent or discarded)
+    void appendBorrowed(const void* data, std::size_t len, releaseCallback done = nullptr)
+    {
+        if(len == 0)
+        {
+            if(done)
+            {
+                done();
+            }
+            return;
+        }
+        Segment seg;
+        seg.data = static_cast<const char*>(data);
+        seg.end = len;
+        seg.release = std::move(done);
+        push(std::move(seg));
+    }
+    // file: len bytes of fd from offset, sent with sendfile in queue order; fd must stay
+    // open until done runs
+    void appendFile(int fd, off_t offset, std::size_t len, releaseCallback done = nullptr)
+    {
+        if(len == 0)
+        {
+            if(done)
+            {
+                done();
+            }
+            return;
+        }
+        Segment seg;
+        seg.fileFd = fd;
+        seg.fileOffset = offset;
+        seg.end = len;
+        seg.release = std::move(done);
+        push(std::move(seg));
+    }
+    // sends the memory segments up to the next file segment with one sendmsg, or a file
+    // segment with sendfile; returns the bytes sent, 0 when the socket buffer is full
+    // and -1 on error
+    // MSG_MORE in flags is only kept when the call can't take the whole queue, so the
+    // kernel holds back a partial packet for the next call
+    ssize_t sendTo(int fd, int flags = 0)
+    {
+        if(_size == 0)
+        {
+            return 0;
+        }
+        if(_segments.front().fileFd >= 0)
+        {
+            return sendFileTo(fd);
+        }
+        if(_zeroCopyThreshold > 0 && _segments.front().end - _segments.front().begin >= _zeroCopyThreshold)
+        {
+            if(_zeroCopySkip == 0)
+            {
+                return sendZeroCopyTo(fd, flags & ~MSG_MORE);
+            }
+            _zeroCopySkip--;
+        }
+        iovec iov[kMaxIov];
+        int iovcnt = 0;
+        for(auto& seg : _segments)
+        {
+            if(iovcnt == kMaxIov || seg.fileFd >= 0)
+            {
+                break;
+            }
+            iov[iovcnt++] = iovec{const_cast<char*>(seg.data + seg.begin), seg.end - seg.begin};
+        }
+        if(static_cast<size_t>(iovcnt) == _segments.size())
+        {
+            flags &= ~MSG_MORE;
+        }
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n;
+        do
+        {
+            n = ::sendmsg(fd, &msg, flags);
+        } while(n == -1 && errno == EINTR);
+        if(n == -1)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        consume(n);
+        return n;
+    }
+    // for sends done elsewhere, e.g. submitted to io_uring: fills iov with the memory
+    // segments at the front (none when a file segment comes first); their bytes stay valid
+    // until consumeSent, whatever is appended meanwhile
+    int peekIov(iovec* iov, int maxIov)
+    {
+        int iovcnt = 0;
+        for(auto& seg : _segments)
+        {
+            if(iovcnt == maxIov || seg.fileFd >= 0)
+            {
+                break;
+            }
+            iov[iovcnt++] = iovec{const_cast<char*>(seg.data + seg.begin), seg.end - seg.begin};
+        }
+        return iovcnt;
+    }
+    void consumeSent(std::size_t len)
+    {
+        consume(len);
+    }
+    // reads MSG_ZEROCOPY completions from the socket error queue and releases the segments
+    // they cover; if the kernel reports it had to copy anyway, zerocopy is switched off since
+    // it then only adds notification overhead. Returns false on a non-zerocopy socket error
+    bool readZeroCopyCompletions(int fd)
+    {
+        while(true)
+        {
+            char control[128];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if(::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+            for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                {
+                    continue;
+                }
+                const sock_extended_err* err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+                if(err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                {
+                    return false;
+                }
+                if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                {
+                    _zeroCopyThreshold = 0;
+                }
+                releaseZeroCopy(err->ee_info, err->ee_data);
+            }
+        }
+    }
+    // drops the unsent bytes; segments already handed to MSG_ZEROCOPY stay pinned until
+    // readZeroCopyCompletions reports them, since the kernel may still be reading them
+    void clear()
+    {
+        while(!_segments.empty())
+        {
+            pop();
+        }
+        _size = 0;
+    }
+private:
+    ssize_t sendZeroCopyTo(int fd, int flags)
+    {
+        Segment& seg = _segments.front();
+        iovec iov{const_cast<char*>(seg.data + seg.begin), seg.end - seg.begin};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t n;
+        do
+        {
+            n = ::sendmsg(fd, &msg, flags | MSG_ZEROCOPY);
+        } while(n == -1 && errno == EINTR);
+        if(n == -1)
+        {
+            if(errno == ENOBUFS)
+            {
+                // out of optmem for notifications until completions are read: send this one
+                // and the next few the ordinary way, then try again
+                _zeroCopySkip = _zeroCopyBackoff;
+                _zeroCopyBackoff = std::min(_zeroCopyBackoff * 2, kMaxZeroCopyBackoff);
+                return sendTo(fd, flags);
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        _zeroCopyBackoff = kMinZeroCopyBackoff;
+        // every successful MSG_ZEROCOPY call takes the next notification id
+        if(!seg.zeroCopy)
+        {
+            seg.zeroCopy = true;
+            seg.zeroCopyFirst = _zeroCopySeq;
+        }
+        seg.zeroCopySeq = _zeroCopySeq++;
+        consume(n);
+        return n;
+    }
+    // ids first..last have completed; completions usually come in send order, but a range
+    // may also complete ahead of an earlier one and is kept until the gap is filled
+    void releaseZeroCopy(uint32_t first, uint32_t last)
+    {
+        if(static_cast<int32_t>(last + 1 - _zeroCopyDone) <= 0)
+        {
+            return;
+        }
+        for(std::size_t i = 0; i < _zeroCopyAhead.size();)
+        {
+            const auto& r = _zeroCopyAhead[i];
+            // overlapping or adjacent ranges become one
+            if(static_cast<int32_t>(r.first - (last + 1)) <= 0 && static_cast<int32_t>(first - (r.second + 1)) <= 0)
+            {
+                first = static_cast<int32_t>(r.first - first) < 0 ? r.first : first;
+                last = static_cast<int32_t>(r.second - last) > 0 ? r.second : last;
+                _zeroCopyAhead[i] = _zeroCopyAhead.back();
+                _zeroCopyAhead.pop_back();
+            }
+            else
+            {
+                i++;
+            }
+        }
+        if(static_cast<int32_t>(first - _zeroCopyDone) <= 0)
+        {
+            _zeroCopyDone = last + 1;
+        }
+        else
+        {
+            _zeroCopyAhead.emplace_back(first, last);
+        }
+        for(auto& seg : _zeroCopyPending)
+        {
+            if(seg.zeroCopy && zeroCopyCompleted(seg))
+            {
+                seg.zeroCopy = false;
+                releaseCallback release = std::move(seg.release);
+                if(release)
+                {
+                    release();
+                }
+            }
+        }
+        while(!_zeroCopyPending.empty() && !_zeroCopyPending.front().zeroCopy)
+        {
+            releaseZeroCopyFront();
+        }
+        // a segment still being sent keeps its ids until it is fully consumed
+    }
+    void releaseZeroCopyFront()
+    {
+        releaseCallback release = std::move(_zeroCopyPending.front().release);
+        _zeroCopyPending.pop_front();
+        if(release)
+        {
+            release();
+        }
+    }
+    ssize_t sendFileTo(int fd)
+    {
+        Segment& seg = _segments.front();
+        off_t offset = seg.fileOffset + seg.begin;
+        ssize_t n;
+        do
+        {
+            n = ::sendfile(fd, seg.fileFd, &offset, std::min(seg.end - seg.begin, kMaxFileChunk));
+        } while(n == -1 && errno == EINTR);
+        if(n == -1)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if(n == 0)
+        {
+            // the file is shorter than promised, the stream can't be completed
+            errno = EIO;
+            return -1;
+        }
+        consume(n);
+        return n;
+    }
+    struct ChunkDeleter
+    {
+        BufferPool* pool;
+        std::size_t capacity;
+        void operator()(char* p) const { BufferPool::deallocate(pool, p, capacity); }
+    };
+    using Chunk = std::unique_ptr<char, ChunkDeleter>;
+    struct Segment
+    {
+        Chunk owned{nullptr, ChunkDeleter{nullptr, 0}}; // owned chunk, appendable up to capacity
+        std::size_t capacity = 0;
+        std::shared_ptr<const void> shared;  // refcounted or adopted storage
+        releaseCallback release;             // borrowed completion
+        const char* data = nullptr;
+        std::size_t begin = 0;               // unsent bytes are [begin, end)
+        std::size_t end = 0;
+        int fileFd = -1;                     // file segment: bytes come from fileFd at fileOffset + begin
+        off_t fileOffset = 0;
+        bool zeroCopy = false;               // sent with MSG_ZEROCOPY, pinned until ids zeroCopyFirst..zeroCopySeq complete
+        uint32_t zeroCopyFirst = 0;
+        uint32_t zeroCopySeq = 0;
+    };
+    // FIFO over a vector: unlike std::deque it allocates nothing while empty, and it
+    // frees its storage each time it drains
+    class SegmentList
+    {
+    public:
+        bool empty() const { return _head == _items.size(); }
+        std::size_t size() const { return _items.size() - _head; }
+        Segment& front() { return _items[_head]; }
+        Segment& back() { return _items.back(); }
+        std::vector<Segment>::iterator begin() { return _items.begin() + _head; }
+        std::vector<Segment>::iterator end() { return _items.end(); }
+        void push_back(Segment&& seg)
+        {
+            if(_head > 0 && _items.size() == _items.capacity())
+            {
+                _items.erase(_items.begin(), _items.begin() + _head);
+                _head = 0;
+            }
+            _items.push_back(std::move(seg));
+        }
+        void pop_front()
+        {
+            _items[_head++] = Segment();
+            if(_head == _items.size())
+            {
+                std::vector<Segment>().swap(_items);
+                _head = 0;
+            }
+        }
+    private:
+        std::vector<Segment> _items;
+        std::size_t _head = 0;
+    };
+    bool zeroCopyCompleted(const Segment& seg) const
+    {
+        if(static_cast<int32_t>(seg.zeroCopySeq - _zeroCopyDone) < 0)
+        {
+            return true;
+        }
+        for(const auto& r : _zeroCopyAhead)
+        {
+            if(static_cast<int32_t>(seg.zeroCopyFirst - r.first) >= 0 && static_cast<int32_t>(r.second - seg.zeroCopySeq) >= 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    void push(Segment&& seg)
+    {
+        _size += seg.end - seg.begin;
+        _segments.push_back(std::move(seg));
+    }
+    void pop()
+    {
+        if(_segments.front().zeroCopy)
+        {
+            // the kernel may still be reading these pages, keep them until completion
+            // unless its ids already completed while the rest was queued
+            if(!zeroCopyCompleted(_segments.front()))
+            {
+                _zeroCopyPending.push_back(std::move(_segments.front()));
+                _segments.pop_front();
+                return;
+            }
+        }
+        releaseCallback release = std::move(_segments.front().release);
+        _segments.pop_front();
+        if(release)
+        {
+            release();
+        }
+    }
+    void consume(std::size_t len)
+    {
+        _size -= len;
+        while(len > 0)
+        {
+            Segment& seg = _segments.front();
+            std::size_t n = std::min(len, seg.end - seg.begin);
+            seg.begin += n;
+            len -= n;
+            if(seg.begin == seg.end)
+            {
+                pop();
+            }
+        }
+    }
+private:
+    BufferPool* _pool;
+    SegmentList _segments;
+    std::size_t _size;
+    std::size_t _zeroCopyThreshold;
+    uint32_t _zeroCopySeq;                   // id the kernel assigns to the next MSG_ZEROCOPY send
+    uint32_t _zeroCopyDone;                  // ids below this have completed
+    std::vector<std::pair<uint32_t, uint32_t>> _zeroCopyAhead; // completed ranges past a gap above _zeroCopyDone
+    uint32_t _zeroCopySkip;                  // eligible sends left to make without MSG_ZEROCOPY
+    uint32_t _zeroCopyBackoff;               // _zeroCopySkip after the next ENOBUFS
+    SegmentList _zeroCopyPending;            // fully sent, waiting for completion
+};
@@ -0,0 +1,17 @@
+#include "poller.hpp"
+#include "epollpoller.hpp"
+#include "iouringpoller.hpp"
+
+Poller* Poller::newPoller(PollerBackend backend)
+{
+    if(backend == PollerBackend::K_IO_URING)
+    {
+        IoUringPoller* poller = new IoUringPoller();
+        if(poller->valid())
+        {
+            return poller;
+        }
+        delete poller;
+    }
+    return new EpollPoller();
+}
@@ -1,89 +1,43 @@
 #pragma once
-#include <sys/epoll.h>
 #include <vector>
-#include <unordered_map>
+#include <cerrno>
+#include <sys/uio.h>
 #include "channel.hpp"
+#include "buffer.hpp"
+
+enum class PollerBackend
+{
+    K_EPOLL,
+    K_IO_URING // falls back to epoll when the kernel refuses io_uring_setup
+};
+
+// backend of an EventLoop; only ever used from the loop thread. Every backend reports
+// readiness. One with completionIo() also does the I/O for channels that ask for it with
+// Channel::setIoMode: the results wait in the poller, the channel is told through
+// EPOLLIN/EPOLLOUT and its owner collects them with the take* calls
 class Poller
 {
 public:
-    Poller() : _epollfd(epoll_create1(EPOLL_CLOEXEC)), _events(1024)
-    {
-        if(_epollfd == -1)
-        {
-            perror("epoll_create1");
-            exit(EXIT_FAILURE);
-        }
-    }
-    ~Poller()
-    {
-        close(_epollfd);
-    }
+    virtual ~Poller() = default;
+    virtual void update(Channel* ch) = 0;
+    virtual void remove(Channel* ch) = 0;
+    // appends the channels with pending events, waiting at most timeout ms (-1 blocks)
+    virtual bool poll(std::vector<Channel*>& activeChannels, int timeout = -1) = 0;
 
-    void update(Channel* ch)
-    {
-        if(hasChannel(ch->getFd()))
-        {
-            epollOp(EPOLL_CTL_MOD, ch);
-        }
-        else
-        {
-            epollOp(EPOLL_CTL_ADD, ch);
-            _channels[ch->getFd()] = ch;
-        }
-    }
-    void remove(Channel* ch)
-    {
-        auto it = _channels.find(ch->getFd());
-        if(it != _channels.end())
-        {
-            epollOp(EPOLL_CTL_DEL, ch);
-            _channels.erase(it);
-        }
-    }
-    bool poll(std::vector<Channel*>& activeChannels, int timeout = -1)
-    {
-        int n = epoll_wait(_epollfd, _events.data(), _events.size(), timeout);
-        if(n == -1)
-        {
-            if(errno == EINTR)
-            {
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
-        for(int i = 0; i < n; i++)
-        {
-            auto ch = _channels.find(_events[i].data.fd);
-            if(ch == _channels.end())
-            {
-                return false;
-            }
-            ch->second->setRevents(_events[i].events);
-            activeChannels.push_back(ch->second);
-        }
-        return true;
-    }
+    virtual bool completionIo() const { return false; }
+    // next fd accepted for ch, -1 with errno (EAGAIN when none is waiting)
+    virtual int takeAccepted(Channel*) { errno = EAGAIN; return -1; }
+    // appends everything received for ch to buf and returns its size; 0 once at end of
+    // stream, -1 with errno (EAGAIN when nothing is waiting)
+    virtual ssize_t takeReceived(Channel*, Buffer*) { errno = EAGAIN; return -1; }
+    // queues a send of iov for ch, submitted with the next wait; the memory must stay valid
+    // until the completion is reported as EPOLLOUT. False when it can't be queued
+    virtual bool submitSend(Channel*, const iovec*, int) { return false; }
+    // result of the completed send: bytes sent, -1 with errno (EAGAIN while in flight)
+    virtual ssize_t takeSent(Channel*) { errno = EAGAIN; return -1; }
+    // a receive or send of ch is still in flight; the channel must not leave the poller
+    // before it ends if its data matters
+    virtual bool busy(const Channel*) const { return false; }
 
-private:
-    void epollOp(int op, Channel* ch)
-    {
-        int fd = ch->getFd();
-        epoll_event ev{};
-        ev.data.fd = fd;
-        ev.events = ch->getEvents();
-        int ret = epoll_ctl(_epollfd, op, fd, &ev);
-        if(ret == -1)
-        {
-            perror("epoll_ctl");
-            exit(EXIT_FAILURE);
-        }
-    }
-    bool hasChannel(int fd) const { return _channels.find(fd) != _channels.end(); }
-private:
-    int _epollfd;
-    std::vector<epoll_event> _events;
-    std::unordered_map <int, Channel*> _channels;
-};
\ No newline at end of file
+    static Poller* newPoller(PollerBackend backend);
+};
@@ -23,6 +23,11 @@ public:
         std::unique_lock<std::mutex> lock(m_mutex);
         m_queue.emplace(t);
     }
+    void push(T &&t)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queue.emplace(std::move(t));
+    }
     bool pop(T &t)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
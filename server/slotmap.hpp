@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Dense id -> value table. An id packs a slot index with the slot's generation, which is
+// bumped whenever the slot is freed, so ids of removed entries only match a reused slot
+// after 2^31 reuses. The low 32 bits hold the map's tag above a 24-bit index, which keeps
+// ids of several maps apart and tells which map issued an id; the generation fills the
+// high bits.
+// Lookup, insert and erase are O(1) array accesses; freed slots are reused LIFO.
+template <typename T>
+class SlotMap
+{
+public:
+    static constexpr int kIndexBits = 24;
+    static constexpr uint32_t kMaxIndex = (1u << kIndexBits) - 1;
+    static constexpr int kTagShift = kIndexBits;
+    static constexpr uint32_t kMaxTag = 255;
+    static constexpr int kGenerationShift = 32;
+    static constexpr uint32_t kGenerationMask = (1u << 31) - 1; // ids stay below 2^63
+
+    explicit SlotMap(uint32_t tag = 0) : _tag(tag & kMaxTag) {}
+    static uint32_t tagOf(uint64_t id) {return static_cast<uint32_t>(id >> kTagShift) & kMaxTag;}
+
+    // 0 once all kMaxIndex + 1 slots are taken
+    uint64_t insert(T value)
+    {
+        uint32_t index;
+        if(!_freeSlots.empty())
+        {
+            index = _freeSlots.back();
+            _freeSlots.pop_back();
+        }
+        else if(_slots.size() > kMaxIndex)
+        {
+            return 0;
+        }
+        else
+        {
+            index = static_cast<uint32_t>(_slots.size());
+            _slots.emplace_back();
+        }
+        Slot& slot = _slots[index];
+        slot.value = std::move(value);
+        slot.used = true;
+        _size++;
+        return makeId(index, slot.generation);
+    }
+    // nullptr for ids that were erased or never issued
+    T* find(uint64_t id)
+    {
+        uint32_t index = static_cast<uint32_t>(id) & kMaxIndex;
+        if(index >= _slots.size())
+        {
+            return nullptr;
+        }
+        Slot& slot = _slots[index];
+        if(!slot.used || makeId(index, slot.generation) != id)
+        {
+            return nullptr;
+        }
+        return &slot.value;
+    }
+    bool erase(uint64_t id)
+    {
+        if(find(id) == nullptr)
+        {
+            return false;
+        }
+        uint32_t index = static_cast<uint32_t>(id) & kMaxIndex;
+        Slot& slot = _slots[index];
+        slot.value = T();
+        slot.used = false;
+        slot.generation = (slot.generation + 1) & kGenerationMask;
+        if(slot.generation == 0)
+        {
+            slot.generation = 1;
+        }
+        _freeSlots.push_back(index);
+        _size--;
+        return true;
+    }
+    std::size_t size() const { return _size; }
+    template <typename Fn>
+    void forEach(Fn fn)
+    {
+        for(auto& slot : _slots)
+        {
+            if(slot.used)
+            {
+                fn(slot.value);
+            }
+        }
+    }
+private:
+    struct Slot
+    {
+        T value{};
+        uint32_t generation = 1; // never 0, so no id is 0
+        bool used = false;
+    };
+    uint64_t makeId(uint32_t index, uint32_t generation) const
+    {
+        return (static_cast<uint64_t>(generation) << kGenerationShift) | (static_cast<uint64_t>(_tag) << kTagShift) | index;
+    }
+private:
+    uint32_t _tag;
+    std::vector<Slot> _slots;
+    std::vector<uint32_t> _freeSlots;
+    std::size_t _size = 0;
+};
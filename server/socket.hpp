@@ -2,18 +2,21 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cerrno>
 #include <string>
+#include <vector>
 
 class Socket
 {
 public:
     Socket() : _sockfd(-1) {}
     explicit Socket(int fd) : _sockfd(fd) {}
-    ~Socket() { ::close(_sockfd); }
+    ~Socket() { close(); }
     Socket(const Socket&) = delete;
     Socket(Socket&&) = delete;
     Socket& operator=(const Socket&) = delete;
@@ -55,22 +58,38 @@ public:
         }
         return true;
     }
-    int accept() {
+    // flags are passed to accept4, e.g. SOCK_NONBLOCK | SOCK_CLOEXEC
+    int accept(int flags = 0) {
         sockaddr_in addr{};
         socklen_t len = sizeof(addr);
-        int fd = ::accept(_sockfd, reinterpret_cast<sockaddr*>(&addr), &len);
+        int fd = ::accept4(_sockfd, reinterpret_cast<sockaddr*>(&addr), &len, flags);
         if (fd == -1) {
             return -1;
         }
         return fd;
     }
+    // returns 0 only when the peer has closed; -1 with errno EAGAIN when nothing is available
     ssize_t recv(void* buf, std::size_t len, int flag = 0)
+    {
+        if(len == 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        ssize_t ret;
+        do
+        {
+            ret = ::recv(_sockfd, buf, len, flag);
+        } while(ret == -1 && errno == EINTR);
+        return ret;
+    }
+    ssize_t send(const void* buf, std::size_t len, int flag = 0)
     {
         if(len == 0)
         {
             return 0;
         }
-        ssize_t ret = ::recv(_sockfd, buf, len, flag);
+        ssize_t ret = ::send(_sockfd, buf, len, flag);
         if (ret == -1)
         {
             if(errno == EAGAIN || errno == EINTR)
@@ -80,13 +99,13 @@ public:
         }
         return ret;
     }
-    ssize_t send(const void* buf, std::size_t len, int flag = 0)
+    // gathers iovcnt pieces into one send, returns like send()
+    ssize_t sendv(const iovec* iov, int iovcnt, int flag = 0)
     {
-        if(len == 0)
-        {
-            return 0;
-        }
-        ssize_t ret = ::send(_sockfd, buf, len, flag);
+        msghdr msg{};
+        msg.msg_iov = const_cast<iovec*>(iov);
+        msg.msg_iovlen = iovcnt;
+        ssize_t ret = ::sendmsg(_sockfd, &msg, flag);
         if (ret == -1)
         {
             if(errno == EAGAIN || errno == EINTR)
@@ -98,7 +117,11 @@ public:
     }
     void close()
     {
-        ::close(_sockfd);
+        if(_sockfd != -1)
+        {
+            ::close(_sockfd);
+            _sockfd = -1;
+        }
     }
     bool createServer(uint16_t port, bool block = true, const std::string& ip = "0.0.0.0", int backlog = 1024)
     {
@@ -106,6 +129,11 @@ public:
         {
             return false;
         }
+        // SO_REUSEPORT must be set before bind, otherwise a second listener on the same port fails
+        if(!reuseAddr())
+        {
+            return false;
+        }
         if(!bind(ip, port))
         {
             return false;
@@ -121,10 +149,6 @@ public:
                 return false;
             }
         }
-        if(!reuseAddr())
-        {
-            return false;
-        }
         return true;
     }
     bool createClient(uint16_t port, const std::string& ip)
@@ -154,6 +178,48 @@ public:
         }
         return true;
     }
+    // for a listener in a SO_REUSEPORT group: a connection whose packets arrive on cpus[i]
+    // goes to the i-th listener bound to the port, any other CPU to the kernel's hash pick
+    bool steerByCpu(const std::vector<int>& cpus)
+    {
+        std::vector<sock_filter> code;
+        code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+        for(size_t i = 0; i < cpus.size(); i++)
+        {
+            code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpus[i]), 0, 1));
+            code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+        }
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, UINT32_MAX)); // out of range: hash fallback
+        sock_fprog prog {static_cast<unsigned short>(code.size()), code.data()};
+        if(setsockopt(_sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+        {
+            return false;
+        }
+        return true;
+    }
+    // reads busy poll the device queue for up to usecs; above net.core.busy_read this
+    // needs CAP_NET_ADMIN
+    bool busyPoll(int usecs)
+    {
+        if(setsockopt(_sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+        {
+            return false;
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        int opt = 1;
+        setsockopt(_sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt));
+#endif
+        return true;
+    }
+    bool zeroCopy()
+    {
+        int opt = 1;
+        if(setsockopt(_sockfd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == -1)
+        {
+            return false;
+        }
+        return true;
+    }
     bool nonBlock()
     {
         int flag = fcntl(_sockfd, F_GETFL, 0);
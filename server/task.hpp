@@ -0,0 +1,105 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only void() callable with inline storage. Captures up to kInlineSize bytes (a
+// this pointer plus a std::string, a Buffer, a shared_ptr or a std::function) are stored
+// in place, so queuing a task does not allocate; larger callables fall back to the heap.
+// Unlike std::function it accepts move-only lambdas and is never copied.
+class Task
+{
+public:
+    static constexpr std::size_t kInlineSize = 64;
+
+    Task() noexcept : _ops(nullptr) {}
+    Task(std::nullptr_t) noexcept : _ops(nullptr) {}
+    template <typename F, typename Fn = std::decay_t<F>,
+              typename = std::enable_if_t<!std::is_same_v<Fn, Task> && std::is_invocable_r_v<void, Fn&>>>
+    Task(F&& f) : _ops(nullptr)
+    {
+        if constexpr (fitsInline<Fn>())
+        {
+            ::new (static_cast<void*>(_storage)) Fn(std::forward<F>(f));
+            _ops = &inlineOps<Fn>;
+        }
+        else
+        {
+            ::new (static_cast<void*>(_storage)) Fn*(new Fn(std::forward<F>(f)));
+            _ops = &heapOps<Fn>;
+        }
+    }
+    Task(Task&& other) noexcept : _ops(other._ops)
+    {
+        if(_ops != nullptr)
+        {
+            _ops->move(_storage, other._storage);
+            other._ops = nullptr;
+        }
+    }
+    Task& operator=(Task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            if(other._ops != nullptr)
+            {
+                other._ops->move(_storage, other._storage);
+                _ops = other._ops;
+                other._ops = nullptr;
+            }
+        }
+        return *this;
+    }
+    Task& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
+
+    void operator()() { _ops->invoke(_storage); }
+    explicit operator bool() const noexcept { return _ops != nullptr; }
+    void reset() noexcept
+    {
+        if(_ops != nullptr)
+        {
+            _ops->destroy(_storage);
+            _ops = nullptr;
+        }
+    }
+private:
+    struct Ops
+    {
+        void (*invoke)(void*);
+        void (*move)(void* dst, void* src) noexcept; // move-constructs into dst and destroys src
+        void (*destroy)(void*) noexcept;
+    };
+    template <typename Fn>
+    static constexpr bool fitsInline()
+    {
+        return sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible_v<Fn>;
+    }
+    template <typename Fn>
+    static inline const Ops inlineOps = {
+        [](void* p) { (*static_cast<Fn*>(p))(); },
+        [](void* dst, void* src) noexcept {
+            ::new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        },
+        [](void* p) noexcept { static_cast<Fn*>(p)->~Fn(); }
+    };
+    template <typename Fn>
+    static inline const Ops heapOps = {
+        [](void* p) { (**static_cast<Fn**>(p))(); },
+        [](void* dst, void* src) noexcept { ::new (dst) Fn*(*static_cast<Fn**>(src)); },
+        [](void* p) noexcept { delete *static_cast<Fn**>(p); }
+    };
+private:
+    alignas(std::max_align_t) unsigned char _storage[kInlineSize];
+    const Ops* _ops;
+};
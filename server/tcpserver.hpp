@@ -4,6 +4,16 @@
 #include "accepter.hpp"
 #include "loopthreadpool.hpp"
 #include "connect.hpp"
+#include "objectpool.hpp"
+#include "slotmap.hpp"
+#include <unordered_map>
+
+enum class AcceptMode
+{
+    K_SINGLE_ACCEPTER, // one listener on the base loop, connections handed to worker loops
+    K_PER_LOOP         // every worker loop owns a SO_REUSEPORT listener and serves what it accepts;
+                       // with pinned loops the kernel hands a connection to the loop on its CPU
+};
 
 class TcpServer : public NetWork
 {
@@ -13,72 +23,436 @@ public:
     using messageCallback = Connection::messageCallback;
     using closeCallback = Connection::closeCallback;
     using eventCallback = Connection::eventCallback;
-    explicit TcpServer(int port, int threadNum = 0)
-    : _nextId(0)
-    ,  _timeout(0)
+    using highWaterMarkCallback = Connection::highWaterMarkCallback;
+    using lowWaterMarkCallback = Connection::lowWaterMarkCallback;
+    static constexpr uint64_t kMinRebalanceBusy = LoopLoad::kWindowNs / 10; // below 10% busy nothing moves
+    // cpus pins worker loop i to cpus[i % cpus.size()], see LoopThreadPool
+    explicit TcpServer(int port, int threadNum = 0, AcceptMode mode = AcceptMode::K_SINGLE_ACCEPTER,
+                       PollerBackend backend = PollerBackend::K_EPOLL, const std::vector<int>& cpus = {})
+    : _timeout(0)
     ,  _inactiveRelease(false)
-    ,  _accepter(&_baseLoop, port, [this](auto && PH1) { newConnection(std::forward<decltype(PH1)>(PH1)); })
-    ,  _threadPool(&_baseLoop, threadNum)
+    ,  _edgeTriggered(false)
+    ,  _zeroCopyThreshold(0)
+    ,  _socketBusyPoll(0)
+    ,  _writeCoalescing(false)
+    ,  _outputHighWater(0)
+    ,  _outputLowWater(0)
+    ,  _inputHighWater(0)
+    ,  _peerHashNeeded(false)
+    ,  _mode(mode)
+    ,  _baseLoop(backend)
+    ,  _threadPool(&_baseLoop, threadNum, backend, cpus)
     {
         _threadPool.creat();
-        _accepter.listen();
+        std::vector<EventLoop*> all = loops();
+        if(all.size() > SlotMap<ptrConnection>::kMaxTag + 1)
+        {
+            // the loop index is the 8-bit tag of its connection ids
+            fprintf(stderr, "too many loops: %zu, at most %u\n", all.size(), SlotMap<ptrConnection>::kMaxTag + 1);
+            exit(EXIT_FAILURE);
+        }
+        for(auto loop : all)
+        {
+            _shards.emplace_back(new LoopShard(static_cast<uint32_t>(_shards.size())));
+            _shardOf[loop] = _shards.back().get();
+        }
+        if(_mode == AcceptMode::K_PER_LOOP)
+        {
+            for(auto loop : _threadPool.getAllLoops())
+            {
+                addAccepter(loop, port);
+            }
+            // listeners joined the group in loop order, so group index i is worker loop i
+            if(!cpus.empty() && threadNum > 0 && !_accepters.front()->steerByCpu(_threadPool.loopCpus()))
+            {
+                perror("SO_ATTACH_REUSEPORT_CBPF");
+            }
+        }
+        else
+        {
+            addAccepter(&_baseLoop, port);
+        }
     }
     void setConnectedCallback(const connectedCallback& cb) {_connectedCallback = cb;}
     void setMessageCallback(const messageCallback& cb) {_messageCallback = cb;}
     void setCloseCallback(const closeCallback& cb) {_closeCallback = cb;}
     void setEventCallback(const eventCallback& cb) {_eventCallback = cb;}
+    void setHighWaterMarkCallback(const highWaterMarkCallback& cb) {_highWaterMarkCallback = cb;}
+    void setLowWaterMarkCallback(const lowWaterMarkCallback& cb) {_lowWaterMarkCallback = cb;}
+    // applied to new connections, see Connection::setOutputWaterMarks
+    void setOutputWaterMarks(size_t high, size_t low)
+    {
+        _outputHighWater = high;
+        _outputLowWater = low;
+    }
+    // applied to new connections, see Connection::setInputHighWaterMark
+    void setInputHighWaterMark(size_t high) {_inputHighWater = high;}
+    void setInputHighWaterMarkCallback(const highWaterMarkCallback& cb) {_inputHighWaterMarkCallback = cb;}
+    // how K_SINGLE_ACCEPTER picks a worker loop for a new connection; call before start()
+    void setPlacementPolicy(PlacementPolicy policy) {_threadPool.setPlacementPolicy(policy);}
+    void setPlacementCallback(const LoopThreadPool::placementCallback& cb)
+    {
+        _threadPool.setPlacementCallback(cb);
+        _peerHashNeeded = true;
+    }
     void enableInactivityRelease(int timeout) 
     {
         _inactiveRelease = true;
         _timeout = timeout;
     }
     void disableInactivityRelease() {_inactiveRelease = false;}
-    void start() {_baseLoop.start();}
-    void runAfter(uint64_t timeout, const TimerTask::TaskFunc& task)
+    // register new connections with EPOLLET and drain them until EAGAIN
+    void enableEdgeTrigger() {_edgeTriggered = true;}
+    // send queued segments of at least threshold bytes with MSG_ZEROCOPY on new connections
+    void enableZeroCopy(size_t threshold = Connection::kDefaultZeroCopyThreshold) {_zeroCopyThreshold = threshold;}
+    // new connections send what they write during a loop iteration in one flush at its end
+    void enableWriteCoalescing() {_writeCoalescing = true;}
+    // serving loops spin for up to spin microseconds before blocking (EventLoop::setBusyPoll);
+    // socketBusyPoll > 0 also sets SO_BUSY_POLL to that many microseconds on new connections
+    void enableBusyPoll(uint64_t spin, int socketBusyPoll = 0)
+    {
+        for(auto loop : _threadPool.getAllLoops())
+        {
+            loop->setBusyPoll(spin);
+        }
+        _socketBusyPoll = socketBusyPoll;
+    }
+    void start()
     {
-        _nextId ++;
-        _baseLoop.runInLoop([this, timeout, task]{_runAfter(_nextId, timeout, task);});
+        for(auto& accepter : _accepters)
+        {
+            Accepter* acc = accepter.get();
+            acc->getLoop()->runInLoop([acc]{acc->listen();});
+        }
+        _baseLoop.start();
+    }
+    // every interval, if the busiest worker loop's recent busy time is over ratio times the
+    // idlest one's, the connection that received the most bytes since the previous check
+    // is migrated from the busiest to the idlest loop; one move per check
+    TimerId enableRebalance(std::chrono::milliseconds interval = std::chrono::seconds(1), double ratio = 2.0)
+    {
+        return _baseLoop.runEvery(interval, [this, ratio]{rebalance(ratio);});
+    }
+    // back connection buffers with huge pages; call before start()
+    void enableHugePages()
+    {
+        for(auto loop : loops())
+        {
+            loop->bufferPool().enableHugePages();
+        }
+    }
+    // buffer memory per loop, base loop first; highWater is the peak since start
+    std::vector<BufferPool::Stats> bufferStats()
+    {
+        std::vector<BufferPool::Stats> stats;
+        for(auto loop : loops())
+        {
+            stats.push_back(loop->bufferPool().stats());
+        }
+        return stats;
+    }
+    // nullptr once the connection has closed, even if its id's slot was reused
+    ptrConnection getConnection(uint64_t id)
+    {
+        uint32_t shard = SlotMap<ptrConnection>::tagOf(id);
+        if(shard >= _shards.size())
+        {
+            return nullptr;
+        }
+        LoopShard& s = *_shards[shard];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        ptrConnection* conn = s.connections.find(id);
+        return conn != nullptr ? *conn : nullptr;
+    }
+    // sums the loops' registries, each is locked in turn
+    size_t connectionCount()
+    {
+        size_t n = 0;
+        for(auto& shard : _shards)
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            n += shard->connections.size();
+        }
+        return n;
+    }
+    // calls fn on a snapshot of every loop's connections, without holding any lock
+    void forEachConnection(const std::function<void(const ptrConnection&)>& fn)
+    {
+        std::vector<ptrConnection> conns;
+        for(auto& shard : _shards)
+        {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->connections.forEach([&conns](const ptrConnection& conn) {
+                    if(conn)
+                    {
+                        conns.push_back(conn);
+                    }
+                });
+            }
+            for(auto& conn : conns)
+            {
+                fn(conn);
+            }
+            conns.clear();
+        }
+    }
+    // runs on the base loop
+    TimerId runAfter(std::chrono::milliseconds timeout, TimerWheel::TaskFunc task)
+    {
+        return _baseLoop.runAfter(timeout, std::move(task));
+    }
+    TimerId runEvery(std::chrono::milliseconds interval, TimerWheel::TaskFunc task)
+    {
+        return _baseLoop.runEvery(interval, std::move(task));
+    }
+    // timeout in seconds, as EventLoop::runAfter(id, timeout, task) takes it
+    TimerId runAfter(uint64_t timeout, TimerWheel::TaskFunc task)
+    {
+        return runAfter(std::chrono::seconds(timeout), std::move(task));
+    }
+    TimerId runEvery(uint64_t interval, TimerWheel::TaskFunc task)
+    {
+        return runEvery(std::chrono::seconds(interval), std::move(task));
+    }
+    void cancel(TimerId timer)
+    {
+        _baseLoop.cancel(timer);
     }
     private:
-    void newConnection(int fd)
+    std::vector<EventLoop*> loops()
+    {
+        std::vector<EventLoop*> loops(1, &_baseLoop);
+        for(auto loop : _threadPool.getAllLoops())
+        {
+            if(loop != &_baseLoop)
+            {
+                loops.push_back(loop);
+            }
+        }
+        return loops;
+    }
+    void addAccepter(EventLoop* loop, uint16_t port)
+    {
+        _accepters.emplace_back(new Accepter(loop, port, [this, loop](const std::vector<int>& fds) { newConnections(fds, loop); }));
+    }
+    void newConnections(const std::vector<int>& fds, EventLoop* acceptLoop)
+    {
+        // group the batch by target loop so each loop gets one task instead of one per fd;
+        // the target creates and registers the connections itself
+        std::unordered_map<EventLoop*, std::vector<int>> batches;
+        for(int fd : fds)
+        {
+            EventLoop* loop = acceptLoop;
+            if(_mode != AcceptMode::K_PER_LOOP)
+            {
+                bool needPeer = _peerHashNeeded || _threadPool.placementPolicy() == PlacementPolicy::K_PEER_HASH;
+                bool needCpu = _threadPool.placementPolicy() == PlacementPolicy::K_INCOMING_CPU;
+                loop = _threadPool.getNextLoop(needPeer ? peerHash(fd) : 0, needCpu ? incomingCpu(fd) : -1);
+            }
+            // counted now so the next placement in this batch already sees it
+            loop->load().connectionAdded();
+            batches[loop].push_back(fd);
+        }
+        bool inactiveRelease = _inactiveRelease;
+        int timeout = _timeout;
+        size_t zeroCopyThreshold = _zeroCopyThreshold;
+        int socketBusyPoll = _socketBusyPoll;
+        bool writeCoalescing = _writeCoalescing;
+        for(auto& batch : batches)
+        {
+            EventLoop* loop = batch.first;
+            batch.first->runInLoop([this, loop, batch = std::move(batch.second), inactiveRelease, timeout, zeroCopyThreshold, socketBusyPoll, writeCoalescing]{
+                for(int fd : batch)
+                {
+                    ptrConnection conn = createConnection(loop, fd);
+                    if(!conn)
+                    {
+                        // counted when it was placed, the fd is already closed
+                        loop->load().connectionRemoved();
+                        continue;
+                    }
+                    if(inactiveRelease)
+                    {
+                        conn->enableInactivityRelease(timeout);
+                    }
+                    if(zeroCopyThreshold > 0)
+                    {
+                        conn->enableZeroCopy(zeroCopyThreshold);
+                    }
+                    if(socketBusyPoll > 0)
+                    {
+                        conn->enableBusyPoll(socketBusyPoll);
+                    }
+                    if(writeCoalescing)
+                    {
+                        conn->enableWriteCoalescing();
+                    }
+                    conn->establish();
+                }
+            });
+        }
+    }
+    void rebalance(double ratio)
+    {
+        std::vector<EventLoop*> loops = _threadPool.getAllLoops();
+        if(loops.size() < 2)
+        {
+            return;
+        }
+        EventLoop* busiest = loops[0];
+        EventLoop* idlest = loops[0];
+        uint64_t most = 0;
+        uint64_t least = UINT64_MAX;
+        for(auto loop : loops)
+        {
+            uint64_t busy = loop->load().recentBusy();
+            if(busy >= most)
+            {
+                most = busy;
+                busiest = loop;
+            }
+            if(busy < least)
+            {
+                least = busy;
+                idlest = loop;
+            }
+        }
+        ptrConnection hottest;
+        uint64_t hottestBytes = 0;
+        forEachConnection([&](const ptrConnection& conn) {
+            uint64_t bytes = conn->bytesRead();
+            if(conn->getLoop() == busiest && bytes - conn->balanceMark() > hottestBytes)
+            {
+                hottestBytes = bytes - conn->balanceMark();
+                hottest = conn;
+            }
+            conn->setBalanceMark(bytes);
+        });
+        if(busiest == idlest || most < kMinRebalanceBusy || most < ratio * least || !hottest)
+        {
+            return;
+        }
+        hottest->migrateTo(idlest);
+    }
+    // hash of the peer's address without the port, so all connections of a client match
+    static uint64_t peerHash(int fd)
+    {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        if(::getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) == -1)
+        {
+            return 0;
+        }
+        const unsigned char* p = nullptr;
+        size_t n = 0;
+        if(addr.ss_family == AF_INET)
+        {
+            p = reinterpret_cast<const unsigned char*>(&reinterpret_cast<sockaddr_in*>(&addr)->sin_addr);
+            n = sizeof(in_addr);
+        }
+        else if(addr.ss_family == AF_INET6)
+        {
+            p = reinterpret_cast<const unsigned char*>(&reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr);
+            n = sizeof(in6_addr);
+        }
+        uint64_t hash = 14695981039346656037ULL; // FNV-1a
+        for(size_t i = 0; i < n; i++)
+        {
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+    static int incomingCpu(int fd)
     {
-        _nextId ++;
-        ptrConnection conn(new Connection(_threadPool.getNextLoop(), _nextId, fd));
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if(::getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+        {
+            return -1;
+        }
+        return cpu;
+    }
+    // runs in loop, which registers the connection in its own shard
+    ptrConnection createConnection(EventLoop* loop, int fd)
+    {
+        LoopShard& shard = *_shardOf.at(loop);
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            id = shard.connections.insert(nullptr);
+        }
+        if(id == 0)
+        {
+            fprintf(stderr, "too many connections on one loop\n");
+            ::close(fd);
+            return nullptr;
+        }
+        // object and control block share one block from the loop's pool
+        ptrConnection conn = std::allocate_shared<Connection>(PoolAllocator<Connection>(shard.pool), loop, id, fd);
+        conn->setEdgeTriggered(_edgeTriggered);
         conn->setConnectedCallback(_connectedCallback);
         conn->setMessageCallback(_messageCallback);
         conn->setCloseCallback(_closeCallback);
         conn->setEventCallback(_eventCallback);
+        conn->setHighWaterMarkCallback(_highWaterMarkCallback);
+        conn->setLowWaterMarkCallback(_lowWaterMarkCallback);
+        conn->setOutputWaterMarks(_outputHighWater, _outputLowWater);
+        conn->setInputHighWaterMark(_inputHighWater);
+        conn->setInputHighWaterMarkCallback(_inputHighWaterMarkCallback);
         conn->setServerCloseCallback([this](auto && PH1) {removeConnection(std::forward<decltype(PH1)>(PH1));});
-        if(_inactiveRelease)
         {
-            conn->enableInactivityRelease(_timeout);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            *shard.connections.find(id) = conn;
         }
-        conn->establish();
-        _connections[_nextId] = conn;
+        return conn;
     }
+    // called by the closing connection in its loop; the entry is dropped after the current
+    // event batch, when nothing on the stack uses the connection any more. A migrated
+    // connection stays in the shard of the loop that accepted it
     void removeConnection(const ptrConnection& conn)
     {
-        _baseLoop.runInLoop([this, conn]{_removeConnection(conn);});
+        conn->getLoop()->queueInLoop([this, conn]{_removeConnection(conn);});
     }
     void _removeConnection(const ptrConnection& conn)
     {
-        _connections.erase(conn->getId());
-    }
-    void _runAfter(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task)
-    {
-        _baseLoop.runAfter(id, timeout, task);
+        conn->getLoop()->load().connectionRemoved();
+        LoopShard& shard = *_shards[SlotMap<ptrConnection>::tagOf(conn->getId())];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.connections.erase(conn->getId());
     }
 private:
-    uint64_t _nextId;
     int _timeout;
     bool _inactiveRelease;
+    bool _edgeTriggered;
+    size_t _zeroCopyThreshold;
+    int _socketBusyPoll;
+    bool _writeCoalescing;
+    size_t _outputHighWater;
+    size_t _outputLowWater;
+    size_t _inputHighWater;
+    bool _peerHashNeeded;
+    AcceptMode _mode;
     EventLoop _baseLoop;
-    Accepter _accepter;
     LoopThreadPool _threadPool;
-    std::unordered_map<uint64_t, ptrConnection> _connections;
+    std::vector<std::unique_ptr<Accepter>> _accepters;
+    // a loop's connections: registered and removed by the loop that serves them, the
+    // lock only keeps lookups and scans from other threads consistent
+    struct LoopShard
+    {
+        explicit LoopShard(uint32_t tag) : pool(std::make_shared<FixedPool>()), connections(tag) {}
+        std::shared_ptr<FixedPool> pool;
+        std::mutex mutex;
+        SlotMap<ptrConnection> connections;
+    };
+    std::vector<std::unique_ptr<LoopShard>> _shards;          // loops() order, index is the id tag
+    std::unordered_map<EventLoop*, LoopShard*> _shardOf;      // read-only after construction
 
     connectedCallback _connectedCallback;
     messageCallback _messageCallback;
     closeCallback _closeCallback;
     eventCallback _eventCallback;
+    highWaterMarkCallback _highWaterMarkCallback;
+    lowWaterMarkCallback _lowWaterMarkCallback;
+    highWaterMarkCallback _inputHighWaterMarkCallback;
 };
\ No newline at end of file
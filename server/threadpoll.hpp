@@ -3,6 +3,7 @@
 #include <future>
 #include <functional>
 #include "safequeue.hpp"
+#include "task.hpp"
 
 class threadPool
 {
@@ -42,14 +43,14 @@ public:
     template <typename F, typename... Args>
     auto submit(F&& f, Args&&... args) -> std::future<decltype(f(args...))>
     {
-        std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-        auto task_ptr = std::make_shared<std::packaged_task<decltype(f(args...))()>>(std::move(func));
-        std::function<void()> wrapper_func = [task_ptr]() {
-            (*task_ptr)();
-        };
-        m_queue.push(wrapper_func);
+        // the packaged_task is moved into the queued Task, no shared_ptr or std::function copies
+        std::packaged_task<decltype(f(args...))()> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        auto future = task.get_future();
+        m_queue.push(Task([task = std::move(task)]() mutable {
+            task();
+        }));
         m_cond.notify_one();
-        return task_ptr->get_future();
+        return future;
     }
 private:
     class threadWorker
@@ -58,7 +59,7 @@ private:
         threadWorker(threadPool* pool, const int id) : m_pool(pool), m_id(id){}
         void operator()()
         {
-            std::function<void()> func;
+            Task func;
             bool dequeued = false;
             while(!m_pool->m_shutdown)
             {
@@ -82,7 +83,7 @@ private:
     };
 private:
     bool m_shutdown; // 线程池是否关闭
-    safeQueue<std::function<void()>> m_queue; // 任务队列
+    safeQueue<Task> m_queue; // 任务队列
     std::vector<std::thread> m_threads; // 线程池
     std::mutex m_conditional_mutex; // 保护任务队列的互斥锁
     std::condition_variable m_cond; // 条件变量
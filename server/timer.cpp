@@ -1,11 +1,16 @@
 #include "timer.hpp"
 #include "eventloop.hpp"
+#include <algorithm>
 
-void TimerWheel::addTask(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task)
+void TimerWheel::addTask(uint64_t id, uint64_t timeout, TaskFunc task)
 {
-    _loop->runInLoop([this, id, timeout, task](){
-        _addTask(id, timeout, task);
-    });
+    TimerNode* node = allocNode();
+    node->id = id;
+    node->timeout = timeout;
+    node->interval = 0;
+    node->expires = nowTick() + timeout;
+    node->task = std::move(task);
+    submit(node);
 }
 void TimerWheel::refreshTask(uint64_t id)
 {
@@ -18,4 +23,382 @@ void TimerWheel::removeTask(uint64_t id)
     _loop->runInLoop([this, id](){
         _removeTask(id);
     });
-}
\ No newline at end of file
+}
+TimerId TimerWheel::addTimer(uint64_t when, uint64_t interval, TaskFunc task)
+{
+    uint64_t id = kHandleBit | ++_nextHandle;
+    TimerNode* node = allocNode();
+    node->id = id;
+    node->timeout = interval;
+    node->interval = interval;
+    node->expires = when > _epoch ? when - _epoch : 0;
+    node->task = std::move(task);
+    submit(node);
+    return TimerId(id);
+}
+// the task already sits in its node, so only the node pointer is queued
+void TimerWheel::submit(TimerNode* node)
+{
+    _loop->runInLoop([this, node](){
+        schedule(node);
+    });
+}
+void TimerWheel::schedule(TimerNode* node)
+{
+    _removeTask(node->id);
+    if(_count == 0)
+    {
+        // the wheel stops advancing while empty, catch up before filing relative to it
+        _current = std::max(_current, nowTick());
+    }
+    hashInsert(node);
+    insert(node);
+    uint64_t next = nextExpiry();
+    if(next < _armed)
+    {
+        arm(next);
+    }
+}
+void TimerWheel::_refreshTask(uint64_t id)
+{
+    TimerNode* node = findNode(id);
+    if(node == nullptr || node == _running)
+    {
+        return;
+    }
+    unlink(node);
+    node->expires = nowTick() + node->timeout;
+    insert(node);
+    uint64_t next = nextExpiry();
+    if(next < _armed)
+    {
+        arm(next);
+    }
+}
+void TimerWheel::_removeTask(uint64_t id)
+{
+    TimerNode* node = findNode(id);
+    if(node == nullptr)
+    {
+        return;
+    }
+    // the timerfd may now fire early, onTime() just re-arms it
+    hashErase(node);
+    if(node == _running)
+    {
+        // cancelled from its own callback, runSlot frees it afterwards
+        _runningCancelled = true;
+        return;
+    }
+    unlink(node);
+    freeNode(node);
+}
+void TimerWheel::onTime()
+{
+    uint64_t res;
+    ssize_t n = read(_timerfd, &res, sizeof(res));
+    if(n != sizeof(res) && errno != EAGAIN && errno != EINTR)
+    {
+        perror("read timerfd");
+        return;
+    }
+    _armed = kNotArmed;
+    advance(nowTick());
+    arm(nextExpiry());
+}
+void TimerWheel::advance(uint64_t now)
+{
+    while(_current <= now)
+    {
+        if(_count == 0)
+        {
+            _current = now + 1;
+            return;
+        }
+        int index = static_cast<int>(_current & (kRootSize - 1));
+        if(index == 0)
+        {
+            // a lower level wrapped: pull the next block down from each level above it
+            for(int level = 1; level < kLevels; level++)
+            {
+                int slot = static_cast<int>((_current >> levelShift(level)) & (kLevelSize - 1));
+                cascade(level, slot);
+                if(slot != 0)
+                {
+                    break;
+                }
+            }
+        }
+        int slot = firstOccupied(0, index);
+        uint64_t blockEnd = (_current | (kRootSize - 1)) + 1;
+        if(slot < index)
+        {
+            // nothing left in this block, skip to where the next cascade happens; empty
+            // blocks after it are skipped too, a long stall doesn't walk them one by one
+            if(now < blockEnd)
+            {
+                _current = now + 1;
+                return;
+            }
+            _current = blockEnd;
+            _current = std::min(now + 1, std::max(blockEnd, nextExpiry()));
+            continue;
+        }
+        uint64_t tick = _current - index + slot;
+        if(tick > now)
+        {
+            _current = now + 1;
+            return;
+        }
+        _current = tick + 1;
+        runSlot(slot);
+    }
+}
+void TimerWheel::cascade(int level, int index)
+{
+    Link pending;
+    detach(levelBase(level) + index, pending);
+    while(pending.next != &pending)
+    {
+        TimerNode* node = static_cast<TimerNode*>(pending.next);
+        unlink(node);
+        insert(node);
+    }
+}
+void TimerWheel::runSlot(int slot)
+{
+    // detach first: callbacks may add timers that land in this same slot one lap later
+    Link expired;
+    detach(slot, expired);
+    while(expired.next != &expired)
+    {
+        TimerNode* node = static_cast<TimerNode*>(expired.next);
+        unlink(node);
+        if(node->interval == 0)
+        {
+            hashErase(node);
+            TaskFunc task = std::move(node->task);
+            freeNode(node);
+            task();
+            continue;
+        }
+        _running = node;
+        _runningCancelled = false;
+        node->task();
+        _running = nullptr;
+        if(_runningCancelled)
+        {
+            freeNode(node);
+            continue;
+        }
+        // keep the original phase unless the loop fell more than a period behind
+        node->expires = std::max(node->expires + node->interval, _current);
+        insert(node);
+    }
+}
+// moves every node of slot onto list, which must be an unused head
+void TimerWheel::detach(int slot, Link& list)
+{
+    Link& head = _slots[slot];
+    list.prev = list.next = &list;
+    if(head.next == &head)
+    {
+        return;
+    }
+    list.next = head.next;
+    list.prev = head.prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head.prev = head.next = &head;
+    _occupied[slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    for(Link* l = list.next; l != &list; l = l->next)
+    {
+        static_cast<TimerNode*>(l)->slot = kNoSlot;
+    }
+}
+void TimerWheel::insert(TimerNode* node)
+{
+    uint64_t expires = std::max(node->expires, _current);
+    uint64_t delta = expires - _current;
+    int slot;
+    if(delta < kRootSize)
+    {
+        slot = static_cast<int>(expires & (kRootSize - 1));
+    }
+    else
+    {
+        if(delta >= kMaxSpan)
+        {
+            // beyond the last level: park it in the furthest slot, it is re-filed on cascade
+            expires = _current + kMaxSpan - 1;
+        }
+        int level = 1;
+        while(level < kLevels - 1 && delta >= (uint64_t(1) << levelShift(level + 1)))
+        {
+            level++;
+        }
+        slot = levelBase(level) + static_cast<int>((expires >> levelShift(level)) & (kLevelSize - 1));
+    }
+    Link& head = _slots[slot];
+    node->next = &head;
+    node->prev = head.prev;
+    head.prev->next = node;
+    head.prev = node;
+    node->slot = slot;
+    _occupied[slot / 64] |= uint64_t(1) << (slot % 64);
+}
+void TimerWheel::unlink(TimerNode* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    if(node->slot != kNoSlot)
+    {
+        Link& head = _slots[node->slot];
+        if(head.next == &head)
+        {
+            _occupied[node->slot / 64] &= ~(uint64_t(1) << (node->slot % 64));
+        }
+        node->slot = kNoSlot;
+    }
+}
+// first non-empty slot of level scanning the ring from index from, -1 if the level is empty
+int TimerWheel::firstOccupied(int level, int from) const
+{
+    int size = level == 0 ? kRootSize : kLevelSize;
+    int words = size / 64;
+    int first = levelBase(level) / 64;
+    for(int i = 0; i <= words; i++)
+    {
+        int w = (from / 64 + i) % words;
+        uint64_t bits = _occupied[first + w];
+        if(i == 0)
+        {
+            bits &= ~uint64_t(0) << (from % 64);
+        }
+        else if(i == words)
+        {
+            bits &= (uint64_t(1) << (from % 64)) - 1;
+        }
+        if(bits != 0)
+        {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+// earliest tick that needs processing: a due root slot or a cascade of a non-empty slot
+uint64_t TimerWheel::nextExpiry() const
+{
+    if(_count == 0)
+    {
+        return kNotArmed;
+    }
+    uint64_t next = kNotArmed;
+    int index = static_cast<int>(_current & (kRootSize - 1));
+    int slot = firstOccupied(0, index);
+    if(slot >= 0)
+    {
+        next = _current - index + slot + (slot < index ? kRootSize : 0);
+    }
+    for(int level = 1; level < kLevels; level++)
+    {
+        int shift = levelShift(level);
+        uint64_t block = _current >> shift;
+        int cur = static_cast<int>(block & (kLevelSize - 1));
+        // the current slot has already cascaded unless _current sits exactly on its boundary
+        bool done = (_current & ((uint64_t(1) << shift) - 1)) != 0;
+        int from = done ? (cur + 1) % kLevelSize : cur;
+        slot = firstOccupied(level, from);
+        if(slot < 0)
+        {
+            continue;
+        }
+        uint64_t distance = ((slot - from) & (kLevelSize - 1)) + (done ? 1 : 0);
+        next = std::min(next, (block + distance) << shift);
+    }
+    return next;
+}
+void TimerWheel::arm(uint64_t tick)
+{
+    itimerspec ts {};
+    if(tick != kNotArmed)
+    {
+        uint64_t ms = _epoch + tick;
+        ts.it_value.tv_sec = ms / 1000;
+        ts.it_value.tv_nsec = (ms % 1000) * 1000000;
+    }
+    if(timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &ts, nullptr) == -1)
+    {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
+    _armed = tick;
+}
+TimerWheel::TimerNode* TimerWheel::allocNode()
+{
+    std::lock_guard<std::mutex> lock(_poolMutex);
+    if(_free == nullptr)
+    {
+        _pool.emplace_back();
+        return &_pool.back();
+    }
+    TimerNode* node = _free;
+    _free = static_cast<TimerNode*>(node->next);
+    node->next = nullptr;
+    return node;
+}
+void TimerWheel::freeNode(TimerNode* node)
+{
+    node->task.reset();
+    std::lock_guard<std::mutex> lock(_poolMutex);
+    node->next = _free;
+    _free = node;
+}
+TimerWheel::TimerNode* TimerWheel::findNode(uint64_t id) const
+{
+    for(TimerNode* node = _buckets[bucketOf(id)]; node != nullptr; node = node->hashNext)
+    {
+        if(node->id == id)
+        {
+            return node;
+        }
+    }
+    return nullptr;
+}
+void TimerWheel::hashInsert(TimerNode* node)
+{
+    if(_count >= _buckets.size())
+    {
+        // one timer per bucket on average: double the table and re-chain every node
+        std::vector<TimerNode*> old = std::move(_buckets);
+        _buckets.assign(old.size() * 2, nullptr);
+        _hashBits++;
+        for(TimerNode* chain : old)
+        {
+            while(chain != nullptr)
+            {
+                TimerNode* next = chain->hashNext;
+                std::size_t bucket = bucketOf(chain->id);
+                chain->hashNext = _buckets[bucket];
+                _buckets[bucket] = chain;
+                chain = next;
+            }
+        }
+    }
+    std::size_t bucket = bucketOf(node->id);
+    node->hashNext = _buckets[bucket];
+    _buckets[bucket] = node;
+    _count++;
+}
+void TimerWheel::hashErase(TimerNode* node)
+{
+    TimerNode** link = &_buckets[bucketOf(node->id)];
+    while(*link != node)
+    {
+        link = &(*link)->hashNext;
+    }
+    *link = node->hashNext;
+    node->hashNext = nullptr;
+    _count--;
+}
@@ -1,55 +1,79 @@
 #pragma once
 #include <functional>
 #include <memory>
+#include <deque>
+#include <atomic>
+#include <mutex>
 #include <vector>
-#include <unordered_map>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
 #include <sys/timerfd.h>
 #include "channel.hpp"
+#include "task.hpp"
 
 class EventLoop;
-class TimerTask
+
+// Handle to a timer from EventLoop::runAt/runAfter/runEvery; cancelling a timer that
+// already fired is a no-op
+class TimerId
 {
 public:
-    using TaskFunc = std::function<void()>;
-    using ReleaseFunc = std::function<void()>;
-
-    TimerTask(uint64_t timeout, TaskFunc task):_timeout(timeout), _task(task){}
-    ~TimerTask(){if(!_canceled) _task(); _release();}
-    void setRelease(const ReleaseFunc& release) {_release = release;}
-    void cancel() {_canceled = true;}
-    uint64_t timeout() const {return _timeout;}
+    TimerId() : _id(0) {}
+    explicit operator bool() const { return _id != 0; }
 private:
-    uint64_t _timeout;
-    TaskFunc _task;
-    ReleaseFunc _release;
-    bool _canceled = false;
+    friend class TimerWheel;
+    explicit TimerId(uint64_t id) : _id(id) {}
+    uint64_t _id;
 };
 
+// Hierarchical timing wheel with one-millisecond ticks: 256 slots for the next 256 ms,
+// then three levels of 64 slots each covering 2^14, 2^20 and 2^26 ms (about 18.6 hours).
+// Timers further out sit in the last level and are re-filed when it cascades, so any
+// horizon works. Nodes live in a pool and are linked intrusively into their slot and into
+// the id hash, which makes add, cancel and refresh O(1) without allocating. The timerfd is
+// armed for the nearest slot that holds a timer or needs cascading, and left disarmed while
+// the wheel is empty.
 class TimerWheel
 {
 public:
+    using TaskFunc = Task;
+    static constexpr int kRootBits = 8;
+    static constexpr int kLevelBits = 6;
+    static constexpr int kLevels = 4;
+    static constexpr int kRootSize = 1 << kRootBits;
+    static constexpr int kLevelSize = 1 << kLevelBits;
+    static constexpr int kSlots = kRootSize + (kLevels - 1) * kLevelSize;
+    static constexpr uint64_t kMaxSpan = uint64_t(1) << (kRootBits + (kLevels - 1) * kLevelBits);
+
     explicit TimerWheel(EventLoop* loop)
-    : _tick(0)
-    , _wheelSize(60)
+    : _buckets(std::size_t(1) << kMinHashBits, nullptr)
+    , _hashBits(kMinHashBits)
+    , _count(0)
+    , _epoch(monotonicMs())
+    , _current(0)
+    , _armed(kNotArmed)
+    , _nextHandle(0)
+    , _free(nullptr)
+    , _running(nullptr)
+    , _runningCancelled(false)
     , _timerfd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
     , _loop(loop)
     ,_channel(new Channel(_timerfd, _loop))
     {
-        _wheel.resize(_wheelSize);
         if(_timerfd == -1)
         {
             perror("timerfd_create");
             exit(EXIT_FAILURE);
         }
-        itimerspec ts {};
-        ts.it_value.tv_sec = 1;
-        ts.it_value.tv_nsec = 0;
-        ts.it_interval.tv_sec = 1;
-        ts.it_interval.tv_nsec = 0;
-        if(timerfd_settime(_timerfd, 0, &ts, nullptr) == -1)
+        for(auto& slot : _slots)
         {
-            perror("timerfd_settime");
-            exit(EXIT_FAILURE);
+            slot.prev = slot.next = &slot;
+        }
+        for(auto& word : _occupied)
+        {
+            word = 0;
         }
         _channel->setReadCallback([this](){onTime();});
         _channel->enableRead();
@@ -60,82 +84,97 @@ public:
         _channel->remove();
         close(_timerfd);
     }
-    void addTask(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task);
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // timeouts are in milliseconds; ids are chosen by the caller and replace an existing timer
+    void addTask(uint64_t id, uint64_t timeout, TaskFunc task);
     void refreshTask(uint64_t id);
     void removeTask(uint64_t id);
-    bool hasTask(uint64_t id)
+    // handle timers: when is CLOCK_MONOTONIC ms (monotonicMs), interval > 0 repeats;
+    // thread-safe, the handle is valid before the timer reaches the loop
+    TimerId addTimer(uint64_t when, uint64_t interval, TaskFunc task);
+    void cancel(TimerId timer) { removeTask(timer._id); }
+    bool hasTask(uint64_t id) const
     {
-        return _taskMap.find(id) != _taskMap.end();
+        return findNode(id) != nullptr;
     }
-private:
-    using TaskPtr = std::shared_ptr<TimerTask>;
-    using TaskWeakPtr = std::weak_ptr<TimerTask>;
-
-    void tick () 
+    std::size_t size() const { return _count; }
+    static uint64_t monotonicMs()
     {
-        _tick = (_tick + 1) % _wheelSize;
-        _wheel[_tick].clear();
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
     }
-    bool onTime()
+private:
+    struct Link
     {
-        uint64_t res;
-        ssize_t n = read(_timerfd, &res, sizeof(res));
-        if(n != sizeof(res))
-        {
-            if(errno == EAGAIN || errno == EINTR)
-            {
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
-        while (res --)
-        {
-            tick();
-        }
-        return true;
-    }
-    void _addTask(uint64_t id, uint64_t timeout, const TimerTask::TaskFunc& task)
+        Link* prev = nullptr;
+        Link* next = nullptr;
+    };
+    struct TimerNode : Link
+    {
+        uint64_t id = 0;
+        uint64_t timeout = 0;
+        uint64_t expires = 0;   // tick the timer fires on
+        uint64_t interval = 0;  // period of a repeating timer, 0 for one-shot
+        int slot = kNoSlot;     // slot list it is linked into, kNoSlot while being run
+        TimerNode* hashNext = nullptr;
+        TaskFunc task;
+    };
+    static constexpr int kNoSlot = -1;
+    static constexpr uint64_t kNotArmed = UINT64_MAX;
+    static constexpr uint64_t kHandleBit = uint64_t(1) << 63; // keeps handle ids apart from caller ids
+    static constexpr int kMinHashBits = 6;
+
+    static int levelShift(int level)
     {
-        TaskPtr pt(new TimerTask(timeout, task));
-        pt->setRelease([this, id](){_taskMap.erase(id);});
-        _taskMap[id] = TaskWeakPtr(pt);
-        uint64_t index = (_tick + timeout) % _wheelSize;
-        _wheel[index].push_back(pt);
+        return level == 0 ? 0 : kRootBits + (level - 1) * kLevelBits;
     }
-    void _refreshTask(uint64_t id)
+    static int levelBase(int level)
     {
-        auto it = _taskMap.find(id);
-        if(it != _taskMap.end())
-        {
-            TaskPtr pt = it->second.lock();
-            if(pt)
-            {
-                uint64_t index = (_tick + pt->timeout()) % _wheelSize;
-                _wheel[index].push_back(pt);
-            }
-        }
+        return level == 0 ? 0 : kRootSize + (level - 1) * kLevelSize;
     }
-    void _removeTask(uint64_t id)
+    uint64_t nowTick() const { return monotonicMs() - _epoch; }
+
+    void _refreshTask(uint64_t id);
+    void _removeTask(uint64_t id);
+    void submit(TimerNode* node);
+    void schedule(TimerNode* node);
+    void onTime();
+    void advance(uint64_t now);
+    void cascade(int level, int index);
+    void runSlot(int slot);
+    void detach(int slot, Link& list);
+    void insert(TimerNode* node);
+    void unlink(TimerNode* node);
+    int firstOccupied(int level, int from) const;
+    uint64_t nextExpiry() const;
+    void arm(uint64_t tick);
+    TimerNode* allocNode();
+    void freeNode(TimerNode* node);
+    std::size_t bucketOf(uint64_t id) const
     {
-        auto it = _taskMap.find(id);
-        if(it!= _taskMap.end())
-        {
-            TaskPtr pt = it->second.lock();
-            if(pt)
-            {
-                pt->cancel();
-            }
-            _taskMap.erase(id);
-        }
+        return static_cast<std::size_t>((id * 0x9E3779B97F4A7C15ULL) >> (64 - _hashBits));
     }
+    TimerNode* findNode(uint64_t id) const;
+    void hashInsert(TimerNode* node);
+    void hashErase(TimerNode* node);
 private:
-    std::vector<std::vector<TaskPtr>> _wheel;
-    std::unordered_map<uint64_t, TaskWeakPtr> _taskMap;
-    size_t _tick;
-    size_t _wheelSize;
+    Link _slots[kSlots];
+    uint64_t _occupied[kSlots / 64];    // one bit per non-empty slot
+    std::deque<TimerNode> _pool;        // stable addresses, nodes are recycled through _free
+    std::mutex _poolMutex;              // other threads take a node to queue a timer in
+    std::vector<TimerNode*> _buckets;   // id hash, chained through hashNext
+    int _hashBits;
+    std::size_t _count;                 // timers in the hash
+    uint64_t _epoch;                    // CLOCK_MONOTONIC ms of tick 0
+    uint64_t _current;                  // next tick to run, everything before it has fired
+    uint64_t _armed;                    // tick the timerfd is set for
+    std::atomic<uint64_t> _nextHandle;
+    TimerNode* _free;
+    TimerNode* _running;                // repeating timer whose callback is running
+    bool _runningCancelled;
     int _timerfd;
     EventLoop* _loop;
     std::unique_ptr<Channel> _channel;
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Connection rate of an echo server with one acceptor on the base loop against a
+// SO_REUSEPORT listener per worker loop, at 1, 4 and hardware_concurrency() loops. Client
+// threads connect, exchange one byte and close with a reset (no TIME_WAIT to run out of
+// ports) for a fixed time. Every connection must get its echo; the rates are reported.
+// make TEST=acceptrate && ./output/acceptrate.elf
+static constexpr uint16_t kPort = 19101;
+static constexpr int kClients = 8;
+static constexpr auto kDuration = std::chrono::milliseconds(500);
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+// connections per second, or -1 if one of them didn't get its echo
+static double measure(AcceptMode mode, int threads, uint16_t port)
+{
+    std::thread([mode, threads, port]{
+        TcpServer server(port, threads, mode);
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            conn->send(buf->readPos(), buf->readableSize());
+            buf->moveReadIdx(buf->readableSize());
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(port));
+
+    std::atomic<uint64_t> done{0};
+    std::atomic<bool> failed{false};
+    auto deadline = std::chrono::steady_clock::now() + kDuration;
+    std::vector<std::thread> clients;
+    for(int i = 0; i < kClients; i++)
+    {
+        clients.emplace_back([&, port]{
+            while(std::chrono::steady_clock::now() < deadline)
+            {
+                int fd = connectServer(port);
+                char c = 'a';
+                if(::write(fd, &c, 1) != 1 || ::read(fd, &c, 1) != 1)
+                {
+                    failed = true;
+                }
+                linger lg{1, 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                ::close(fd);
+                done++;
+            }
+        });
+    }
+    for(std::thread& client : clients)
+    {
+        client.join();
+    }
+    double seconds = std::chrono::duration<double>(kDuration).count();
+    return failed ? -1 : done.load() / seconds;
+}
+
+int main()
+{
+    std::vector<int> counts = {1, 4, static_cast<int>(std::thread::hardware_concurrency())};
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+    bool ok = true;
+    uint16_t port = kPort;
+    printf("%u CPUs, %d client threads\n", std::thread::hardware_concurrency(), kClients);
+    for(int threads : counts)
+    {
+        double single = measure(AcceptMode::K_SINGLE_ACCEPTER, threads, port++);
+        double perLoop = measure(AcceptMode::K_PER_LOOP, threads, port++);
+        ok = ok && single > 0 && perLoop > 0;
+        printf("%2d loops: single acceptor %8.0f conn/s, per-loop acceptors %8.0f conn/s\n", threads, single, perLoop);
+    }
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
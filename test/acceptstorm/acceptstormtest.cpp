@@ -0,0 +1,243 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Accept path under a connect storm and under fd exhaustion.
+// storm: the base loop is held busy while kStorm connections queue in the backlog, then
+// released. Every accepted fd must be non-blocking and close-on-exec, and draining the
+// backlog must take about kStorm / budget polls of the base loop, not one per connection.
+// exhaustion: with RLIMIT_NOFILE lowered so only a few more fds fit, more connections
+// arrive than the server can accept. The excess must be closed rather than left in the
+// backlog (which keeps the listener readable and spins the loop), the process must stay
+// idle while overloaded, and new connections must be served once fds are freed again.
+// make TEST=acceptstorm && ./output/acceptstorm.elf
+static constexpr uint16_t kStormPort = 19110;
+static constexpr uint16_t kLimitPort = 19111;
+static constexpr int kStorm = 1000;
+static constexpr int kHeadroom = 40;       // fds left to the server under the lowered limit
+static constexpr rlim_t kLowLimit = 256;
+static constexpr auto kIdleWindow = std::chrono::milliseconds(500);
+
+static std::atomic<TcpServer*> g_server{nullptr};
+static std::atomic<int> g_connected{0};
+static std::atomic<int> g_blocking{0};
+static std::atomic<bool> g_stalled{false};
+static std::atomic<bool> g_release{false};
+static std::atomic<uint64_t> g_basePolls{0};
+static thread_local bool t_baseLoop = false;
+
+// counts the polls made by the base loop thread, the one that runs the acceptor
+extern "C" int epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout)
+{
+    using waitFn = int (*)(int, epoll_event*, int, int);
+    static waitFn real = reinterpret_cast<waitFn>(::dlsym(RTLD_NEXT, "epoll_wait"));
+    if(t_baseLoop)
+    {
+        g_basePolls++;
+    }
+    return real(epfd, events, maxevents, timeout);
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static bool waitFor(const std::function<bool()>& cond)
+{
+    for(int i = 0; i < 500; i++)
+    {
+        if(cond())
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static void startServer(uint16_t port)
+{
+    std::thread([port]{
+        TcpServer server(port, 2);
+        server.setConnectedCallback([](const TcpServer::ptrConnection& conn){
+            int fl = ::fcntl(conn->getFd(), F_GETFL);
+            int fd = ::fcntl(conn->getFd(), F_GETFD);
+            if(!(fl & O_NONBLOCK) || !(fd & FD_CLOEXEC))
+            {
+                g_blocking++;
+            }
+            g_connected++;
+        });
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            conn->send(buf->readPos(), buf->readableSize());
+            buf->moveReadIdx(buf->readableSize());
+        });
+        t_baseLoop = true;
+        g_server.store(&server);
+        server.start();
+    }).detach();
+    g_connected = 0;
+    ::close(connectServer(port));
+    // the startup connection must be fully through before the counters are reset
+    waitFor([]{return g_connected.load() > 0 && g_server.load()->connectionCount() == 0;});
+    g_connected = 0;
+}
+
+static double cpuSeconds()
+{
+    rusage ru{};
+    ::getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// one byte round trip: 1 echoed, 0 closed by the server, -1 no answer
+static int probe(int fd)
+{
+    timeval tv{2, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char c = 'a';
+    if(::send(fd, &c, 1, MSG_NOSIGNAL) != 1)
+    {
+        return 0;
+    }
+    ssize_t n = ::read(fd, &c, 1);
+    if(n == 1)
+    {
+        return 1;
+    }
+    return n == 0 || errno == ECONNRESET ? 0 : -1;
+}
+
+static bool storm()
+{
+    startServer(kStormPort);
+    g_server.load()->runAfter(std::chrono::milliseconds(0), []{
+        g_stalled = true;
+        while(!g_release)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    waitFor([]{return g_stalled.load();});
+    std::vector<int> fds;
+    for(int i = 0; i < kStorm; i++)
+    {
+        fds.push_back(connectServer(kStormPort));
+    }
+    uint64_t before = g_basePolls;
+    g_release = true;
+    bool all = waitFor([]{return g_connected.load() == kStorm;});
+    uint64_t polls = g_basePolls - before;
+    uint64_t bound = kStorm / Accepter::kDefaultAcceptBudget + 8;
+    printf("storm: %d/%d accepted in %lu base loop polls (bound %lu), %d blocking or inheritable fds\n",
+           g_connected.load(), kStorm, polls, bound, g_blocking.load());
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    waitFor([]{return g_server.load()->connectionCount() == 0;});
+    return all && polls <= bound && g_blocking == 0;
+}
+
+static bool exhaustion()
+{
+    g_server = nullptr;
+    startServer(kLimitPort);
+    rlimit old{};
+    ::getrlimit(RLIMIT_NOFILE, &old);
+    rlimit low = old;
+    low.rlim_cur = kLowLimit;
+    if(::setrlimit(RLIMIT_NOFILE, &low) == -1)
+    {
+        perror("setrlimit");
+        return false;
+    }
+    // take every fd there is, then leave kHeadroom of them to the server
+    std::vector<int> fds;
+    for(;;)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(fd == -1)
+        {
+            break;
+        }
+        fds.push_back(fd);
+    }
+    for(int i = 0; i < kHeadroom; i++)
+    {
+        ::close(fds.back());
+        fds.pop_back();
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kLimitPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int fd : fds)
+    {
+        ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    double cpuStart = cpuSeconds();
+    std::this_thread::sleep_for(kIdleWindow);
+    double cpu = cpuSeconds() - cpuStart;
+    int echoed = 0;
+    int dropped = 0;
+    int hung = 0;
+    for(int fd : fds)
+    {
+        int r = probe(fd);
+        (r > 0 ? echoed : r == 0 ? dropped : hung)++;
+    }
+    printf("exhaustion: %zu connections with %d fds free: %d served, %d dropped, %d hung, %.0f ms cpu over %ld ms\n",
+           fds.size(), kHeadroom, echoed, dropped, hung, cpu * 1000,
+           static_cast<long>(std::chrono::milliseconds(kIdleWindow).count()));
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    waitFor([]{return g_server.load()->connectionCount() == 0;});
+    ::setrlimit(RLIMIT_NOFILE, &old);
+    int fd = connectServer(kLimitPort);
+    bool recovered = probe(fd) == 1;
+    ::close(fd);
+    printf("exhaustion: %s after fds were freed\n", recovered ? "served" : "not served");
+    double idleBudget = std::chrono::duration<double>(kIdleWindow).count() / 5;
+    return echoed > 0 && dropped > 0 && hung == 0 && cpu < idleBudget && recovered;
+}
+
+int main()
+{
+    bool ok = storm();
+    ok = exhaustion() && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
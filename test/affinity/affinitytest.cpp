@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Loop pinning and CPU steering.
+// pool: allowedCpus() follows the affinity mask, also a narrowed one (taskset, cpusets).
+// threads: every worker loop is named "loop-N" and may run on exactly its CPU.
+// steering: connections made from a client thread pinned to each CPU in turn must land
+// on the loop pinned to the CPU that received them, once through K_INCOMING_CPU on the
+// single accepter and once through the reuseport BPF program in K_PER_LOOP mode.
+// The NUMA gain itself (loop memory first touched on the node of the CPU that serves the
+// connection) needs more than one node; the test prints the CPU and node counts it ran on.
+// make TEST=affinity && ./output/affinity.elf
+static constexpr uint16_t kPort = 19128;
+static constexpr int kMaxLoops = 8;
+static constexpr int kRounds = 4;   // connections per CPU
+
+struct Placed
+{
+    std::string name;
+    std::vector<int> allowed;   // the worker's affinity mask
+    int incomingCpu;
+};
+
+static std::mutex g_mutex;
+static std::vector<Placed> g_placed;
+
+static std::vector<int> maskCpus(const cpu_set_t& set)
+{
+    std::vector<int> cpus;
+    for(int i = 0; i < CPU_SETSIZE; i++)
+    {
+        if(CPU_ISSET(i, &set))
+        {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+static void pinSelf(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(::sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+        perror("sched_setaffinity");
+        exit(EXIT_FAILURE);
+    }
+}
+static int numaNodes()
+{
+    int nodes = 0;
+    DIR* dir = ::opendir("/sys/devices/system/node");
+    if(dir == nullptr)
+    {
+        return 1;
+    }
+    while(dirent* entry = ::readdir(dir))
+    {
+        nodes += std::strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9';
+    }
+    ::closedir(dir);
+    return std::max(nodes, 1);
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static std::vector<Placed> takePlaced(size_t expected)
+{
+    for(int i = 0; i < 500; i++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            if(g_placed.size() >= expected)
+            {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    std::vector<Placed> placed;
+    placed.swap(g_placed);
+    return placed;
+}
+
+static void startServer(uint16_t port, AcceptMode mode, const std::vector<int>& cpus)
+{
+    std::thread([port, mode, cpus]{
+        TcpServer server(port, static_cast<int>(cpus.size()), mode, PollerBackend::K_EPOLL, cpus);
+        server.setPlacementPolicy(PlacementPolicy::K_INCOMING_CPU);
+        server.setConnectedCallback([](const TcpServer::ptrConnection& conn){
+            Placed placed;
+            char name[16] = {};
+            ::pthread_getname_np(::pthread_self(), name, sizeof(name));
+            placed.name = name;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            ::pthread_getaffinity_np(::pthread_self(), sizeof(set), &set);
+            placed.allowed = maskCpus(set);
+            placed.incomingCpu = -1;
+            socklen_t len = sizeof(placed.incomingCpu);
+            ::getsockopt(conn->getFd(), SOL_SOCKET, SO_INCOMING_CPU, &placed.incomingCpu, &len);
+            std::lock_guard<std::mutex> lock(g_mutex);
+            g_placed.push_back(placed);
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(port));
+    takePlaced(1);
+}
+
+// every connection must be served by a "loop-N" thread pinned to the CPU it arrived on
+static bool run(uint16_t port, AcceptMode mode, const std::vector<int>& cpus, const char* name)
+{
+    startServer(port, mode, cpus);
+    // the client thread is pinned too, so SYN, handshake and accept all happen on one CPU
+    std::vector<int> fds;
+    std::thread([port, &cpus, &fds]{
+        for(int round = 0; round < kRounds; round++)
+        {
+            for(int cpu : cpus)
+            {
+                pinSelf(cpu);
+                fds.push_back(connectServer(port));
+            }
+        }
+    }).join();
+    std::vector<Placed> placed = takePlaced(fds.size());
+    int named = 0;
+    int pinned = 0;
+    int steered = 0;
+    for(const Placed& p : placed)
+    {
+        named += p.name.compare(0, 5, "loop-") == 0;
+        pinned += p.allowed.size() == 1 && std::find(cpus.begin(), cpus.end(), p.allowed[0]) != cpus.end();
+        steered += p.allowed.size() == 1 && p.allowed[0] == p.incomingCpu;
+    }
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    printf("%-16s %zu connections: %d on a loop-N thread, %d on a single pinned CPU, %d on the receiving CPU\n",
+           name, placed.size(), named, pinned, steered);
+    int total = static_cast<int>(fds.size());
+    return static_cast<int>(placed.size()) == total && named == total && pinned == total && steered == total;
+}
+
+int main()
+{
+    std::vector<int> allowed = LoopThreadPool::allowedCpus();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    ::sched_getaffinity(0, sizeof(set), &set);
+    bool ok = allowed == maskCpus(set);
+    int nodes = numaNodes();
+    printf("%u CPUs online, %zu allowed, %d NUMA node(s)%s\n", std::thread::hardware_concurrency(), allowed.size(),
+           nodes, nodes == 1 ? ": the cross-node locality gain can't show on this machine" : "");
+    // a narrowed mask, as taskset would leave, must be what the pool sizes itself by
+    std::thread([&ok, &allowed]{
+        pinSelf(allowed.back());
+        std::vector<int> narrowed = LoopThreadPool::allowedCpus();
+        printf("pool:            mask narrowed to CPU %d, allowedCpus() has %zu CPU(s)\n", allowed.back(),
+               narrowed.size());
+        ok = ok && narrowed == std::vector<int>{allowed.back()};
+    }).join();
+
+    std::vector<int> cpus(allowed.begin(), allowed.begin() + std::min<size_t>(allowed.size(), kMaxLoops));
+    ok = run(kPort, AcceptMode::K_SINGLE_ACCEPTER, cpus, "incoming cpu") && ok;
+    ok = run(kPort + 1, AcceptMode::K_PER_LOOP, cpus, "reuseport bpf") && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
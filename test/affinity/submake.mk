@@ -0,0 +1,6 @@
+CURRENT_DIR := $(CURDIR)/test/affinity
+
+SRC_CXX_FILES += $(wildcard $(CURRENT_DIR)/*.cpp)
+SRC_CXX_FILES += $(filter-out %/tcpserver.cpp, $(wildcard $(CURDIR)/server/*.cpp))
+
+SRC_INCDIR += $(CURRENT_DIR) $(CURDIR)/server
@@ -0,0 +1,168 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Counts heap allocations while messages go through an echo server. Once warm, a send on
+// the loop thread, a send from another thread, runInLoop and a timer added from another
+// thread must not allocate.
+// make TEST=alloc && ./output/alloc.elf
+static std::atomic<long> g_allocs{0};
+
+void* operator new(std::size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if(p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void operator delete(void* p) noexcept {std::free(p);}
+void operator delete(void* p, std::size_t) noexcept {std::free(p);}
+
+static constexpr uint16_t kPort = 19090;
+static constexpr int kWarmup = 1000;
+static constexpr int kRounds = 10000;
+static constexpr size_t kMessage = 64;
+static constexpr uint64_t kTimerId = 1;
+
+static std::mutex g_mutex;
+static TcpServer::ptrConnection g_conn;
+static std::atomic<bool> g_echo{true};
+
+static int connectServer()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+static void readFull(int fd, char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = ::read(fd, data, len);
+        if(n <= 0)
+        {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        len -= n;
+    }
+}
+// the client writes, the server echoes from its message callback on the loop thread
+static void loopSend(int fd, int rounds)
+{
+    char out[kMessage];
+    char in[kMessage];
+    std::memset(out, 'a', sizeof(out));
+    for(int i = 0; i < rounds; i++)
+    {
+        if(::write(fd, out, sizeof(out)) != static_cast<ssize_t>(sizeof(out)))
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        readFull(fd, in, sizeof(in));
+    }
+}
+// this thread re-arms a timer on the connection's loop, then waits for an echo so the
+// loop has taken it before the next one
+static void crossThreadTimer(int fd, int rounds)
+{
+    EventLoop* loop;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        loop = g_conn->getLoop();
+    }
+    for(int i = 0; i < rounds; i++)
+    {
+        loop->runAfter(kTimerId, std::chrono::minutes(1), []{});
+        loopSend(fd, 1);
+    }
+}
+// this thread sends through the connection, which hands the data to its loop
+static void crossThreadSend(int fd, int rounds)
+{
+    char out[kMessage];
+    char in[kMessage];
+    std::memset(out, 'b', sizeof(out));
+    TcpServer::ptrConnection conn;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        conn = g_conn;
+    }
+    for(int i = 0; i < rounds; i++)
+    {
+        conn->send(out, sizeof(out));
+        readFull(fd, in, sizeof(in));
+    }
+}
+static bool measure(const char* name, void (*run)(int, int), int fd)
+{
+    run(fd, kWarmup);
+    long before = g_allocs.load();
+    run(fd, kRounds);
+    long allocs = g_allocs.load() - before;
+    printf("%-19s %ld allocations in %d messages\n", name, allocs, kRounds);
+    return allocs == 0;
+}
+
+int main()
+{
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        server.setConnectedCallback([](const TcpServer::ptrConnection& conn){
+            std::lock_guard<std::mutex> lock(g_mutex);
+            g_conn = conn;
+        });
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            if(!g_echo.load())
+            {
+                buf->moveReadIdx(buf->readableSize());
+                return;
+            }
+            // larger than a Task's inline storage: it would have to be boxed if it were wrapped
+            char pad[Task::kInlineSize * 2] = {};
+            conn->getLoop()->runInLoop([conn, buf, pad]{
+                conn->send(buf->readPos(), buf->readableSize() + pad[0]);
+                buf->moveReadIdx(buf->readableSize());
+            });
+        });
+        server.start();
+    }).detach();
+
+    int fd = connectServer();
+    bool ok = measure("loop send", loopSend, fd);
+    ok = measure("cross-thread timer", crossThreadTimer, fd) && ok;
+    g_echo.store(false);
+    ok = measure("cross-thread send", crossThreadSend, fd) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,98 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Connections that each send one burst and then stay open without another byte. There is
+// no inactivity release, so nothing but the read that drained the burst can give the
+// grown input storage back; once the server has consumed everything the pools must hold
+// no more than a small buffer per connection.
+// make TEST=burstidle && ./output/burstidle.elf
+static constexpr uint16_t kPort = 19094;
+static constexpr int kConns = 200;
+static constexpr size_t kBurst = 256 * 1024;
+static constexpr size_t kMaxHeld = kConns * BufferPool::kMinClass;
+
+static std::atomic<TcpServer*> g_server{nullptr};
+static std::atomic<size_t> g_consumed{0};
+
+static int connectServer()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static size_t serverBytes(size_t BufferPool::Stats::*field)
+{
+    size_t n = 0;
+    for(const BufferPool::Stats& stats : g_server.load()->bufferStats())
+    {
+        n += stats.*field;
+    }
+    return n;
+}
+
+int main()
+{
+    std::thread([]{
+        TcpServer server(kPort, 2);
+        server.setMessageCallback([](const TcpServer::ptrConnection&, Buffer* buf){
+            g_consumed += buf->readableSize();
+            buf->moveReadIdx(buf->readableSize());
+        });
+        g_server.store(&server);
+        server.start();
+    }).detach();
+
+    std::vector<int> fds;
+    static char data[kBurst];
+    std::memset(data, 'b', sizeof(data));
+    for(int i = 0; i < kConns; i++)
+    {
+        int fd = connectServer();
+        fds.push_back(fd);
+        for(size_t sent = 0; sent < kBurst; )
+        {
+            ssize_t n = ::write(fd, data + sent, kBurst - sent);
+            if(n <= 0)
+            {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            sent += n;
+        }
+    }
+    for(int i = 0; i < 500 && g_consumed.load() < kConns * kBurst; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // the message callback runs before the read decides about the storage
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    size_t held = serverBytes(&BufferPool::Stats::inUse);
+    size_t peak = serverBytes(&BufferPool::Stats::highWater);
+    bool ok = g_consumed.load() == kConns * kBurst && held <= kMaxHeld;
+    printf("%d connections, %zu KB burst each: peak %zu KB, held after the burst %zu KB (limit %zu KB)\n%s\n",
+           kConns, kBurst >> 10, peak >> 10, held >> 10, kMaxHeld >> 10, ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
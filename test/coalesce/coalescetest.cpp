@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Pipelined requests with and without write coalescing. The client writes kPipeline
+// requests at once, kBatches times; the server answers each with its own send, which
+// without coalescing is a syscall per reply. Reported per batch: the worker loop's send
+// syscalls, the TCP segments sent on loopback (both ends) and the batch rate; every
+// reply must come back intact and in order. The server keeps Nagle on, so without
+// coalescing the tail of each batch waits for the client's delayed ACK.
+// make TEST=coalesce && ./output/coalesce.elf
+static constexpr uint16_t kPort = 19136;
+static constexpr int kPipeline = 50;
+static constexpr int kBatches = 50;
+static constexpr size_t kReply = 32;
+
+static thread_local bool t_worker = false;
+static std::atomic<uint64_t> g_sendCalls{0};
+
+extern "C" ssize_t send(int fd, const void* buf, size_t len, int flags)
+{
+    using sendFn = ssize_t (*)(int, const void*, size_t, int);
+    static sendFn real = reinterpret_cast<sendFn>(::dlsym(RTLD_NEXT, "send"));
+    if(t_worker)
+    {
+        g_sendCalls++;
+    }
+    return real(fd, buf, len, flags);
+}
+extern "C" ssize_t sendmsg(int fd, const msghdr* msg, int flags)
+{
+    using sendmsgFn = ssize_t (*)(int, const msghdr*, int);
+    static sendmsgFn real = reinterpret_cast<sendmsgFn>(::dlsym(RTLD_NEXT, "sendmsg"));
+    if(t_worker)
+    {
+        g_sendCalls++;
+    }
+    return real(fd, msg, flags);
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+// OutSegs of /proc/net/snmp: loopback segments sent by both ends, nothing else runs here
+static uint64_t segmentsOut()
+{
+    FILE* f = ::fopen("/proc/net/snmp", "r");
+    if(f == nullptr)
+    {
+        return 0;
+    }
+    char header[1024];
+    char values[1024];
+    uint64_t segments = 0;
+    while(::fgets(header, sizeof(header), f) != nullptr && ::fgets(values, sizeof(values), f) != nullptr)
+    {
+        if(std::strncmp(header, "Tcp:", 4) != 0)
+        {
+            continue;
+        }
+        char* nameSave;
+        char* valueSave;
+        char* name = ::strtok_r(header, " \n", &nameSave);
+        char* value = ::strtok_r(values, " \n", &valueSave);
+        while(name != nullptr && value != nullptr)
+        {
+            if(std::strcmp(name, "OutSegs") == 0)
+            {
+                segments = std::strtoull(value, nullptr, 10);
+            }
+            name = ::strtok_r(nullptr, " \n", &nameSave);
+            value = ::strtok_r(nullptr, " \n", &valueSave);
+        }
+    }
+    ::fclose(f);
+    return segments;
+}
+
+// reply to request number n: the number, then filler derived from it
+static void makeReply(uint32_t n, char* reply)
+{
+    std::memcpy(reply, &n, sizeof(n));
+    for(size_t i = sizeof(n); i < kReply; i++)
+    {
+        reply[i] = static_cast<char>(n + i);
+    }
+}
+
+static void startServer(uint16_t port, bool coalesce)
+{
+    std::thread([port, coalesce]{
+        TcpServer server(port, 1);
+        if(coalesce)
+        {
+            server.enableWriteCoalescing();
+        }
+        server.setConnectedCallback([](const TcpServer::ptrConnection&){
+            t_worker = true;
+        });
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            while(buf->readableSize() >= sizeof(uint32_t))
+            {
+                uint32_t n;
+                std::memcpy(&n, buf->readPos(), sizeof(n));
+                buf->moveReadIdx(sizeof(n));
+                char reply[kReply];
+                makeReply(n, reply);
+                conn->send(reply, sizeof(reply));
+            }
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(port));
+}
+
+static bool readExactly(int fd, char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = ::read(fd, data, len);
+        if(n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// returns send syscalls per batch through calls, segments per batch through segments
+static bool run(uint16_t port, bool coalesce, double* calls, double* segments)
+{
+    startServer(port, coalesce);
+    int fd = connectServer(port);
+    uint64_t callsStart = g_sendCalls;
+    uint64_t segmentsStart = segmentsOut();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint32_t> requests(kPipeline);
+    std::vector<char> replies(kPipeline * kReply);
+    char expected[kReply];
+    bool intact = true;
+    for(int b = 0; intact && b < kBatches; b++)
+    {
+        for(int i = 0; i < kPipeline; i++)
+        {
+            requests[i] = static_cast<uint32_t>(b * kPipeline + i);
+        }
+        size_t bytes = requests.size() * sizeof(uint32_t);
+        intact = ::write(fd, requests.data(), bytes) == static_cast<ssize_t>(bytes) &&
+                 readExactly(fd, replies.data(), replies.size());
+        for(int i = 0; intact && i < kPipeline; i++)
+        {
+            makeReply(requests[i], expected);
+            intact = std::memcmp(replies.data() + i * kReply, expected, kReply) == 0;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    *calls = static_cast<double>(g_sendCalls - callsStart) / kBatches;
+    *segments = static_cast<double>(segmentsOut() - segmentsStart) / kBatches;
+    ::close(fd);
+    printf("%s: %5.2f send syscalls and %4.2f segments per batch of %d, %.0f batches/s, replies %s\n",
+           coalesce ? "coalesced" : "direct   ", *calls, *segments, kPipeline, kBatches / seconds,
+           intact ? "intact and in order" : "broken");
+    return intact;
+}
+
+int main()
+{
+    double directCalls;
+    double directSegments;
+    double coalescedCalls;
+    double coalescedSegments;
+    bool ok = run(kPort, false, &directCalls, &directSegments);
+    ok = run(kPort + 1, true, &coalescedCalls, &coalescedSegments) && ok;
+    // one flush per batch, unless a batch's requests were split over two reads
+    ok = ok && coalescedCalls < 1.5 && coalescedCalls < directCalls && coalescedSegments <= directSegments;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,274 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+#include "codec.hpp"
+
+// FrameCodec decoding over real connections, one server per format: headers and frames
+// split across reads, several frames in one read, oversize lengths, delimiter framing with
+// the delimiter split, and input consumed by someone else between two reads of a partial
+// delimited frame; FrameCodec::send from the loop thread and from another one. Then
+// frames/sec for 1M small frames, decoded by the codec and by the readAsString loop an
+// application would write without it.
+// make TEST=codec && ./output/codec.elf
+static constexpr uint16_t kU32Port = 19097;
+static constexpr uint16_t kVarintPort = 19098;
+static constexpr uint16_t kDelimiterPort = 19099;
+static constexpr uint16_t kStringPort = 19100;
+static constexpr size_t kMaxFrame = 1024;
+static constexpr int kBenchFrames = 1000000;
+static constexpr size_t kBenchPayload = 64;
+
+static std::mutex g_mutex;
+static std::vector<std::string> g_frames;
+static std::atomic<int> g_errors{0};
+static std::atomic<bool> g_bench{false};
+static std::atomic<int> g_counted{0};
+static FrameCodec* g_echoCodec = nullptr;
+
+static void onFrame(const TcpServer::ptrConnection& conn, std::string_view frame)
+{
+    if(g_bench.load(std::memory_order_relaxed))
+    {
+        g_counted.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // echoed with FrameCodec::send from the loop thread, then once more from another thread
+    if(g_echoCodec != nullptr && frame.substr(0, 4) == "echo")
+    {
+        g_echoCodec->send(conn, frame);
+        std::string copy(frame);
+        std::thread([conn, copy]{g_echoCodec->send(conn, copy);}).join();
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_frames.emplace_back(frame);
+}
+
+static void serveCodec(uint16_t port, FrameCodec* codec, bool dropOnBang)
+{
+    std::thread([port, codec, dropOnBang]{
+        TcpServer server(port, 1);
+        codec->setErrorCallback([](const TcpServer::ptrConnection&){g_errors++;});
+        server.setMessageCallback([codec, dropOnBang](const TcpServer::ptrConnection& conn, Buffer* buf){
+            // stands in for application code that discards input behind the codec's back
+            if(dropOnBang && buf->readableSize() > 0 && buf->readPos()[buf->readableSize() - 1] == '!')
+            {
+                buf->moveReadIdx(buf->readableSize());
+                return;
+            }
+            codec->onMessage(conn, buf);
+        });
+        server.start();
+    }).detach();
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static void writeAll(int fd, const std::string& data)
+{
+    for(size_t sent = 0; sent < data.size(); )
+    {
+        ssize_t n = ::write(fd, data.data() + sent, data.size() - sent);
+        if(n <= 0)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        sent += n;
+    }
+}
+
+// true once the server closed the connection, waiting up to a second
+static bool closedByServer(int fd)
+{
+    timeval tv{1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char c;
+    return ::read(fd, &c, 1) == 0;
+}
+
+// sends the pieces one read apart and compares what the codec delivered
+static bool runCase(const char* name, uint16_t port, const std::vector<std::string>& pieces,
+                    const std::vector<std::string>& expected, bool expectError)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        g_frames.clear();
+    }
+    int errors = g_errors.load();
+    int fd = connectServer(port);
+    for(const std::string& piece : pieces)
+    {
+        writeAll(fd, piece);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    bool closed = expectError ? closedByServer(fd) : false;
+    for(int i = 0; i < 100; i++)
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if(g_frames.size() >= expected.size())
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ::close(fd);
+    std::vector<std::string> frames;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        frames = g_frames;
+    }
+    bool errored = g_errors.load() > errors;
+    bool ok = frames == expected && errored == expectError && closed == expectError;
+    printf("%-28s %zu/%zu frames%s %s\n", name, frames.size(), expected.size(),
+           expectError ? (errored && closed ? ", rejected and closed" : ", not rejected") : "", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// the echo of a frame comes back twice, framed the same way
+static bool runEcho(const char* name, uint16_t port, const std::string& frame)
+{
+    int fd = connectServer(port);
+    writeAll(fd, frame);
+    std::string expected = frame + frame;
+    std::string received(expected.size(), '\0');
+    timeval tv{1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    size_t got = 0;
+    while(got < received.size())
+    {
+        ssize_t n = ::read(fd, &received[got], received.size() - got);
+        if(n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    ::close(fd);
+    bool ok = received == expected;
+    printf("%-28s %zu/%zu bytes %s\n", name, got, expected.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static std::string u32(size_t length)
+{
+    char header[4];
+    FrameCodec::encodeHeader(FrameFormat::K_U32, length, header);
+    return std::string(header, 4);
+}
+
+static std::string varint(size_t length)
+{
+    char header[FrameCodec::kMaxVarintBytes];
+    size_t n = FrameCodec::encodeHeader(FrameFormat::K_VARINT, length, header);
+    return std::string(header, n);
+}
+
+// seconds until the server has taken kBenchFrames frames sent as one stream
+static double benchmark(uint16_t port, const std::string& stream)
+{
+    g_counted.store(0);
+    int fd = connectServer(port);
+    auto start = std::chrono::steady_clock::now();
+    writeAll(fd, stream);
+    while(g_counted.load() < kBenchFrames)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ::close(fd);
+    return seconds;
+}
+
+int main()
+{
+    static FrameCodec u32Codec(FrameFormat::K_U32, onFrame, kMaxFrame);
+    static FrameCodec varintCodec(FrameFormat::K_VARINT, onFrame, kMaxFrame);
+    static FrameCodec delimiterCodec(std::string("\r\n"), onFrame, kMaxFrame);
+    g_echoCodec = &u32Codec;
+    serveCodec(kU32Port, &u32Codec, false);
+    serveCodec(kVarintPort, &varintCodec, false);
+    serveCodec(kDelimiterPort, &delimiterCodec, true);
+    std::thread([]{
+        TcpServer server(kStringPort, 1);
+        server.setMessageCallback([](const TcpServer::ptrConnection&, Buffer* buf){
+            while(buf->readableSize() >= 4)
+            {
+                const uint8_t* p = reinterpret_cast<const uint8_t*>(buf->readPos());
+                size_t length = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | p[3];
+                if(buf->readableSize() < 4 + length)
+                {
+                    break;
+                }
+                buf->moveReadIdx(4);
+                std::string frame = buf->readAsString(length, true);
+                g_counted.fetch_add(frame.empty() ? 0 : 1, std::memory_order_relaxed);
+            }
+        });
+        server.start();
+    }).detach();
+
+    std::string big(300, 'x');
+    std::string u32Frames = u32(3) + "one" + u32(3) + "two" + u32(5) + "thr";
+    bool ok = true;
+    ok = runCase("u32 header split", kU32Port, {u32(5).substr(0, 2), u32(5).substr(2) + "hel", "lo"},
+                 {"hello"}, false) && ok;
+    ok = runCase("u32 frames in one read", kU32Port, {u32Frames, "ee"}, {"one", "two", "three"}, false) && ok;
+    ok = runCase("u32 oversize", kU32Port, {u32(kMaxFrame + 1)}, {}, true) && ok;
+    ok = runEcho("u32 send", kU32Port, u32(9) + "echo ping") && ok;
+    ok = runEcho("u32 send large", kU32Port, u32(kMaxFrame) + "echo" + std::string(kMaxFrame - 4, 'l')) && ok;
+    ok = runCase("varint header split", kVarintPort,
+                 {varint(300).substr(0, 1), varint(300).substr(1), big.substr(0, 100), big.substr(100)},
+                 {big}, false) && ok;
+    // the first two bytes already exceed the limit, the rest of the header never comes
+    ok = runCase("varint oversize", kVarintPort, {"\xff\xff"}, {}, true) && ok;
+    ok = runCase("delimiter split", kDelimiterPort, {"ab", "c\r", "\nde\r\n"}, {"abc", "de"}, false) && ok;
+    ok = runCase("delimiter oversize", kDelimiterPort, {std::string(kMaxFrame + 2, 'a')}, {}, true) && ok;
+    ok = runCase("delimiter input consumed", kDelimiterPort, {"aaaa", "!", "b\r\n"}, {"b"}, false) && ok;
+
+    std::string stream;
+    std::string payload(kBenchPayload, 'p');
+    for(int i = 0; i < kBenchFrames; i++)
+    {
+        stream += u32(kBenchPayload);
+        stream += payload;
+    }
+    g_bench.store(true);
+    double codecSeconds = benchmark(kU32Port, stream);
+    double stringSeconds = benchmark(kStringPort, stream);
+    printf("bench %d frames of %zu bytes: codec %.1fM frames/s, readAsString %.1fM frames/s\n", kBenchFrames,
+           kBenchPayload, kBenchFrames / codecSeconds / 1e6, kBenchFrames / stringSeconds / 1e6);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
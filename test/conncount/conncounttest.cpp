@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "tcpserver.hpp"
+
+// Connection bookkeeping at scale.
+// held: the given number of idle connections (default 100k, up to 1M with enough
+// RLIMIT_NOFILE), reported as resident bytes per connection on the server side.
+// churn: client threads connect and reset for a fixed time, reported as connections/s.
+// ids: after every held connection is gone and the slots have been reused by new ones,
+// no old id may find a connection and every new id must find its own.
+// make TEST=conncount && ./output/conncount.elf [connections]
+static constexpr uint16_t kPort = 19122;
+static constexpr int kDestinations = 64;    // 127.0.0.1..64, each has its own port range
+static constexpr int kConnectBatch = 256;   // stays under the listen backlog
+static constexpr int kChurnThreads = 4;
+static constexpr auto kChurnTime = std::chrono::milliseconds(500);
+
+static std::atomic<TcpServer*> g_server{nullptr};
+static std::mutex g_idMutex;
+static std::vector<uint64_t> g_ids;
+
+static long residentBytes()
+{
+    long pages = 0;
+    FILE* f = ::fopen("/proc/self/statm", "r");
+    if(f == nullptr || ::fscanf(f, "%*ld %ld", &pages) != 1)
+    {
+        perror("statm");
+        exit(EXIT_FAILURE);
+    }
+    ::fclose(f);
+    return pages * ::sysconf(_SC_PAGESIZE);
+}
+static int connectionLimit(int wanted)
+{
+    rlimit limit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    // both ends live in this process, plus some for the loops
+    long fit = (static_cast<long>(limit.rlim_cur) - 64) / 2;
+    return static_cast<int>(std::min<long>(wanted, fit));
+}
+static bool waitCount(size_t count)
+{
+    for(int i = 0; i < 3000; i++)
+    {
+        if(g_server.load()->connectionCount() == count)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// opens count non-blocking connections, spread over the destinations, in batches
+static std::vector<int> openConnections(int count)
+{
+    int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    std::vector<int> fds;
+    epoll_event ev[256];
+    for(int begin = 0; begin < count; begin += kConnectBatch)
+    {
+        int end = std::min(count, begin + kConnectBatch);
+        for(int i = begin; i < end; i++)
+        {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(kPort);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % kDestinations);
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if(fd < 0 || (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS))
+            {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+            epoll_event add{EPOLLOUT | EPOLLONESHOT, {.fd = fd}};
+            ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &add);
+            fds.push_back(fd);
+        }
+        for(int done = begin; done < end;)
+        {
+            int n = ::epoll_wait(epfd, ev, 256, 5000);
+            if(n <= 0)
+            {
+                fprintf(stderr, "connect timed out\n");
+                exit(EXIT_FAILURE);
+            }
+            for(int i = 0; i < n; i++)
+            {
+                if(ev[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    fprintf(stderr, "connect failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            done += n;
+        }
+    }
+    ::close(epfd);
+    return fds;
+}
+
+// the ids recorded so far, once there are at least expected of them or after a timeout
+static std::vector<uint64_t> takeIds(size_t expected = 0)
+{
+    for(int i = 0; i < 500; i++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_idMutex);
+            if(g_ids.size() >= expected)
+            {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::lock_guard<std::mutex> lock(g_idMutex);
+    std::vector<uint64_t> ids;
+    ids.swap(g_ids);
+    return ids;
+}
+
+static double churn()
+{
+    std::atomic<uint64_t> done{0};
+    auto deadline = std::chrono::steady_clock::now() + kChurnTime;
+    std::vector<std::thread> clients;
+    for(int t = 0; t < kChurnThreads; t++)
+    {
+        clients.emplace_back([&done, deadline, t]{
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(kPort);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + t % kDestinations);
+            while(std::chrono::steady_clock::now() < deadline)
+            {
+                int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+                {
+                    done++;
+                }
+                // reset instead of TIME_WAIT, so the ports never run out
+                linger lg{1, 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                ::close(fd);
+            }
+        });
+    }
+    for(std::thread& client : clients)
+    {
+        client.join();
+    }
+    return done / std::chrono::duration<double>(kChurnTime).count();
+}
+
+int main(int argc, char** argv)
+{
+    int wanted = argc > 1 ? atoi(argv[1]) : 100000;
+    int conns = connectionLimit(wanted);
+    if(conns < wanted)
+    {
+        printf("RLIMIT_NOFILE allows %d connections of %d\n", conns, wanted);
+    }
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        server.setConnectedCallback([](const TcpServer::ptrConnection& conn){
+            std::lock_guard<std::mutex> lock(g_idMutex);
+            g_ids.push_back(conn->getId());
+        });
+        g_server.store(&server);
+        server.start();
+    }).detach();
+    while(g_server.load() == nullptr)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // warm the client side once so its own allocations don't count against the server
+    for(int fd : openConnections(kConnectBatch))
+    {
+        ::close(fd);
+    }
+    bool ok = waitCount(0);
+    takeIds();
+    long before = residentBytes();
+    std::vector<int> fds = openConnections(conns);
+    ok = waitCount(conns) && ok;
+    long held = residentBytes() - before;
+    std::vector<uint64_t> oldIds = takeIds(conns);
+    printf("held:  %d connections, %ld bytes resident per connection\n", conns,
+           held / std::max(conns, 1));
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    ok = waitCount(0) && ok;
+
+    double rate = churn();
+    ok = waitCount(0) && ok;
+    takeIds();
+    printf("churn: %.0f connections/s with %d client threads\n", rate, kChurnThreads);
+
+    // the freed slots are taken again; a stale id must not match the new occupant
+    std::vector<int> again = openConnections(std::min(conns, 4096));
+    ok = waitCount(again.size()) && ok;
+    std::vector<uint64_t> newIds = takeIds(again.size());
+    int stale = 0;
+    for(uint64_t id : oldIds)
+    {
+        stale += g_server.load()->getConnection(id) != nullptr;
+    }
+    int found = 0;
+    for(uint64_t id : newIds)
+    {
+        TcpServer::ptrConnection conn = g_server.load()->getConnection(id);
+        found += conn != nullptr && conn->getId() == id;
+    }
+    printf("ids:   %d of %zu old ids still match, %d of %zu new ids found\n", stale, oldIds.size(), found,
+           newIds.size());
+    ok = ok && oldIds.size() == static_cast<size_t>(conns) && stale == 0 && found == static_cast<int>(again.size());
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
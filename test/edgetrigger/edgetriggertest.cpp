@@ -0,0 +1,247 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Level-triggered against edge-triggered connections on an echo server.
+// throughput: kTotal bytes are echoed back and checked; the server's epoll_wait, readv and
+// send/sendmsg calls are counted per MB, every thread but the client's is the server.
+// peer close: a half-closed client must get all its echo and then EOF, a client that
+// closes outright must be reported closed, and the loop must stay idle afterwards
+// instead of spinning on a readable fd that only has EOF left.
+// make TEST=edgetrigger && ./output/edgetrigger.elf
+static constexpr uint16_t kPort = 19112;
+static constexpr size_t kTotal = 64 * 1024 * 1024;
+static constexpr size_t kChunk = 64 * 1024;
+static constexpr size_t kHalfClose = 256 * 1024;
+static constexpr int kAbrupt = 50;
+static constexpr auto kIdleWindow = std::chrono::milliseconds(300);
+
+static std::atomic<uint64_t> g_polls{0};
+static std::atomic<uint64_t> g_reads{0};
+static std::atomic<uint64_t> g_writes{0};
+static std::atomic<int> g_closed{0};
+static thread_local bool t_client = false;
+
+template<typename Fn>
+static Fn realFn(const char* name)
+{
+    return reinterpret_cast<Fn>(::dlsym(RTLD_NEXT, name));
+}
+extern "C" int epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout)
+{
+    static auto real = realFn<int (*)(int, epoll_event*, int, int)>("epoll_wait");
+    if(!t_client)
+    {
+        g_polls++;
+    }
+    return real(epfd, events, maxevents, timeout);
+}
+extern "C" ssize_t readv(int fd, const iovec* iov, int iovcnt)
+{
+    static auto real = realFn<ssize_t (*)(int, const iovec*, int)>("readv");
+    if(!t_client)
+    {
+        g_reads++;
+    }
+    return real(fd, iov, iovcnt);
+}
+extern "C" ssize_t send(int fd, const void* buf, size_t len, int flags)
+{
+    static auto real = realFn<ssize_t (*)(int, const void*, size_t, int)>("send");
+    if(!t_client)
+    {
+        g_writes++;
+    }
+    return real(fd, buf, len, flags);
+}
+extern "C" ssize_t sendmsg(int fd, const msghdr* msg, int flags)
+{
+    static auto real = realFn<ssize_t (*)(int, const msghdr*, int)>("sendmsg");
+    if(!t_client)
+    {
+        g_writes++;
+    }
+    return real(fd, msg, flags);
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static bool waitFor(const std::function<bool()>& cond)
+{
+    for(int i = 0; i < 200; i++)
+    {
+        if(cond())
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static double cpuSeconds()
+{
+    rusage ru{};
+    ::getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void startServer(uint16_t port, bool edge)
+{
+    std::thread([port, edge]{
+        TcpServer server(port, 1);
+        if(edge)
+        {
+            server.enableEdgeTrigger();
+        }
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            conn->send(buf->readPos(), buf->readableSize());
+            buf->moveReadIdx(buf->readableSize());
+        });
+        server.setCloseCallback([](const TcpServer::ptrConnection&){
+            g_closed++;
+        });
+        server.start();
+    }).detach();
+    int closed = g_closed;
+    ::close(connectServer(port));
+    waitFor([closed]{return g_closed > closed;});
+}
+
+static bool throughput(uint16_t port, const char* name)
+{
+    int fd = connectServer(port);
+    uint64_t polls = g_polls;
+    uint64_t reads = g_reads;
+    uint64_t writes = g_writes;
+    auto start = std::chrono::steady_clock::now();
+    std::thread writer([fd]{
+        t_client = true;
+        std::vector<char> data(kChunk);
+        for(size_t sent = 0; sent < kTotal; sent += kChunk)
+        {
+            for(size_t i = 0; i < kChunk; i++)
+            {
+                data[i] = static_cast<char>((sent + i) % 251);
+            }
+            size_t off = 0;
+            while(off < kChunk)
+            {
+                ssize_t n = ::write(fd, data.data() + off, kChunk - off);
+                if(n <= 0)
+                {
+                    return;
+                }
+                off += n;
+            }
+        }
+    });
+    std::vector<char> data(kChunk);
+    size_t got = 0;
+    bool intact = true;
+    while(got < kTotal)
+    {
+        ssize_t n = ::read(fd, data.data(), data.size());
+        if(n <= 0)
+        {
+            break;
+        }
+        for(ssize_t i = 0; i < n; i++)
+        {
+            intact = intact && data[i] == static_cast<char>((got + i) % 251);
+        }
+        got += n;
+    }
+    writer.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ::close(fd);
+    double mb = kTotal / (1024.0 * 1024.0);
+    printf("%s: %.0f MB/s, per MB %.1f epoll_wait, %.1f readv, %.1f send, echo %s\n", name, mb / seconds,
+           (g_polls - polls) / mb, (g_reads - reads) / mb, (g_writes - writes) / mb,
+           got == kTotal && intact ? "intact" : "broken");
+    return got == kTotal && intact;
+}
+
+static bool peerClose(uint16_t port, const char* name)
+{
+    int closed = g_closed;
+    // half close: everything sent before the FIN still comes back, then the server closes
+    int fd = connectServer(port);
+    std::vector<char> data(kHalfClose, 'h');
+    bool sent = ::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+    ::shutdown(fd, SHUT_WR);
+    timeval tv{2, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    size_t got = 0;
+    ssize_t n;
+    while((n = ::read(fd, data.data(), data.size())) > 0)
+    {
+        got += n;
+    }
+    bool halfClosed = sent && n == 0 && got == kHalfClose;
+    ::close(fd);
+
+    // outright close, with and without unread data on the server side
+    for(int i = 0; i < kAbrupt; i++)
+    {
+        fd = connectServer(port);
+        char c = 'a';
+        if(i % 2 == 0 && ::write(fd, &c, 1) != 1)
+        {
+            perror("write");
+        }
+        ::close(fd);
+    }
+    bool reported = waitFor([closed]{return g_closed - closed >= kAbrupt + 1;});
+    double cpuStart = cpuSeconds();
+    std::this_thread::sleep_for(kIdleWindow);
+    double cpu = cpuSeconds() - cpuStart;
+    printf("%s: half close echoed %zu/%zu then %s, %d/%d closes reported, %.0f ms cpu over %ld ms after\n",
+           name, got, kHalfClose, n == 0 ? "EOF" : "no EOF", g_closed - closed - 1, kAbrupt, cpu * 1000,
+           static_cast<long>(std::chrono::milliseconds(kIdleWindow).count()));
+    return halfClosed && reported && cpu < std::chrono::duration<double>(kIdleWindow).count() / 5;
+}
+
+int main()
+{
+    t_client = true;
+    startServer(kPort, false);
+    startServer(kPort + 1, true);
+    bool ok = throughput(kPort, "level") && throughput(kPort + 1, "edge ");
+    ok = peerClose(kPort, "level") && ok;
+    ok = peerClose(kPort + 1, "edge ") && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
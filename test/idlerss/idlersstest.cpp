@@ -0,0 +1,169 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "tcpserver.hpp"
+
+// Many connections, each sending a small message every round, with inactivity release on:
+// activity only stamps a time, so resident memory must stay flat however many events the
+// connections see. Connection count as argument, reduced to what RLIMIT_NOFILE allows.
+// make TEST=idlerss && ./output/idlerss.elf [connections]
+static constexpr uint16_t kPort = 19091;
+static constexpr int kDestinations = 4;     // 127.0.0.1..4, each has its own port range
+static constexpr int kConnectBatch = 256;   // stays under the listen backlog
+static constexpr int kWarmupRounds = 5;
+static constexpr int kRounds = 50;
+static constexpr size_t kMessage = 16;
+static constexpr long kMaxGrowthPerConn = 64; // bytes; one timer entry per event was far more
+
+static long residentBytes()
+{
+    long pages = 0;
+    FILE* f = ::fopen("/proc/self/statm", "r");
+    if(f == nullptr || ::fscanf(f, "%*ld %ld", &pages) != 1)
+    {
+        perror("statm");
+        exit(EXIT_FAILURE);
+    }
+    ::fclose(f);
+    return pages * ::sysconf(_SC_PAGESIZE);
+}
+static int connectionLimit(int wanted)
+{
+    rlimit limit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    // both ends live in this process, plus some for the loops
+    long fit = (static_cast<long>(limit.rlim_cur) - 64) / 2;
+    return static_cast<int>(std::min<long>(wanted, fit));
+}
+static void waitAll(int epfd, int count, const std::vector<int>& fds, bool drain)
+{
+    epoll_event ev[256];
+    int done = 0;
+    char buf[kMessage];
+    std::vector<size_t> got(drain ? fds.size() : 0);
+    while(done < count)
+    {
+        int n = ::epoll_wait(epfd, ev, 256, 5000);
+        if(n <= 0)
+        {
+            fprintf(stderr, "timed out with %d of %d done\n", done, count);
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < n; i++)
+        {
+            int idx = static_cast<int>(ev[i].data.u32);
+            if(!drain)
+            {
+                if(ev[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    fprintf(stderr, "connect failed\n");
+                    exit(EXIT_FAILURE);
+                }
+                epoll_event mod{0, {.u32 = static_cast<uint32_t>(idx)}};
+                ::epoll_ctl(epfd, EPOLL_CTL_MOD, fds[idx], &mod);
+                done++;
+                continue;
+            }
+            ssize_t r;
+            while((r = ::read(fds[idx], buf, sizeof(buf))) > 0)
+            {
+                got[idx] += r;
+                if(got[idx] == kMessage)
+                {
+                    done++;
+                }
+            }
+            if(r == 0)
+            {
+                fprintf(stderr, "connection closed by the server\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int wanted = argc > 1 ? atoi(argv[1]) : 50000;
+    int conns = connectionLimit(wanted);
+    if(conns < wanted)
+    {
+        printf("RLIMIT_NOFILE allows %d connections of %d\n", conns, wanted);
+    }
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        server.enableInactivityRelease(600);
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            conn->send(buf->readPos(), buf->readableSize());
+            buf->moveReadIdx(buf->readableSize());
+        });
+        server.start();
+    }).detach();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    std::vector<int> fds;
+    for(int begin = 0; begin < conns; begin += kConnectBatch)
+    {
+        int end = std::min(conns, begin + kConnectBatch);
+        for(int i = begin; i < end; i++)
+        {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(kPort);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % kDestinations);
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if(fd < 0 || (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS))
+            {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+            epoll_event ev{EPOLLOUT, {.u32 = static_cast<uint32_t>(i)}};
+            ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            fds.push_back(fd);
+        }
+        waitAll(epfd, end - begin, fds, false);
+    }
+    for(size_t i = 0; i < fds.size(); i++)
+    {
+        epoll_event ev{EPOLLIN | EPOLLET, {.u32 = static_cast<uint32_t>(i)}};
+        ::epoll_ctl(epfd, EPOLL_CTL_MOD, fds[i], &ev);
+    }
+    char msg[kMessage];
+    std::memset(msg, 'r', sizeof(msg));
+    auto round = [&]{
+        for(int fd : fds)
+        {
+            if(::write(fd, msg, sizeof(msg)) != static_cast<ssize_t>(sizeof(msg)))
+            {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+        }
+        waitAll(epfd, conns, fds, true);
+    };
+    for(int i = 0; i < kWarmupRounds; i++)
+    {
+        round();
+    }
+    long before = residentBytes();
+    for(int i = 0; i < kRounds; i++)
+    {
+        round();
+    }
+    long growth = residentBytes() - before;
+    bool ok = growth <= kMaxGrowthPerConn * conns;
+    printf("%d connections, %d rounds: RSS %ld KB -> %+ld KB\n%s\n", conns, kRounds, before / 1024, growth / 1024,
+           ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
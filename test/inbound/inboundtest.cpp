@@ -0,0 +1,232 @@
+#include <any>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Inbound throughput of a sink server with one worker loop. kConns clients write
+// kPerConn bytes of a counting pattern each; the message callback checks every byte and
+// consumes it. Reported: MB/s and CPU time of the worker loop thread per MB, next to a
+// bare recv loop into a stack array with the same check as the floor.
+// make TEST=inbound && ./output/inbound.elf
+static constexpr uint16_t kPort = 19114;
+static constexpr uint16_t kFloorPort = 19115;
+static constexpr int kConns = 4;
+static constexpr size_t kPerConn = 64 * 1024 * 1024;
+static constexpr size_t kChunk = 64 * 1024;
+
+static std::atomic<uint64_t> g_received{0};
+static std::atomic<bool> g_corrupt{false};
+static std::atomic<bool> g_haveWorker{false};
+static pthread_t g_worker;
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static double threadCpu(pthread_t thread)
+{
+    clockid_t clock;
+    timespec ts{};
+    if(::pthread_getcpuclockid(thread, &clock) != 0 || ::clock_gettime(clock, &ts) != 0)
+    {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool intact(const char* p, size_t n, size_t offset)
+{
+    bool ok = true;
+    for(size_t i = 0; i < n; i++)
+    {
+        ok &= p[i] == static_cast<char>(offset + i);
+    }
+    return ok;
+}
+
+// writes kPerConn pattern bytes to each of fds from its own thread
+static void feed(const std::vector<int>& fds)
+{
+    std::vector<std::thread> writers;
+    for(int fd : fds)
+    {
+        writers.emplace_back([fd]{
+            std::vector<char> data(kChunk);
+            for(size_t sent = 0; sent < kPerConn; sent += kChunk)
+            {
+                for(size_t i = 0; i < kChunk; i++)
+                {
+                    data[i] = static_cast<char>(sent + i);
+                }
+                size_t off = 0;
+                while(off < kChunk)
+                {
+                    ssize_t n = ::write(fd, data.data() + off, kChunk - off);
+                    if(n <= 0)
+                    {
+                        perror("write");
+                        exit(EXIT_FAILURE);
+                    }
+                    off += n;
+                }
+            }
+        });
+    }
+    for(std::thread& writer : writers)
+    {
+        writer.join();
+    }
+}
+
+static bool server()
+{
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        server.setConnectedCallback([](const TcpServer::ptrConnection& conn){
+            conn->setContext(std::any(size_t(0)));
+            if(!g_haveWorker)
+            {
+                g_worker = ::pthread_self();
+                g_haveWorker = true;
+            }
+        });
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            size_t& offset = std::any_cast<size_t&>(*conn->getContext());
+            size_t n = buf->readableSize();
+            if(!intact(buf->readPos(), n, offset))
+            {
+                g_corrupt = true;
+            }
+            offset += n;
+            buf->moveReadIdx(n);
+            g_received += n;
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(kPort));
+    while(!g_haveWorker)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::vector<int> fds;
+    for(int i = 0; i < kConns; i++)
+    {
+        fds.push_back(connectServer(kPort));
+    }
+    double cpuStart = threadCpu(g_worker);
+    auto start = std::chrono::steady_clock::now();
+    feed(fds);
+    uint64_t total = static_cast<uint64_t>(kConns) * kPerConn;
+    while(g_received < total && !g_corrupt)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = threadCpu(g_worker) - cpuStart;
+    double mb = total / (1024.0 * 1024.0);
+    printf("server: %.0f MB/s, %.0f us worker cpu per MB, data %s\n", mb / seconds, cpu * 1e6 / mb,
+           g_corrupt ? "corrupt" : "intact");
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    return !g_corrupt && g_received == total;
+}
+
+// kernel copy into a stack array and the same check, one thread per connection like feed
+static void recvFloor()
+{
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kFloorPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || ::listen(listener, 16) == -1)
+    {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    std::vector<int> fds;
+    std::vector<int> accepted;
+    for(int i = 0; i < kConns; i++)
+    {
+        fds.push_back(connectServer(kFloorPort));
+        accepted.push_back(::accept(listener, nullptr, nullptr));
+    }
+    std::atomic<double> cpu{0};
+    std::vector<std::thread> readers;
+    auto start = std::chrono::steady_clock::now();
+    for(int fd : accepted)
+    {
+        readers.emplace_back([fd, &cpu]{
+            char data[64 * 1024];
+            double cpuStart = threadCpu(::pthread_self());
+            size_t got = 0;
+            while(got < kPerConn)
+            {
+                ssize_t n = ::recv(fd, data, sizeof(data), 0);
+                if(n <= 0 || !intact(data, n, got))
+                {
+                    break;
+                }
+                got += n;
+            }
+            double used = threadCpu(::pthread_self()) - cpuStart;
+            double old = cpu.load();
+            while(!cpu.compare_exchange_weak(old, old + used))
+            {
+            }
+        });
+    }
+    feed(fds);
+    for(std::thread& reader : readers)
+    {
+        reader.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double mb = static_cast<double>(kConns) * kPerConn / (1024.0 * 1024.0);
+    printf("floor:  %.0f MB/s, %.0f us recv cpu per MB\n", mb / seconds, cpu * 1e6 / mb);
+    for(size_t i = 0; i < fds.size(); i++)
+    {
+        ::close(fds[i]);
+        ::close(accepted[i]);
+    }
+    ::close(listener);
+}
+
+int main()
+{
+    printf("%d connections, %zu MB each\n", kConns, kPerConn / (1024 * 1024));
+    bool ok = server();
+    recvFloor();
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
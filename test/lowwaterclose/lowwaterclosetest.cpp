@@ -0,0 +1,103 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// An echo server whose low watermark callback shuts the connection down. The callback
+// runs from the write path once the output drains and the close releases the socket
+// there; the write path must not touch the channel afterwards, re-registering the closed
+// fd would stop the loop.
+// make TEST=lowwaterclose && ./output/lowwaterclose.elf
+static constexpr uint16_t kPort = 19093;
+static constexpr size_t kHighWater = 256 * 1024;
+static constexpr size_t kPerConn = 8 * 1024 * 1024;
+static constexpr int kConns = 8;
+
+static std::atomic<TcpServer*> g_server{nullptr};
+static std::atomic<int> g_closed{0};
+
+static int connectServer()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+int main()
+{
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        // low watermark 0: the callback fires with the output empty, so the shutdown closes
+        // the connection right inside the write path
+        server.setOutputWaterMarks(kHighWater, 0);
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            conn->send(buf->readPos(), buf->readableSize());
+            buf->moveReadIdx(buf->readableSize());
+        });
+        server.setLowWaterMarkCallback([](const TcpServer::ptrConnection& conn){
+            conn->shutdown();
+        });
+        server.setCloseCallback([](const TcpServer::ptrConnection&){
+            g_closed++;
+        });
+        g_server.store(&server);
+        server.start();
+    }).detach();
+
+    size_t echoed = 0;
+    for(int i = 0; i < kConns; i++)
+    {
+        int fd = connectServer();
+        std::thread writer([fd]{
+            static char data[64 * 1024];
+            std::memset(data, 'w', sizeof(data));
+            for(size_t sent = 0; sent < kPerConn; sent += sizeof(data))
+            {
+                // the server closes once it drained the echo, the rest of the writes fail
+                if(::send(fd, data, sizeof(data), MSG_NOSIGNAL) <= 0)
+                {
+                    break;
+                }
+            }
+        });
+        // let the echo back up past the high watermark before draining it
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        char buf[64 * 1024];
+        ssize_t n;
+        while((n = ::read(fd, buf, sizeof(buf))) > 0)
+        {
+            echoed += n;
+        }
+        writer.join();
+        ::close(fd);
+    }
+    // the last close may still be on its way through the loop
+    for(int i = 0; i < 100 && (g_closed.load() < kConns || g_server.load()->connectionCount() > 0); i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    size_t open = g_server.load()->connectionCount();
+    bool ok = g_closed.load() == kConns && open == 0;
+    printf("closed %d/%d connections from the low watermark callback after %zu MB echoed, %zu still open\n%s\n",
+           g_closed.load(), kConns, echoed >> 20, open, ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Connections moved back and forth between loops while a thread that owns no loop sends
+// numbered words to each of them and the clients send numbered words back. Both directions
+// must arrive complete and in order, and every callback, including migrateTo's done, must
+// run on the loop that owns the connection at that moment: a callback on the loop it left
+// would see another thread in getLoop(). Runs once on epoll and once on io_uring, whose
+// completion mode waits for the ring before a move.
+// make TEST=migrate && ./output/migrate.elf
+static constexpr uint16_t kPort = 19095;
+static constexpr int kConns = 8;
+static constexpr int kThreads = 4;
+static constexpr uint32_t kWords = 1 << 20;       // per connection and direction
+static constexpr uint32_t kChunk = 1024;          // words per send or write
+static constexpr uint64_t kMinMigrations = 100;
+
+struct Phase
+{
+    std::mutex mutex;
+    std::vector<TcpServer::ptrConnection> conns;
+    std::vector<EventLoop*> loops;
+    std::atomic<uint64_t> inbound{0};       // words the server received
+    std::atomic<uint64_t> misordered{0};
+    std::atomic<uint64_t> wrongLoop{0};
+    std::atomic<uint64_t> migrations{0};
+    std::atomic<bool> stop{false};
+};
+
+static void checkLoop(Phase* phase, const TcpServer::ptrConnection& conn)
+{
+    if(!conn->getLoop()->isInLoopThread())
+    {
+        phase->wrongLoop++;
+    }
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static bool runPhase(const char* name, PollerBackend backend, uint16_t port)
+{
+    // the server thread outlives the phase, so does its state
+    Phase* phase = new Phase;
+    std::thread([phase, backend, port]{
+        TcpServer server(port, kThreads, AcceptMode::K_SINGLE_ACCEPTER, backend);
+        server.setConnectedCallback([phase](const TcpServer::ptrConnection& conn){
+            checkLoop(phase, conn);
+            conn->setContext(uint32_t(0));
+            std::lock_guard<std::mutex> lock(phase->mutex);
+            phase->conns.push_back(conn);
+            if(std::find(phase->loops.begin(), phase->loops.end(), conn->getLoop()) == phase->loops.end())
+            {
+                phase->loops.push_back(conn->getLoop());
+            }
+        });
+        server.setMessageCallback([phase](const TcpServer::ptrConnection& conn, Buffer* buf){
+            checkLoop(phase, conn);
+            uint32_t* expected = std::any_cast<uint32_t>(conn->getContext());
+            uint64_t words = 0;
+            while(buf->readableSize() >= sizeof(uint32_t))
+            {
+                uint32_t word;
+                std::memcpy(&word, buf->readPos(), sizeof(word));
+                buf->moveReadIdx(sizeof(word));
+                if(word != (*expected)++)
+                {
+                    phase->misordered++;
+                }
+                words++;
+            }
+            phase->inbound += words;
+        });
+        server.setCloseCallback([phase](const TcpServer::ptrConnection& conn){
+            checkLoop(phase, conn);
+        });
+        server.start();
+    }).detach();
+
+    std::vector<int> fds;
+    for(int i = 0; i < kConns; i++)
+    {
+        fds.push_back(connectServer(port));
+    }
+    for(int i = 0; i < 500; i++)
+    {
+        std::lock_guard<std::mutex> lock(phase->mutex);
+        if(phase->conns.size() == kConns)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::vector<TcpServer::ptrConnection> conns;
+    std::vector<EventLoop*> loops;
+    {
+        std::lock_guard<std::mutex> lock(phase->mutex);
+        conns = phase->conns;
+        loops = phase->loops;
+    }
+    if(conns.size() != kConns || loops.size() < 2)
+    {
+        printf("%s: %zu connections on %zu loops\n", name, conns.size(), loops.size());
+        return false;
+    }
+
+    // each connection alternates between its own loop and the next one
+    std::thread migrator([phase, conns, loops]{
+        for(size_t round = 0; !phase->stop.load(); round++)
+        {
+            for(size_t i = 0; i < conns.size(); i++)
+            {
+                EventLoop* target = loops[(i + round) % loops.size()];
+                conns[i]->migrateTo(target, [phase](const TcpServer::ptrConnection& conn, bool moved){
+                    checkLoop(phase, conn);
+                    if(moved)
+                    {
+                        phase->migrations++;
+                    }
+                });
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    });
+    // server to client, from a thread that owns no loop
+    std::thread sender([conns]{
+        uint32_t words[kChunk];
+        for(uint32_t base = 0; base < kWords; base += kChunk)
+        {
+            for(uint32_t i = 0; i < kChunk; i++)
+            {
+                words[i] = base + i;
+            }
+            for(const TcpServer::ptrConnection& conn : conns)
+            {
+                conn->send(reinterpret_cast<const char*>(words), sizeof(words));
+            }
+        }
+    });
+    std::vector<std::thread> clients;
+    std::atomic<uint64_t> outbound{0};      // words the clients received in order
+    std::atomic<uint64_t> clientMisordered{0};
+    for(int fd : fds)
+    {
+        clients.emplace_back([fd]{
+            uint32_t words[kChunk];
+            for(uint32_t base = 0; base < kWords; base += kChunk)
+            {
+                for(uint32_t i = 0; i < kChunk; i++)
+                {
+                    words[i] = base + i;
+                }
+                if(::write(fd, words, sizeof(words)) != static_cast<ssize_t>(sizeof(words)))
+                {
+                    perror("write");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        });
+        clients.emplace_back([fd, &outbound, &clientMisordered]{
+            char buf[64 * 1024];
+            size_t held = 0;
+            uint32_t expected = 0;
+            while(expected < kWords)
+            {
+                ssize_t n = ::read(fd, buf + held, sizeof(buf) - held);
+                if(n <= 0)
+                {
+                    perror("read");
+                    exit(EXIT_FAILURE);
+                }
+                held += n;
+                size_t used = 0;
+                for(; held - used >= sizeof(uint32_t); used += sizeof(uint32_t))
+                {
+                    uint32_t word;
+                    std::memcpy(&word, buf + used, sizeof(word));
+                    if(word != expected++)
+                    {
+                        clientMisordered++;
+                    }
+                }
+                std::memmove(buf, buf + used, held - used);
+                held -= used;
+                outbound += used / sizeof(uint32_t);
+            }
+        });
+    }
+    sender.join();
+    for(std::thread& client : clients)
+    {
+        client.join();
+    }
+    uint64_t total = static_cast<uint64_t>(kWords) * kConns;
+    for(int i = 0; i < 1000 && phase->inbound.load() < total; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    phase->stop.store(true);
+    migrator.join();
+    // the last migrations settle before their callbacks are counted
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    bool ok = phase->inbound.load() == total && outbound.load() == total && phase->misordered.load() == 0 &&
+              clientMisordered.load() == 0 && phase->wrongLoop.load() == 0 &&
+              phase->migrations.load() >= kMinMigrations;
+    printf("%-8s %zu loops, %llu migrations: in %llu/%llu words, out %llu/%llu, %llu out of order, "
+           "%llu callbacks off the owning loop\n",
+           name, loops.size(), static_cast<unsigned long long>(phase->migrations.load()),
+           static_cast<unsigned long long>(phase->inbound.load()), static_cast<unsigned long long>(total),
+           static_cast<unsigned long long>(outbound.load()), static_cast<unsigned long long>(total),
+           static_cast<unsigned long long>(phase->misordered.load() + clientMisordered.load()),
+           static_cast<unsigned long long>(phase->wrongLoop.load()));
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    return ok;
+}
+
+int main()
+{
+    bool ok = runPhase("epoll", PollerBackend::K_EPOLL, kPort);
+    ok = runPhase("io_uring", PollerBackend::K_IO_URING, kPort + 1) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
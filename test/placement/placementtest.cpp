@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Placement under a skewed workload on kLoops loops. kHeavy connections keep their loop
+// busy (each request spins kHeavyWork on the loop), then kLight connections arrive and
+// ping-pong one byte every kLightPause. Per policy: how many light connections landed on
+// a loop with a heavy one, and the light round trip p50/p99. Round robin and least
+// connections don't see the busy loops; least busy and power of two should avoid them.
+// make TEST=placement && ./output/placement.elf
+static constexpr uint16_t kPort = 19124;
+static constexpr int kLoops = 4;
+static constexpr int kHeavy = 2;
+static constexpr int kLight = 32;
+static constexpr auto kHeavyWork = std::chrono::milliseconds(1);
+static constexpr auto kLightPause = std::chrono::milliseconds(2);
+static constexpr auto kWarmup = std::chrono::milliseconds(300);
+static constexpr auto kMeasure = std::chrono::seconds(1);
+
+static std::mutex g_mutex;
+static std::map<EventLoop*, int> g_heavyLoops;
+static std::vector<EventLoop*> g_lightLoops;
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static bool roundTrip(int fd, char c)
+{
+    return ::write(fd, &c, 1) == 1 && ::read(fd, &c, 1) == 1;
+}
+
+static void startServer(uint16_t port, PlacementPolicy policy)
+{
+    std::thread([port, policy]{
+        TcpServer server(port, kLoops);
+        server.setPlacementPolicy(policy);
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            while(buf->readableSize() > 0)
+            {
+                char c = *buf->readPos();
+                buf->moveReadIdx(1);
+                if(c == 'H')
+                {
+                    auto until = std::chrono::steady_clock::now() + kHeavyWork;
+                    while(std::chrono::steady_clock::now() < until)
+                    {
+                    }
+                }
+                else if(c == 'h' || c == 'l')
+                {
+                    // first byte of a connection: tells which kind it is
+                    std::lock_guard<std::mutex> lock(g_mutex);
+                    if(c == 'h')
+                    {
+                        g_heavyLoops[conn->getLoop()]++;
+                    }
+                    else
+                    {
+                        g_lightLoops.push_back(conn->getLoop());
+                    }
+                }
+                conn->send(&c, 1);
+            }
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(port));
+}
+
+// false if a request went unanswered; shared gets the light connections placed next to a heavy one
+static bool run(uint16_t port, PlacementPolicy policy, const char* name, int* shared)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        g_heavyLoops.clear();
+        g_lightLoops.clear();
+    }
+    startServer(port, policy);
+    std::atomic<bool> stop{false};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> heavy;
+    for(int i = 0; i < kHeavy; i++)
+    {
+        int fd = connectServer(port);
+        failed = failed || !roundTrip(fd, 'h');
+        heavy.emplace_back([fd, &stop, &failed]{
+            while(!stop)
+            {
+                if(!roundTrip(fd, 'H'))
+                {
+                    failed = true;
+                    break;
+                }
+            }
+            ::close(fd);
+        });
+    }
+    // let the busy time of the heavy loops show before the light connections are placed
+    std::this_thread::sleep_for(kWarmup);
+    std::mutex latencyMutex;
+    std::vector<double> latencies;
+    std::vector<std::thread> light;
+    auto until = std::chrono::steady_clock::now() + kMeasure;
+    for(int i = 0; i < kLight; i++)
+    {
+        int fd = connectServer(port);
+        failed = failed || !roundTrip(fd, 'l');
+        light.emplace_back([fd, until, &failed, &latencyMutex, &latencies]{
+            std::vector<double> mine;
+            while(std::chrono::steady_clock::now() < until)
+            {
+                auto start = std::chrono::steady_clock::now();
+                if(!roundTrip(fd, 'p'))
+                {
+                    failed = true;
+                    break;
+                }
+                mine.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+                std::this_thread::sleep_for(kLightPause);
+            }
+            ::close(fd);
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+        });
+    }
+    for(std::thread& t : light)
+    {
+        t.join();
+    }
+    stop = true;
+    for(std::thread& t : heavy)
+    {
+        t.join();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p){
+        return latencies.empty() ? 0.0 : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+    *shared = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for(EventLoop* loop : g_lightLoops)
+        {
+            *shared += g_heavyLoops.count(loop) > 0;
+        }
+    }
+    printf("%-17s %2d/%d light connections next to a heavy one, light rtt p50 %6.0f us, p99 %6.0f us\n", name, *shared,
+           kLight, percentile(0.5), percentile(0.99));
+    return !failed && !latencies.empty();
+}
+
+int main()
+{
+    printf("%d loops on %u CPUs, %d heavy connections (%ld ms per request), %d light ones\n", kLoops,
+           std::thread::hardware_concurrency(), kHeavy,
+           static_cast<long>(std::chrono::milliseconds(kHeavyWork).count()), kLight);
+    int roundRobin;
+    int leastConnections;
+    int leastBusy;
+    int powerOfTwo;
+    bool ok = run(kPort, PlacementPolicy::K_ROUND_ROBIN, "round robin", &roundRobin);
+    ok = run(kPort + 1, PlacementPolicy::K_LEAST_CONNECTIONS, "least connections", &leastConnections) && ok;
+    ok = run(kPort + 2, PlacementPolicy::K_LEAST_BUSY, "least busy", &leastBusy) && ok;
+    ok = run(kPort + 3, PlacementPolicy::K_POWER_OF_TWO, "power of two", &powerOfTwo) && ok;
+    // the busy-aware policies must steer light connections away from the busy loops
+    ok = ok && leastBusy < roundRobin && powerOfTwo < roundRobin;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+#include <sys/eventfd.h>
+#include "eventloop.hpp"
+
+// Poller with many ready fds. kFds eventfds are kept readable (level-triggered). Checked:
+// every ready channel is reported within a few polls, epoll's event array grows until one
+// wait returns all of them, and after half of the channels are removed and their fd
+// numbers reused by new channels, events go to the new channels only. Reported: ns per
+// delivered event once warm and the cost of a remove and re-add.
+// make TEST=poller && ./output/poller.elf
+static constexpr int kFds = 10000;
+static constexpr int kRounds = 200;
+static constexpr int kMaxPolls = 64;
+
+struct Source
+{
+    int fd;
+    std::unique_ptr<Channel> ch;
+};
+
+static Source openSource(EventLoop* loop)
+{
+    int fd = ::eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd == -1)
+    {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    Source s{fd, std::unique_ptr<Channel>(new Channel(fd, loop))};
+    s.ch->enableRead();
+    return s;
+}
+
+// polls until every channel in expected has been reported; false if another channel
+// (a removed one) shows up or some are still missing after kMaxPolls
+static bool reportsAll(Poller* poller, const std::unordered_set<Channel*>& expected, int* polls)
+{
+    std::unordered_set<Channel*> seen;
+    std::vector<Channel*> active;
+    *polls = 0;
+    while(seen.size() < expected.size() && *polls < kMaxPolls)
+    {
+        active.clear();
+        poller->poll(active, 0);
+        ++*polls;
+        for(Channel* ch : active)
+        {
+            if(!expected.count(ch))
+            {
+                return false;
+            }
+            seen.insert(ch);
+        }
+    }
+    return seen.size() == expected.size();
+}
+
+static bool run(PollerBackend backend, const char* name)
+{
+    EventLoop loop(backend);
+    Poller* poller = loop.poller();
+    std::vector<Source> sources;
+    std::unordered_set<Channel*> expected;
+    for(int i = 0; i < kFds; i++)
+    {
+        sources.push_back(openSource(&loop));
+        expected.insert(sources.back().ch.get());
+    }
+    int polls;
+    bool ok = reportsAll(poller, expected, &polls);
+
+    std::vector<Channel*> active;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t events = 0;
+    size_t largest = 0;
+    for(int r = 0; r < kRounds; r++)
+    {
+        active.clear();
+        poller->poll(active, 0);
+        events += active.size();
+        largest = std::max(largest, active.size());
+        for(Channel* ch : active)
+        {
+            ch->handleEvent();
+        }
+    }
+    double perEvent = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / events;
+
+    // remove every other channel, then reuse the fd numbers for new channels
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < kFds; i += 2)
+    {
+        Source& s = sources[i];
+        expected.erase(s.ch.get());
+        s.ch->remove();
+        ::close(s.fd);
+        s = openSource(&loop);
+        expected.insert(s.ch.get());
+    }
+    double perChurn = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (kFds / 2);
+    int churnPolls;
+    ok = reportsAll(poller, expected, &churnPolls) && ok;
+    printf("%s: %d ready fds all reported within %d polls, largest batch %zu, %.0f ns per event, "
+           "%.0f ns per remove + add, %s\n", name, kFds, polls, largest, perEvent, perChurn,
+           ok ? "nothing lost or stale" : "events lost or stale");
+    for(Source& s : sources)
+    {
+        s.ch->remove();
+        ::close(s.fd);
+    }
+    // epoll's event array grows until one wait takes every ready fd
+    return ok && (backend != PollerBackend::K_EPOLL || largest == static_cast<size_t>(kFds));
+}
+
+int main()
+{
+    bool ok = run(PollerBackend::K_EPOLL, "epoll   ");
+    ok = run(PollerBackend::K_IO_URING, "io_uring") && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
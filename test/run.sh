@@ -0,0 +1,17 @@
+#!/bin/sh
+# builds and runs every test program, one directory each: sh test/run.sh
+cd "$(dirname "$0")/.." || exit 1
+status=0
+for dir in test/*/; do
+    name=$(basename "$dir")
+    make clean > /dev/null
+    if ! make TEST="$name" -j8 > /dev/null 2>&1; then
+        echo "$name: build failed"
+        status=1
+        continue
+    fi
+    echo "== $name"
+    ./output/"$name".elf || status=1
+done
+make clean > /dev/null
+exit $status
@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// File transfer without user-space copies over loopback.
+// download: a kFileSize sparse file, stamped with its own offset every kStride bytes, goes
+// out with sendFile between two copied sends; the client checks the order and every byte.
+// upload: kUpload bytes following a request byte are spliced into a file, the byte after
+// the body must still reach the message callback, after the done callback.
+// Reported: MB/s and the worker loop's CPU time per GB in each direction.
+// make TEST=sendfile && ./output/sendfile.elf
+static constexpr uint16_t kPort = 19118;
+static constexpr size_t kFileSize = size_t(2) << 30;
+static constexpr size_t kUpload = size_t(512) << 20;
+static constexpr size_t kStride = 1 << 20;
+static constexpr size_t kChunk = 256 * 1024;
+
+static int g_download = -1;
+static int g_upload = -1;
+static std::atomic<size_t> g_stored{0};
+static std::atomic<int> g_sent{0};
+static std::atomic<bool> g_haveWorker{false};
+static pthread_t g_worker;
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static double threadCpu(pthread_t thread)
+{
+    clockid_t clock;
+    timespec ts{};
+    if(::pthread_getcpuclockid(thread, &clock) != 0 || ::clock_gettime(clock, &ts) != 0)
+    {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the file's content: zero except for the offset itself at the start of every stride
+static char expectedAt(size_t pos)
+{
+    size_t r = pos % kStride;
+    if(r >= sizeof(uint64_t))
+    {
+        return 0;
+    }
+    uint64_t stamp = pos - r;
+    return reinterpret_cast<const char*>(&stamp)[r];
+}
+
+// whether p holds the file's bytes from pos on; the zero runs are compared in one go
+static bool matchesFile(const char* p, size_t n, size_t pos)
+{
+    static const std::vector<char> zeros(kStride);
+    while(n > 0)
+    {
+        size_t r = pos % kStride;
+        size_t len = r < sizeof(uint64_t) ? 1 : std::min(n, kStride - r);
+        if(len == 1 ? *p != expectedAt(pos) : std::memcmp(p, zeros.data(), len) != 0)
+        {
+            return false;
+        }
+        p += len;
+        pos += len;
+        n -= len;
+    }
+    return true;
+}
+// upload content: every chunk filled with a byte of its own
+static char uploadByte(size_t pos)
+{
+    return static_cast<char>(pos / kChunk + 1);
+}
+
+static int tempFile(const char* name)
+{
+    char path[64];
+    std::snprintf(path, sizeof(path), "/tmp/%s.XXXXXX", name);
+    int fd = ::mkstemp(path);
+    if(fd == -1)
+    {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    ::unlink(path);
+    return fd;
+}
+
+static void startServer()
+{
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        server.setConnectedCallback([](const TcpServer::ptrConnection&){
+            if(!g_haveWorker)
+            {
+                g_worker = ::pthread_self();
+                g_haveWorker = true;
+            }
+        });
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            while(buf->readableSize() > 0)
+            {
+                char op = *buf->readPos();
+                buf->moveReadIdx(1);
+                if(op == 'G')
+                {
+                    conn->send("HDR", 3);
+                    conn->sendFile(g_download, 0, kFileSize, []{g_sent++;});
+                    conn->send("END", 3);
+                }
+                else if(op == 'U')
+                {
+                    conn->spliceToFile(g_upload, kUpload, [](const TcpServer::ptrConnection& c, size_t stored){
+                        g_stored = stored;
+                        c->send("OK", 2);
+                    });
+                    return;
+                }
+                else
+                {
+                    conn->send(&op, 1);
+                }
+            }
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(kPort));
+    while(!g_haveWorker)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static bool readExactly(int fd, char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = ::read(fd, data, len);
+        if(n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool download(int fd)
+{
+    double cpuStart = threadCpu(g_worker);
+    auto start = std::chrono::steady_clock::now();
+    char head[3];
+    if(::write(fd, "G", 1) != 1 || !readExactly(fd, head, sizeof(head)))
+    {
+        return false;
+    }
+    bool intact = std::memcmp(head, "HDR", 3) == 0;
+    std::vector<char> data(kChunk);
+    size_t got = 0;
+    while(got < kFileSize)
+    {
+        ssize_t n = ::read(fd, data.data(), std::min(kChunk, kFileSize - got));
+        if(n <= 0)
+        {
+            return false;
+        }
+        intact = intact && matchesFile(data.data(), n, got);
+        got += n;
+    }
+    char tail[3];
+    intact = intact && readExactly(fd, tail, sizeof(tail)) && std::memcmp(tail, "END", 3) == 0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = threadCpu(g_worker) - cpuStart;
+    double gb = kFileSize / double(1 << 30);
+    printf("download: %.0f MB sparse file at %.0f MB/s, %.0f ms worker cpu per GB, %s\n", gb * 1024,
+           gb * 1024 / seconds, cpu * 1000 / gb, intact ? "intact and in order" : "broken");
+    return intact;
+}
+
+static bool upload(int fd)
+{
+    double cpuStart = threadCpu(g_worker);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char> data(kChunk);
+    std::vector<char> expected(kChunk);
+    bool ok = ::write(fd, "U", 1) == 1;
+    for(size_t sent = 0; ok && sent < kUpload; sent += kChunk)
+    {
+        std::memset(data.data(), uploadByte(sent), kChunk);
+        ok = ::write(fd, data.data(), kChunk) == static_cast<ssize_t>(kChunk);
+    }
+    char reply[3];
+    ok = ok && ::write(fd, "X", 1) == 1 && readExactly(fd, reply, sizeof(reply)) && std::memcmp(reply, "OKX", 3) == 0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = threadCpu(g_worker) - cpuStart;
+    bool stored = g_stored == kUpload && ::lseek(g_upload, 0, SEEK_CUR) == static_cast<off_t>(kUpload);
+    for(size_t pos = 0; stored && pos < kUpload; pos += kChunk)
+    {
+        std::memset(expected.data(), uploadByte(pos), kChunk);
+        stored = ::pread(g_upload, data.data(), kChunk, pos) == static_cast<ssize_t>(kChunk) &&
+                 std::memcmp(data.data(), expected.data(), kChunk) == 0;
+    }
+    double gb = kUpload / double(1 << 30);
+    printf("upload:   %.0f MB spliced at %.0f MB/s, %.0f ms worker cpu per GB, file %s, next byte %s\n",
+           gb * 1024, gb * 1024 / seconds, cpu * 1000 / gb, stored ? "intact" : "broken",
+           ok ? "delivered after done" : "lost or early");
+    return ok && stored;
+}
+
+int main()
+{
+    g_download = tempFile("sendfile-src");
+    g_upload = tempFile("sendfile-dst");
+    if(::ftruncate(g_download, kFileSize) == -1)
+    {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t pos = 0; pos < kFileSize; pos += kStride)
+    {
+        uint64_t stamp = pos;
+        if(::pwrite(g_download, &stamp, sizeof(stamp), pos) != sizeof(stamp))
+        {
+            perror("pwrite");
+            exit(EXIT_FAILURE);
+        }
+    }
+    startServer();
+    int fd = connectServer(kPort);
+    bool ok = download(fd);
+    ok = upload(fd) && ok;
+    ok = ok && g_sent == 1;
+    ::close(fd);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
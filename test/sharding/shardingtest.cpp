@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Per-loop connection registries.
+// churn: client threads connect and reset for kChurnTime against 1, 2 and 4 loops while
+// another thread keeps looking up the newest ids; reported as connections/s and lookups/s.
+// held: kHeldPerLoop connections per loop stay open. Every loop must tag its ids with one
+// tag of its own, getConnection() must find each of them from a foreign thread,
+// forEachConnection() must visit each once, and after the close no id may match again.
+// make TEST=sharding && ./output/sharding.elf
+static constexpr uint16_t kPort = 19133;
+static constexpr int kChurnThreads = 4;
+static constexpr int kHeldPerLoop = 64;
+static constexpr auto kChurnTime = std::chrono::milliseconds(500);
+
+struct Record
+{
+    uint64_t id;
+    EventLoop* loop;
+};
+
+static std::atomic<TcpServer*> g_server{nullptr};
+static std::mutex g_mutex;
+static std::vector<Record> g_records;
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static bool waitCount(size_t count)
+{
+    for(int i = 0; i < 3000; i++)
+    {
+        if(g_server.load()->connectionCount() == count)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// the records so far, once there are at least expected of them or after a timeout
+static std::vector<Record> takeRecords(size_t expected = 0)
+{
+    for(int i = 0; i < 500; i++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            if(g_records.size() >= expected)
+            {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    std::vector<Record> records;
+    records.swap(g_records);
+    return records;
+}
+
+static void startServer(uint16_t port, int loops)
+{
+    g_server = nullptr;
+    std::thread([port, loops]{
+        TcpServer server(port, loops);
+        server.setConnectedCallback([](const TcpServer::ptrConnection& conn){
+            std::lock_guard<std::mutex> lock(g_mutex);
+            g_records.push_back({conn->getId(), conn->getLoop()});
+        });
+        g_server.store(&server);
+        server.start();
+    }).detach();
+    while(g_server.load() == nullptr)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ::close(connectServer(port));
+}
+
+static void churn(uint16_t port, double* connections, double* lookups)
+{
+    std::atomic<uint64_t> done{0};
+    std::atomic<uint64_t> looked{0};
+    auto deadline = std::chrono::steady_clock::now() + kChurnTime;
+    std::vector<std::thread> clients;
+    for(int t = 0; t < kChurnThreads; t++)
+    {
+        clients.emplace_back([port, &done, deadline]{
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            while(std::chrono::steady_clock::now() < deadline)
+            {
+                int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+                {
+                    done++;
+                }
+                // reset instead of TIME_WAIT, so the ports never run out
+                linger lg{1, 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                ::close(fd);
+            }
+        });
+    }
+    clients.emplace_back([&looked, deadline]{
+        while(std::chrono::steady_clock::now() < deadline)
+        {
+            uint64_t id = 0;
+            {
+                std::lock_guard<std::mutex> lock(g_mutex);
+                if(!g_records.empty())
+                {
+                    id = g_records.back().id;
+                }
+            }
+            g_server.load()->getConnection(id);
+            looked++;
+        }
+    });
+    for(std::thread& client : clients)
+    {
+        client.join();
+    }
+    double seconds = std::chrono::duration<double>(kChurnTime).count();
+    *connections = done / seconds;
+    *lookups = looked / seconds;
+}
+
+static bool run(uint16_t port, int loops)
+{
+    startServer(port, loops);
+    bool ok = waitCount(0);
+    takeRecords(1);
+    double connections;
+    double lookups;
+    churn(port, &connections, &lookups);
+    ok = waitCount(0) && ok;
+    takeRecords();
+
+    int held = kHeldPerLoop * loops;
+    std::vector<int> fds;
+    for(int i = 0; i < held; i++)
+    {
+        fds.push_back(connectServer(port));
+    }
+    ok = waitCount(held) && ok;
+    std::vector<Record> records = takeRecords(held);
+    std::map<EventLoop*, std::set<uint32_t>> tags;
+    int found = 0;
+    for(const Record& r : records)
+    {
+        tags[r.loop].insert(SlotMap<TcpServer::ptrConnection>::tagOf(r.id));
+        TcpServer::ptrConnection conn = g_server.load()->getConnection(r.id);
+        found += conn != nullptr && conn->getId() == r.id && conn->getLoop() == r.loop;
+    }
+    std::set<uint32_t> distinct;
+    bool oneTagEach = static_cast<int>(tags.size()) == loops;
+    for(const auto& loopTags : tags)
+    {
+        oneTagEach = oneTagEach && loopTags.second.size() == 1;
+        distinct.insert(loopTags.second.begin(), loopTags.second.end());
+    }
+    oneTagEach = oneTagEach && static_cast<int>(distinct.size()) == loops;
+    int visited = 0;
+    g_server.load()->forEachConnection([&visited](const TcpServer::ptrConnection&){visited++;});
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    ok = waitCount(0) && ok;
+    int stale = 0;
+    for(const Record& r : records)
+    {
+        stale += g_server.load()->getConnection(r.id) != nullptr;
+    }
+    printf("%d loop(s): churn %.0f connections/s, %.1fM lookups/s; held %d: %d found, %d visited, %d stale, "
+           "%s\n", loops, connections, lookups / 1e6, held, found, visited, stale,
+           oneTagEach ? "one tag per loop" : "TAGS MIXED");
+    return ok && static_cast<int>(records.size()) == held && found == held && visited == held && stale == 0 &&
+           oneTagEach;
+}
+
+int main()
+{
+    printf("%u CPUs, %d client threads\n", std::thread::hardware_concurrency(), kChurnThreads);
+    bool ok = run(kPort, 1);
+    ok = run(kPort + 1, 2) && ok;
+    ok = run(kPort + 2, 4) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
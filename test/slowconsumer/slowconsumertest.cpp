@@ -0,0 +1,94 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// An echo server fed as fast as a client can write while the client reads the echo
+// slowly. The output high watermark pauses reading from the connection, so the server's
+// buffer memory stays bounded by the watermark instead of growing with the backlog.
+// make TEST=slowconsumer && ./output/slowconsumer.elf
+static constexpr uint16_t kPort = 19092;
+static constexpr size_t kHighWater = 1024 * 1024;
+static constexpr size_t kLowWater = 256 * 1024;
+static constexpr size_t kTotal = 64 * 1024 * 1024;
+static constexpr size_t kReadChunk = 16 * 1024;   // per read, with a pause in between
+static constexpr size_t kMaxBuffered = 4 * kHighWater;
+
+static std::atomic<TcpServer*> g_server{nullptr};
+
+static int connectServer()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+int main()
+{
+    std::thread([]{
+        TcpServer server(kPort, 1);
+        server.setOutputWaterMarks(kHighWater, kLowWater);
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            conn->send(buf->readPos(), buf->readableSize());
+            buf->moveReadIdx(buf->readableSize());
+        });
+        g_server.store(&server);
+        server.start();
+    }).detach();
+
+    int fd = connectServer();
+    std::thread writer([fd]{
+        static char data[64 * 1024];
+        std::memset(data, 'w', sizeof(data));
+        for(size_t sent = 0; sent < kTotal; sent += sizeof(data))
+        {
+            if(::write(fd, data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)))
+            {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+        }
+    });
+    char buf[kReadChunk];
+    size_t received = 0;
+    while(received < kTotal)
+    {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if(n <= 0)
+        {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        received += n;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    writer.join();
+    size_t peak = 0;
+    for(const BufferPool::Stats& stats : g_server.load()->bufferStats())
+    {
+        peak = std::max(peak, stats.highWater);
+    }
+    bool ok = peak <= kMaxBuffered;
+    printf("echoed %zu MB, peak server buffers %zu KB (high watermark %zu KB)\n%s\n", received >> 20, peak >> 10,
+           kHighWater >> 10, ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
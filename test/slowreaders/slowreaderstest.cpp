@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Many slow readers of one large response. Every client asks for the same kPayload
+// bytes with a tiny receive buffer and doesn't read until all responses are queued, so
+// nearly all of it waits in the server. Copied, each connection holds its own unsent
+// tail; sent as one shared_ptr<const std::string>, every output queue refers to the
+// same bytes. Reported per mode: pool bytes in use while the readers stall, RSS growth,
+// then the drain rate once they read. Every response must arrive intact in both modes.
+// make TEST=slowreaders && ./output/slowreaders.elf
+static constexpr uint16_t kPort = 19116;
+static constexpr int kWanted = 10000;
+static constexpr size_t kPayload = 64 * 1024;
+static constexpr int kReceiveBuffer = 4096;
+
+static std::atomic<int> g_answered{0};
+
+static long residentBytes()
+{
+    long pages = 0;
+    FILE* f = ::fopen("/proc/self/statm", "r");
+    if(f == nullptr || ::fscanf(f, "%*ld %ld", &pages) != 1)
+    {
+        perror("statm");
+        exit(EXIT_FAILURE);
+    }
+    ::fclose(f);
+    return pages * ::sysconf(_SC_PAGESIZE);
+}
+static int connectionLimit(int wanted)
+{
+    rlimit limit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    // both ends live in this process, plus some for the loops
+    long fit = (static_cast<long>(limit.rlim_cur) - 64) / 2;
+    return static_cast<int>(std::min<long>(wanted, fit));
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        // before connect, so the window never opens wider
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kReceiveBuffer, sizeof(kReceiveBuffer));
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static TcpServer* startServer(uint16_t port, bool shared)
+{
+    static std::atomic<TcpServer*> started{nullptr};
+    started = nullptr;
+    std::thread([port, shared]{
+        auto payload = std::make_shared<const std::string>([]{
+            std::string s(kPayload, '\0');
+            for(size_t i = 0; i < kPayload; i++)
+            {
+                s[i] = static_cast<char>(i);
+            }
+            return s;
+        }());
+        TcpServer server(port, 1);
+        server.setMessageCallback([payload, shared](const TcpServer::ptrConnection& conn, Buffer* buf){
+            buf->moveReadIdx(buf->readableSize());
+            if(shared)
+            {
+                conn->send(payload);
+            }
+            else
+            {
+                conn->send(payload->data(), payload->size());
+            }
+            g_answered++;
+        });
+        started = &server;
+        server.start();
+    }).detach();
+    ::close(connectServer(port));
+    while(started == nullptr)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return started;
+}
+
+static size_t poolInUse(TcpServer* server, size_t* highWater)
+{
+    size_t inUse = 0;
+    *highWater = 0;
+    for(const BufferPool::Stats& stats : server->bufferStats())
+    {
+        inUse += stats.inUse;
+        *highWater += stats.highWater;
+    }
+    return inUse;
+}
+
+static bool run(uint16_t port, bool shared, int conns, size_t* held)
+{
+    TcpServer* server = startServer(port, shared);
+    g_answered = 0;
+    long rssStart = residentBytes();
+    std::vector<int> fds;
+    for(int i = 0; i < conns; i++)
+    {
+        int fd = connectServer(port);
+        char c = 'G';
+        if(::write(fd, &c, 1) != 1)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        fds.push_back(fd);
+    }
+    while(g_answered < conns)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    size_t highWater;
+    size_t inUse = poolInUse(server, &highWater);
+    *held = inUse;
+    long rss = residentBytes() - rssStart;
+
+    std::vector<pollfd> pfds;
+    for(int fd : fds)
+    {
+        pfds.push_back(pollfd{fd, POLLIN, 0});
+    }
+    std::vector<size_t> got(conns, 0);
+    std::vector<char> data(kPayload);
+    bool intact = true;
+    int done = 0;
+    auto start = std::chrono::steady_clock::now();
+    while(done < conns && intact)
+    {
+        if(::poll(pfds.data(), pfds.size(), 2000) <= 0)
+        {
+            intact = false;
+            break;
+        }
+        for(int i = 0; i < conns; i++)
+        {
+            if(!(pfds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            ssize_t n = ::recv(pfds[i].fd, data.data(), kPayload - got[i], MSG_DONTWAIT);
+            if(n <= 0)
+            {
+                intact = false;
+                break;
+            }
+            for(ssize_t j = 0; j < n; j++)
+            {
+                intact = intact && data[j] == static_cast<char>(got[i] + j);
+            }
+            got[i] += n;
+            if(got[i] == kPayload)
+            {
+                pfds[i].fd = -1;
+                done++;
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for(int fd : fds)
+    {
+        ::close(fd);
+    }
+    double mb = static_cast<double>(conns) * kPayload / (1024.0 * 1024.0);
+    printf("%s: %zu KB pool in use (%zu KB peak), rss +%ld KB while stalled, drained %.0f MB at %.0f MB/s, %s\n",
+           shared ? "shared" : "copied", inUse / 1024, highWater / 1024, rss / 1024, mb, mb / seconds,
+           intact ? "intact" : "broken");
+    return intact && done == conns;
+}
+
+int main()
+{
+    int conns = connectionLimit(kWanted);
+    printf("%d slow readers of %zu KB with a %d byte receive buffer\n", conns, kPayload / 1024, kReceiveBuffer);
+    size_t copied;
+    size_t shared;
+    bool ok = run(kPort, false, conns, &copied);
+    ok = run(kPort + 1, true, conns, &shared) && ok;
+    // the shared payload is queued by reference, what remains is the input buffers
+    ok = ok && shared * 10 < copied;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
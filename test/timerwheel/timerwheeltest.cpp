@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include "eventloop.hpp"
+
+// Timer wheel checks on a bare loop: expiry order and accuracy across root block cascades
+// in real time; the upper levels, parking past kMaxSpan and re-filing by moving the loop's
+// clock ahead; refresh, cancel, and cancel from a timer's own callback; the id API's
+// timeout in seconds; then 1M timers added, refreshed and cancelled on the loop thread.
+// The wheel reads CLOCK_MONOTONIC through clock_gettime and arms its timerfd in absolute
+// CLOCK_MONOTONIC time. Both are defined below on top of the libc versions and shifted by
+// g_skewMs, which lets the test skip hours of wheel time without waiting for them.
+// make TEST=timerwheel && ./output/timerwheel.elf
+static constexpr int kOrderTimers = 2000;
+static constexpr uint64_t kOrderSpan = 2000;    // ms, eight root blocks
+static constexpr uint64_t kSlackMs = 50;        // allowed lateness of a timer
+static constexpr uint64_t kLeadMs = 20;         // a skip stops this far before the next timer
+static constexpr int kBenchTimers = 1000000;
+
+static std::atomic<int64_t> g_skewMs{0};
+static std::mutex g_clockMutex;
+static int g_timerfd = -1;         // the last timerfd armed in absolute time, and for when
+static itimerspec g_deadline;
+
+using settimeFn = int (*)(int, int, const itimerspec*, itimerspec*);
+
+extern "C" int clock_gettime(clockid_t clock, timespec* ts) noexcept
+{
+    using clockFn = int (*)(clockid_t, timespec*);
+    static clockFn real = reinterpret_cast<clockFn>(::dlsym(RTLD_NEXT, "clock_gettime"));
+    int ret = real(clock, ts);
+    int64_t skew = g_skewMs.load(std::memory_order_relaxed);
+    if(ret == 0 && clock == CLOCK_MONOTONIC && skew > 0)
+    {
+        int64_t nsec = ts->tv_nsec + skew % 1000 * 1000000;
+        ts->tv_sec += skew / 1000 + nsec / 1000000000;
+        ts->tv_nsec = nsec % 1000000000;
+    }
+    return ret;
+}
+
+// with g_clockMutex held
+static int setShifted(int fd, int flags, const itimerspec* value, itimerspec* old)
+{
+    static settimeFn real = reinterpret_cast<settimeFn>(::dlsym(RTLD_NEXT, "timerfd_settime"));
+    itimerspec shifted = *value;
+    bool armed = value->it_value.tv_sec != 0 || value->it_value.tv_nsec != 0;
+    if((flags & TFD_TIMER_ABSTIME) && armed)
+    {
+        int64_t ms = value->it_value.tv_sec * 1000LL + value->it_value.tv_nsec / 1000000 - g_skewMs.load();
+        // a deadline still has to fire when the skew moves it before boot, zero would disarm
+        ms = std::max<int64_t>(ms, 1);
+        shifted.it_value.tv_sec = ms / 1000;
+        shifted.it_value.tv_nsec = ms % 1000 * 1000000;
+        g_timerfd = fd;
+        g_deadline = *value;
+    }
+    return real(fd, flags, &shifted, old);
+}
+
+extern "C" int timerfd_settime(int fd, int flags, const itimerspec* value, itimerspec* old) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_clockMutex);
+    return setShifted(fd, flags, value, old);
+}
+
+// moves the clock ahead by ms; the armed timerfd follows, as an absolute CLOCK_MONOTONIC
+// timer does when the clock jumps
+static void skipClock(int64_t ms)
+{
+    std::lock_guard<std::mutex> lock(g_clockMutex);
+    g_skewMs += ms;
+    if(g_timerfd != -1)
+    {
+        itimerspec deadline = g_deadline;
+        setShifted(g_timerfd, TFD_TIMER_ABSTIME, &deadline, nullptr);
+    }
+}
+
+// runs fn on the loop thread and waits for it
+template <typename F>
+static void onLoop(EventLoop* loop, F fn)
+{
+    std::promise<void> done;
+    loop->runInLoop([&]{
+        fn();
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+static std::chrono::steady_clock::time_point atMs(uint64_t ms)
+{
+    return std::chrono::steady_clock::time_point(std::chrono::milliseconds(ms));
+}
+
+// timers with the given deadlines, recording when and in which order they fire
+struct Batch
+{
+    std::vector<uint64_t> deadlines;
+    std::vector<uint64_t> firedAt;
+    std::vector<int> order;                 // loop thread only
+    std::atomic<int> fired{0};
+
+    void add(EventLoop* loop)
+    {
+        firedAt.assign(deadlines.size(), 0);
+        for(size_t i = 0; i < deadlines.size(); i++)
+        {
+            loop->runAt(atMs(deadlines[i]), [this, i]{
+                firedAt[i] = TimerWheel::monotonicMs();
+                order.push_back(static_cast<int>(i));
+                fired++;
+            });
+        }
+    }
+    bool waitFired(int count, uint64_t timeoutMs)
+    {
+        for(uint64_t waited = 0; fired.load() < count && waited < timeoutMs; waited++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return fired.load() >= count;
+    }
+    // call with the loop idle: every timer fired, none early or more than kSlackMs late,
+    // in deadline order
+    bool check(const char* name, EventLoop* loop)
+    {
+        bool ok = true;
+        uint64_t late = 0;
+        int misordered = 0;
+        onLoop(loop, [&]{
+            ok = order.size() == deadlines.size();
+            for(size_t i = 0; i < deadlines.size(); i++)
+            {
+                if(firedAt[i] < deadlines[i])
+                {
+                    ok = false;
+                }
+                else
+                {
+                    late = std::max(late, firedAt[i] - deadlines[i]);
+                }
+            }
+            for(size_t i = 1; i < order.size(); i++)
+            {
+                misordered += deadlines[order[i]] < deadlines[order[i - 1]] ? 1 : 0;
+            }
+        });
+        ok = ok && late <= kSlackMs && misordered == 0;
+        printf("%-8s %d/%zu fired, max %llu ms late, %d out of order\n", name, fired.load(), deadlines.size(),
+               static_cast<unsigned long long>(late), misordered);
+        return ok;
+    }
+};
+
+// real time: random deadlines over a few root blocks, each cascaded down from level 1
+static bool checkOrder(EventLoop* loop)
+{
+    Batch batch;
+    std::mt19937 rng(1);
+    onLoop(loop, [&]{
+        uint64_t base = TimerWheel::monotonicMs();
+        for(int i = 0; i < kOrderTimers; i++)
+        {
+            batch.deadlines.push_back(base + rng() % kOrderSpan);
+        }
+        batch.add(loop);
+    });
+    batch.waitFired(kOrderTimers, kOrderSpan + 1000);
+    return batch.check("order", loop);
+}
+
+// skewed time: deadlines on both sides of every level's span and past kMaxSpan, where
+// timers park in the last level and are re-filed each time it cascades. The clock skips
+// to just before each deadline and the timer must still fire on time
+static bool checkLevels(EventLoop* loop)
+{
+    const uint64_t delays[] = {
+        255, 256, 257,
+        (1 << 14) - 1, 1 << 14, (1 << 14) + 1,
+        (1 << 20) - 1, 1 << 20, (1 << 20) + 1,
+        TimerWheel::kMaxSpan - 1, TimerWheel::kMaxSpan, TimerWheel::kMaxSpan + 1,
+        3 * TimerWheel::kMaxSpan + 12345,
+    };
+    Batch batch;
+    onLoop(loop, [&]{
+        uint64_t base = TimerWheel::monotonicMs();
+        for(uint64_t delay : delays)
+        {
+            batch.deadlines.push_back(base + delay);
+        }
+        batch.add(loop);
+    });
+    for(size_t i = 0; i < batch.deadlines.size(); i++)
+    {
+        int64_t skip = static_cast<int64_t>(batch.deadlines[i] - kLeadMs) - static_cast<int64_t>(TimerWheel::monotonicMs());
+        if(skip > 0)
+        {
+            skipClock(skip);
+        }
+        if(!batch.waitFired(static_cast<int>(i) + 1, 1000))
+        {
+            break;
+        }
+    }
+    return batch.check("levels", loop);
+}
+
+static bool checkRefreshCancel(EventLoop* loop)
+{
+    using std::chrono::milliseconds;
+    std::atomic<uint64_t> refreshedAt{0};
+    std::atomic<int> cancelledRuns{0};
+    std::atomic<int> replacedRuns{0};
+    std::atomic<int> replacementRuns{0};
+    std::atomic<int> selfCancelRuns{0};
+    std::atomic<int> oneShotRuns{0};
+    TimerId self;
+    uint64_t start = TimerWheel::monotonicMs();
+    loop->runAfter(1, milliseconds(300), [&]{refreshedAt = TimerWheel::monotonicMs();});
+    loop->runAfter(2, milliseconds(100), [&]{cancelledRuns++;});
+    loop->removeAfter(2);
+    TimerId handle = loop->runAfter(milliseconds(100), [&]{cancelledRuns++;});
+    loop->cancel(handle);
+    loop->runAfter(3, milliseconds(100), [&]{replacedRuns++;});
+    loop->runAfter(3, milliseconds(150), [&]{replacementRuns++;});
+    onLoop(loop, [&]{
+        // set before the first run, which can't come while this task holds the loop
+        self = loop->runEvery(milliseconds(10), [&]{
+            if(++selfCancelRuns == 3)
+            {
+                loop->cancel(self);
+            }
+        });
+    });
+    TimerId oneShot;
+    onLoop(loop, [&]{
+        oneShot = loop->runAfter(milliseconds(10), [&]{
+            oneShotRuns++;
+            loop->cancel(oneShot);
+        });
+    });
+    std::this_thread::sleep_for(milliseconds(200));
+    uint64_t refreshed = TimerWheel::monotonicMs();
+    loop->refreshAfter(1);
+    std::this_thread::sleep_for(milliseconds(300 + kSlackMs + 100));
+    bool pending = true;
+    onLoop(loop, [&]{pending = loop->hasAfter(1) || loop->hasAfter(2) || loop->hasAfter(3);});
+    uint64_t fired = refreshedAt.load();
+    bool ok = fired >= refreshed + 300 && fired <= refreshed + 300 + kSlackMs && cancelledRuns == 0 &&
+              replacedRuns == 0 && replacementRuns == 1 && selfCancelRuns == 3 && oneShotRuns == 1 && !pending;
+    printf("refresh  fired %llu ms after adding (refreshed at %llu ms), cancelled %d runs, replaced %d/%d runs, "
+           "self-cancelled after %d runs, one-shot %d runs\n",
+           static_cast<unsigned long long>(fired - start), static_cast<unsigned long long>(refreshed - start),
+           cancelledRuns.load(), replacedRuns.load(), replacementRuns.load(), selfCancelRuns.load(), oneShotRuns.load());
+    return ok;
+}
+
+// the id API also takes whole seconds, as TcpServer::runAfter(uint64_t, task) does
+static bool checkSeconds(EventLoop* loop)
+{
+    std::atomic<uint64_t> firedAt{0};
+    uint64_t start = TimerWheel::monotonicMs();
+    loop->runAfter(4, uint64_t(1), [&]{firedAt = TimerWheel::monotonicMs();});
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000 + kSlackMs + 100));
+    uint64_t fired = firedAt.load();
+    bool ok = fired >= start + 1000 && fired <= start + 1000 + kSlackMs;
+    printf("seconds  1 s timer fired after %lld ms\n", fired == 0 ? -1LL : static_cast<long long>(fired - start));
+    return ok;
+}
+
+// the id API connections use for inactivity release, run where they call it: the loop thread.
+// The first round grows the node pool, the second one recycles it
+static bool benchmark(EventLoop* loop)
+{
+    using clock = std::chrono::steady_clock;
+    std::mt19937 rng(2);
+    std::vector<std::chrono::milliseconds> delays;
+    for(int i = 0; i < kBenchTimers; i++)
+    {
+        delays.emplace_back(1000 + rng() % 60000);
+    }
+    bool ok = true;
+    for(const char* round : {"cold", "warm"})
+    {
+        double addNs = 0;
+        double refreshNs = 0;
+        double cancelNs = 0;
+        onLoop(loop, [&]{
+            clock::time_point t0 = clock::now();
+            for(int i = 0; i < kBenchTimers; i++)
+            {
+                loop->runAfter(i + 1, delays[i], []{});
+            }
+            clock::time_point t1 = clock::now();
+            for(int i = 0; i < kBenchTimers; i++)
+            {
+                loop->refreshAfter(i + 1);
+            }
+            clock::time_point t2 = clock::now();
+            for(int i = 0; i < kBenchTimers; i++)
+            {
+                loop->removeAfter(i + 1);
+            }
+            clock::time_point t3 = clock::now();
+            addNs = std::chrono::duration<double, std::nano>(t1 - t0).count() / kBenchTimers;
+            refreshNs = std::chrono::duration<double, std::nano>(t2 - t1).count() / kBenchTimers;
+            cancelNs = std::chrono::duration<double, std::nano>(t3 - t2).count() / kBenchTimers;
+            ok = ok && !loop->hasAfter(1) && !loop->hasAfter(kBenchTimers);
+        });
+        printf("bench    %d timers, %s: add %.0f ns, refresh %.0f ns, cancel %.0f ns per timer\n", kBenchTimers,
+               round, addNs, refreshNs, cancelNs);
+    }
+    return ok;
+}
+
+int main()
+{
+    // the loop thread never returns
+    EventLoop* loop = (new LoopThread())->getLoop();
+    bool ok = checkOrder(loop);
+    ok = checkLevels(loop) && ok;
+    ok = checkRefreshCancel(loop) && ok;
+    ok = checkSeconds(loop) && ok;
+    ok = benchmark(loop) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the loop thread never returns, skip static destructors it may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tcpserver.hpp"
+
+// Large borrowed sends with and without MSG_ZEROCOPY. The server queues kSends borrowed
+// kPayload blocks on one connection, the client reads and checks them. Every block must be
+// released exactly once, including the ones pinned until their zerocopy completion.
+// Reported: MB/s, the worker loop's CPU time per GB and how many sendmsg calls carried
+// MSG_ZEROCOPY. Loopback can't avoid the copy: the kernel says so in the first
+// completions and the connection falls back to ordinary sends, so the CPU saving itself
+// only shows on a real NIC.
+// make TEST=zerocopy && ./output/zerocopy.elf
+static constexpr uint16_t kPort = 19120;
+static constexpr size_t kPayload = 1024 * 1024;
+static constexpr int kSends = 1024;
+
+static std::vector<char> g_payload;
+static std::atomic<int> g_released{0};
+static std::atomic<uint64_t> g_zeroCopySends{0};
+static std::atomic<bool> g_haveWorker{false};
+static pthread_t g_worker;
+
+extern "C" ssize_t sendmsg(int fd, const msghdr* msg, int flags)
+{
+    using sendmsgFn = ssize_t (*)(int, const msghdr*, int);
+    static sendmsgFn real = reinterpret_cast<sendmsgFn>(::dlsym(RTLD_NEXT, "sendmsg"));
+    ssize_t n = real(fd, msg, flags);
+    if((flags & MSG_ZEROCOPY) && n > 0)
+    {
+        g_zeroCopySends++;
+    }
+    return n;
+}
+
+static int connectServer(uint16_t port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    perror("connect");
+    exit(EXIT_FAILURE);
+}
+
+static double threadCpu(pthread_t thread)
+{
+    clockid_t clock;
+    timespec ts{};
+    if(::pthread_getcpuclockid(thread, &clock) != 0 || ::clock_gettime(clock, &ts) != 0)
+    {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void startServer(uint16_t port, bool zeroCopy)
+{
+    g_haveWorker = false;
+    std::thread([port, zeroCopy]{
+        TcpServer server(port, 1);
+        if(zeroCopy)
+        {
+            server.enableZeroCopy();
+        }
+        server.setConnectedCallback([](const TcpServer::ptrConnection&){
+            if(!g_haveWorker)
+            {
+                g_worker = ::pthread_self();
+                g_haveWorker = true;
+            }
+        });
+        server.setMessageCallback([](const TcpServer::ptrConnection& conn, Buffer* buf){
+            buf->moveReadIdx(buf->readableSize());
+            for(int i = 0; i < kSends; i++)
+            {
+                conn->sendBorrowed(g_payload.data(), g_payload.size(), []{g_released++;});
+            }
+        });
+        server.start();
+    }).detach();
+    ::close(connectServer(port));
+    while(!g_haveWorker)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static bool run(uint16_t port, bool zeroCopy)
+{
+    startServer(port, zeroCopy);
+    g_released = 0;
+    uint64_t zeroCopySends = g_zeroCopySends;
+    int fd = connectServer(port);
+    double cpuStart = threadCpu(g_worker);
+    auto start = std::chrono::steady_clock::now();
+    bool intact = ::write(fd, "G", 1) == 1;
+    std::vector<char> data(256 * 1024);
+    size_t total = kPayload * kSends;
+    size_t got = 0;
+    while(intact && got < total)
+    {
+        ssize_t n = ::read(fd, data.data(), std::min(data.size(), total - got));
+        if(n <= 0)
+        {
+            intact = false;
+            break;
+        }
+        // reads never straddle two blocks: both sizes divide kPayload
+        size_t offset = got % kPayload;
+        size_t first = std::min<size_t>(n, kPayload - offset);
+        intact = std::memcmp(data.data(), g_payload.data() + offset, first) == 0 &&
+                 std::memcmp(data.data() + first, g_payload.data(), n - first) == 0;
+        got += n;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = threadCpu(g_worker) - cpuStart;
+    for(int i = 0; i < 200 && g_released < kSends; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    ::close(fd);
+    double gb = total / double(1 << 30);
+    printf("%s: %.0f MB/s, %.0f ms worker cpu per GB, %lu MSG_ZEROCOPY sends, %d/%d blocks released, data %s\n",
+           zeroCopy ? "zerocopy" : "copy    ", gb * 1024 / seconds, cpu * 1000 / gb,
+           g_zeroCopySends - zeroCopySends, g_released.load(), kSends, intact ? "intact" : "broken");
+    bool used = !zeroCopy || g_zeroCopySends > zeroCopySends;
+    return intact && g_released == kSends && used;
+}
+
+int main()
+{
+    g_payload.resize(kPayload);
+    for(size_t i = 0; i < kPayload; i++)
+    {
+        g_payload[i] = static_cast<char>(i * 7 + i / 4096);
+    }
+    bool ok = run(kPort, false);
+    ok = run(kPort + 1, true) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // the server threads never return, skip static destructors they may still be using
+    ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}